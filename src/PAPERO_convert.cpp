@@ -9,11 +9,13 @@
 #include <CLI/CLI.hpp>
 
 #include "PAPERO.h"
+#include "instrument.h"
 
 #define max_detectors 16
 
 int main(int argc, char *argv[])
 {
+    INSTRUMENT_PROGRAM("PAPERO_convert");
     CLI::App app{"PAPERO_convert"};
 
     bool verbose = false;
@@ -155,7 +157,9 @@ int main(int argc, char *argv[])
         }
 
         is_good = false;
+        INSTRUMENT_LAP(lap);
         maka_retValues = read_evt_header(file, offset, verbose);
+        INSTRUMENT_STAGE(lap, "headers");
         if (std::get<0>(maka_retValues))
         {
             offset = std::get<7>(maka_retValues);
@@ -163,6 +167,7 @@ int main(int argc, char *argv[])
             {
                 de10_retValues = read_de10_header(file, offset, verbose); // read de10 header
                 is_good = std::get<0>(de10_retValues);
+                INSTRUMENT_STAGE(lap, "headers");
 
                 if (is_good)
                 {
@@ -203,6 +208,7 @@ int main(int argc, char *argv[])
                         raw_event_buffer.clear();
                         raw_event_buffer = reorder(read_event(file, offset, evt_size, verbose, false));
                     }
+                    INSTRUMENT_STAGE(lap, "decode");
 
                     if (!gsi)
                     {
@@ -223,12 +229,14 @@ int main(int argc, char *argv[])
                         raw_event_vector.at(2 * detector_ids_map.at(board_id)) = raw_event_buffer;
                         raw_events_tree.at(2 * detector_ids_map.at(board_id))->Fill();
                     }
+                    INSTRUMENT_STAGE(lap, "tree fill");
 
                     offset += evt_size * 4 + 8 + 36; // 8 is the size of the de10 footer + crc, 36 is the size of the de10 header
                 }
             }
             boards_read = 0;
             evtnum++;
+            INSTRUMENT_EVENTS(1);
         }
         else
         {
@@ -237,6 +245,7 @@ int main(int argc, char *argv[])
     }
 
     std::cout << "\n\tClosing file after " << std::dec << evtnum << " events" << std::endl;
+    INSTRUMENT_LAP(write);
     int filled = 0;
 
     for (size_t detector = 0; detector < raw_events_tree.size(); detector++)
@@ -261,6 +270,7 @@ int main(int argc, char *argv[])
     }
 
     foutput->Close();
+    INSTRUMENT_STAGE(write, "write");
     file.close();
     return 0;
 }
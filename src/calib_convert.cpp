@@ -0,0 +1,51 @@
+#include "calib_io.h"
+
+#include <CLI/CLI.hpp>
+
+int main(int argc, char *argv[])
+{
+  bool verb = false;
+  bool to_ascii = false;
+  std::string input;
+  std::string output;
+
+  CLI::App app{"calib_convert"};
+  app.set_help_all_flag("--help-all", "Show all help");
+
+  app.add_flag("-v,--verbose", verb, "Verbose");
+  app.add_flag("--ascii", to_ascii, "Write an ASCII .cal also from an ASCII input (default: the opposite format of the input)");
+  app.add_option("input", input, "Input calibration file (ASCII .cal or binary .calb)")->required();
+  app.add_option("output", output, "Output calibration file")->required();
+
+  CLI11_PARSE(app, argc, argv);
+
+  std::vector<calib> cals;
+  std::vector<std::string> headers;
+
+  bool binary_input = is_binary_calib(input.c_str());
+  bool ok = binary_input ? read_calib_binary(input.c_str(), cals, &headers, verb)
+                         : read_calib_ascii(input.c_str(), cals, &headers, verb);
+  if (!ok || cals.empty())
+  {
+    std::cout << "ERROR: could not read calibration file " << input << std::endl;
+    return 1;
+  }
+
+  if (binary_input || to_ascii)
+  {
+    ok = write_calib_ascii(output.c_str(), cals, headers);
+  }
+  else
+  {
+    ok = write_calib_binary(output.c_str(), cals, headers);
+  }
+  if (!ok)
+  {
+    std::cout << "ERROR: could not write calibration file " << output << std::endl;
+    return 1;
+  }
+
+  std::cout << "Converted " << cals.size() << " detector(s) from " << input << " to "
+            << (binary_input || to_ascii ? "ASCII " : "binary ") << output << std::endl;
+  return 0;
+}
@@ -0,0 +1,346 @@
+#include "calib_io.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+  uint64_t fnv1a(const char *data, size_t size)
+  {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+      hash ^= (unsigned char)data[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  size_t pad8(size_t size) { return (size + 7) & ~(size_t)7; }
+
+  std::string default_header()
+  {
+    std::string header;
+    const char *keys[] = {"temp_SN", "temp_SN", "name", "location", "bias_volt", "leak_curr",
+                          "6v_curr", "3v_curr", "starting_time", "temp_right", "temp_left", "hold_delay",
+                          "sigmaraw_cut", "sigmaraw_noise_cut", "sigma_cut", "sigma_noise_cut", "sigma_k", "occupancy_k"};
+    for (const char *key : keys)
+    {
+      header += std::string("#") + key + "= NC\n";
+    }
+    return header;
+  }
+}
+
+mapped_calib::mapped_calib(const char *calib_file, bool verb)
+{
+  int fd = open(calib_file, O_RDONLY);
+  if (fd < 0)
+  {
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(calib_file_header))
+  {
+    close(fd);
+    return;
+  }
+  size = st.st_size;
+
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return;
+  }
+  data = (const char *)map;
+
+  const calib_file_header *h = header();
+  if (memcmp(h->magic, CALIB_MAGIC, sizeof(h->magic)) != 0 || h->version != CALIB_VERSION)
+  {
+    std::cout << "ERROR: " << calib_file << " is not a version " << CALIB_VERSION << " binary calibration" << std::endl;
+    return;
+  }
+  if (h->payload_size != size - sizeof(calib_file_header) ||
+      h->ndetectors * sizeof(calib_index_entry) > h->payload_size)
+  {
+    std::cout << "ERROR: " << calib_file << " is truncated" << std::endl;
+    return;
+  }
+  if (fnv1a(data + sizeof(calib_file_header), h->payload_size) != h->checksum)
+  {
+    std::cout << "ERROR: checksum mismatch in " << calib_file << std::endl;
+    return;
+  }
+
+  for (uint32_t det = 0; det < h->ndetectors; det++)
+  {
+    const calib_index_entry &entry = index()[det];
+    uint64_t end = entry.offset + pad8(entry.header_size) + (3 * sizeof(float) + sizeof(uint32_t)) * (uint64_t)entry.nchannels;
+    if (entry.offset % 8 || end > size)
+    {
+      std::cout << "ERROR: bad index entry for detector " << det << " in " << calib_file << std::endl;
+      return;
+    }
+  }
+
+  if (verb)
+  {
+    std::cout << "Mapped binary calibration " << calib_file << " with " << h->ndetectors << " detectors" << std::endl;
+  }
+  good = true;
+}
+
+mapped_calib::~mapped_calib()
+{
+  if (data)
+  {
+    munmap((void *)data, size);
+  }
+}
+
+calib_view mapped_calib::view(int detector) const
+{
+  calib_view v;
+  if (!good || detector < 0 || detector >= (int)header()->ndetectors)
+  {
+    return v;
+  }
+
+  const calib_index_entry &entry = index()[detector];
+  const char *arrays = data + entry.offset + pad8(entry.header_size);
+  v.nchannels = entry.nchannels;
+  v.ped = (const float *)arrays;
+  v.rsig = v.ped + entry.nchannels;
+  v.sig = v.rsig + entry.nchannels;
+  v.status = (const uint32_t *)(v.sig + entry.nchannels);
+  return v;
+}
+
+std::string mapped_calib::text_header(int detector) const
+{
+  if (!good || detector < 0 || detector >= (int)header()->ndetectors)
+  {
+    return "";
+  }
+  const calib_index_entry &entry = index()[detector];
+  return std::string(data + entry.offset, entry.header_size);
+}
+
+bool is_binary_calib(const char *calib_file)
+{
+  std::ifstream in(calib_file, std::ios::binary);
+  char magic[8];
+  return in.read(magic, sizeof(magic)) && memcmp(magic, CALIB_MAGIC, sizeof(magic)) == 0;
+}
+
+bool read_calib_ascii(const char *calib_file, std::vector<calib> &cals, std::vector<std::string> *headers, bool verb)
+{
+  std::ifstream in(calib_file, std::ios::binary);
+  if (!in.is_open())
+  {
+    return false;
+  }
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+  cals.clear();
+  if (headers)
+  {
+    headers->clear();
+  }
+
+  std::string header;
+  bool in_block = false;
+  size_t pos = 0;
+  while (pos < text.size())
+  {
+    size_t eol = text.find('\n', pos);
+    if (eol == std::string::npos)
+    {
+      eol = text.size();
+    }
+
+    if (text[pos] == '#')
+    {
+      if (in_block) // a header after data starts a new detector
+      {
+        header.clear();
+        in_block = false;
+      }
+      header.append(text, pos, eol - pos + 1);
+    }
+    else if (eol > pos)
+    {
+      if (!in_block)
+      {
+        cals.emplace_back();
+        if (headers)
+        {
+          headers->push_back(header);
+        }
+        in_block = true;
+      }
+
+      // strip, va, va channel, ped, raw sigma, sigma, status, not used
+      const char *p = text.c_str() + pos;
+      char *end;
+      float values[8];
+      int nvalues = 0;
+      for (; nvalues < 8; nvalues++)
+      {
+        values[nvalues] = strtof(p, &end);
+        if (end == p)
+        {
+          break;
+        }
+        p = end;
+        while (*p == ',' || *p == ' ' || *p == '\t')
+        {
+          p++;
+        }
+      }
+      if (nvalues < 7)
+      {
+        std::cout << "ERROR: malformed line in " << calib_file << ": " << text.substr(pos, eol - pos) << std::endl;
+        return false;
+      }
+
+      calib &cal = cals.back();
+      cal.ped.push_back(values[3]);
+      cal.rsig.push_back(values[4]);
+      cal.sig.push_back(values[5]);
+      cal.status.push_back(values[6]);
+    }
+    pos = eol + 1;
+  }
+
+  if (verb)
+  {
+    for (size_t det = 0; det < cals.size(); det++)
+    {
+      std::cout << "Read " << cals[det].ped.size() << " channels for detector " << det << " from calib file" << std::endl;
+    }
+  }
+  return true;
+}
+
+bool read_calib_binary(const char *calib_file, std::vector<calib> &cals, std::vector<std::string> *headers, bool verb)
+{
+  mapped_calib mapped(calib_file, verb);
+  if (!mapped.ok())
+  {
+    return false;
+  }
+
+  cals.assign(mapped.detectors(), calib());
+  if (headers)
+  {
+    headers->clear();
+  }
+  for (int det = 0; det < mapped.detectors(); det++)
+  {
+    calib_view v = mapped.view(det);
+    cals[det].ped.assign(v.ped, v.ped + v.nchannels);
+    cals[det].rsig.assign(v.rsig, v.rsig + v.nchannels);
+    cals[det].sig.assign(v.sig, v.sig + v.nchannels);
+    cals[det].status.assign(v.status, v.status + v.nchannels);
+    if (headers)
+    {
+      headers->push_back(mapped.text_header(det));
+    }
+  }
+  return true;
+}
+
+bool write_calib_ascii(const char *calib_file, const std::vector<calib> &cals, const std::vector<std::string> &headers)
+{
+  std::ofstream calfile(calib_file);
+  if (!calfile.is_open())
+  {
+    return false;
+  }
+
+  for (size_t det = 0; det < cals.size(); det++)
+  {
+    if (det < headers.size() && !headers[det].empty())
+    {
+      calfile << headers[det];
+    }
+    else
+    {
+      calfile << default_header();
+    }
+
+    // same layout as the calibration executable
+    const calib &cal = cals[det];
+    for (size_t ch = 0; ch < cal.ped.size(); ch++)
+    {
+      calfile << ch << ", " << ch / 64 << ", " << ch % 64
+              << ", " << cal.ped[ch] << ", " << cal.rsig[ch] << ", " << cal.sig[ch]
+              << ", " << cal.status[ch] << ", "
+              << "0.000"
+              << "\n";
+    }
+  }
+  return calfile.good();
+}
+
+bool write_calib_binary(const char *calib_file, const std::vector<calib> &cals, const std::vector<std::string> &headers)
+{
+  std::vector<calib_index_entry> index(cals.size());
+  uint64_t offset = sizeof(calib_file_header) + pad8(cals.size() * sizeof(calib_index_entry));
+  for (size_t det = 0; det < cals.size(); det++)
+  {
+    index[det].detector = det;
+    index[det].nchannels = cals[det].ped.size();
+    index[det].offset = offset;
+    index[det].header_size = det < headers.size() ? headers[det].size() : 0;
+    index[det].reserved = 0;
+    offset += pad8(index[det].header_size) + (3 * sizeof(float) + sizeof(uint32_t)) * index[det].nchannels;
+  }
+
+  std::vector<char> file(offset, 0);
+  char *payload = file.data() + sizeof(calib_file_header);
+  memcpy(payload, index.data(), index.size() * sizeof(calib_index_entry));
+  for (size_t det = 0; det < cals.size(); det++)
+  {
+    const calib &cal = cals[det];
+    size_t nchannels = index[det].nchannels;
+    if (cal.rsig.size() != nchannels || cal.sig.size() != nchannels || cal.status.size() != nchannels)
+    {
+      std::cout << "ERROR: inconsistent calibration arrays for detector " << det << std::endl;
+      return false;
+    }
+
+    char *block = file.data() + index[det].offset;
+    if (index[det].header_size)
+    {
+      memcpy(block, headers[det].data(), index[det].header_size);
+    }
+    float *arrays = (float *)(block + pad8(index[det].header_size));
+    memcpy(arrays, cal.ped.data(), nchannels * sizeof(float));
+    memcpy(arrays + nchannels, cal.rsig.data(), nchannels * sizeof(float));
+    memcpy(arrays + 2 * nchannels, cal.sig.data(), nchannels * sizeof(float));
+    uint32_t *status = (uint32_t *)(arrays + 3 * nchannels);
+    for (size_t ch = 0; ch < nchannels; ch++)
+    {
+      status[ch] = cal.status[ch];
+    }
+  }
+
+  calib_file_header h;
+  memcpy(h.magic, CALIB_MAGIC, sizeof(h.magic));
+  h.version = CALIB_VERSION;
+  h.ndetectors = cals.size();
+  h.payload_size = file.size() - sizeof(calib_file_header);
+  h.checksum = fnv1a(payload, h.payload_size);
+  memcpy(file.data(), &h, sizeof(h));
+
+  std::ofstream out(calib_file, std::ios::binary);
+  out.write(file.data(), file.size());
+  return out.good();
+}
@@ -0,0 +1,84 @@
+#ifndef CALIB_IO_H_
+#define CALIB_IO_H_
+
+#include "event.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary calibration container (.calb), little endian:
+//
+//   calib_file_header
+//   calib_index_entry[ndetectors]
+//   per detector, at index.offset (8 byte aligned):
+//     text header (the '#' lines of the ASCII block), padded to 8 bytes
+//     float ped[nchannels], float rsig[nchannels], float sig[nchannels], uint32_t status[nchannels]
+//
+// status keeps the ASCII status word, so miniTRB flag bits survive the conversion.
+// checksum is the 64 bit FNV-1a hash of everything after calib_file_header
+
+#define CALIB_MAGIC "PGMSDCAL"
+#define CALIB_VERSION 1
+
+struct calib_file_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t ndetectors;
+  uint64_t payload_size; // bytes after this header
+  uint64_t checksum;
+};
+
+struct calib_index_entry
+{
+  uint32_t detector;  // detector number (2 * board + side)
+  uint32_t nchannels;
+  uint64_t offset;      // start of the detector block, from the beginning of the file
+  uint32_t header_size; // text header bytes, without padding
+  uint32_t reserved;
+};
+
+struct calib_view
+{
+  int nchannels = 0;
+  const float *ped = nullptr;
+  const float *rsig = nullptr;
+  const float *sig = nullptr;
+  const uint32_t *status = nullptr;
+}; // arrays of one detector, pointing into the mapped file
+
+class mapped_calib
+{
+public:
+  explicit mapped_calib(const char *calib_file, bool verb = false); // maps the file and checks header and checksum
+  ~mapped_calib();
+
+  mapped_calib(const mapped_calib &) = delete;
+  mapped_calib &operator=(const mapped_calib &) = delete;
+
+  bool ok() const { return good; }
+  int detectors() const { return good ? header()->ndetectors : 0; }
+  calib_view view(int detector) const;
+  std::string text_header(int detector) const;
+
+private:
+  const calib_file_header *header() const { return (const calib_file_header *)data; }
+  const calib_index_entry *index() const { return (const calib_index_entry *)(data + sizeof(calib_file_header)); }
+
+  const char *data = nullptr;
+  size_t size = 0;
+  bool good = false;
+};
+
+bool is_binary_calib(const char *calib_file);
+
+// All the detectors of a calibration file, with the '#' header lines of each block (headers can be nullptr)
+bool read_calib_ascii(const char *calib_file, std::vector<calib> &cals, std::vector<std::string> *headers, bool verb);
+bool read_calib_binary(const char *calib_file, std::vector<calib> &cals, std::vector<std::string> *headers, bool verb);
+
+// Missing or empty headers are written as a default 18-line header, as expected by the miniTRB tools
+bool write_calib_ascii(const char *calib_file, const std::vector<calib> &cals, const std::vector<std::string> &headers);
+bool write_calib_binary(const char *calib_file, const std::vector<calib> &cals, const std::vector<std::string> &headers);
+
+#endif
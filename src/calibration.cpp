@@ -2,6 +2,7 @@
 #include "TFile.h"
 #include "TError.h"
 #include "TH1.h"
+#include "TH2.h"
 #include "TF1.h"
 #include "TGraph.h"
 #include "TAxis.h"
@@ -16,51 +17,264 @@
 #include "TLine.h"
 #include "TKey.h"
 #include "TPaveText.h"
+#include "Math/MinimizerOptions.h"
 #include "event.h"
 #include "PAPERO.h"
+#include "stats.h"
+#include "covariance.h"
+#include "online_calibration.h"
+#include "thread_pool.h"
+#include "instrument.h"
 
 #include <CLI/CLI.hpp>
 
 #include <cstdio>
+#include <cstdint>
 #include <unistd.h>
 #include <map>
+#include <random>
 
-double MAD(const std::vector<float> *v)
+struct event_matrix
 {
-  std::vector<float> tmp = *v;
-  const float med = TMath::Median(tmp.size(), tmp.data());
+  int NChannels = 0;
+  std::vector<uint16_t> adc; // raw ADC samples, row-major (events x channels)
+
+  long nevents() const { return NChannels ? adc.size() / NChannels : 0; }
+  const uint16_t *row(long event) const { return adc.data() + event * NChannels; }
+}; // calibration run held in memory
+
+long load_event_matrix(TChain &chain, std::vector<unsigned int> *&raw_event, int NChannels,
+                       long reservoir, event_matrix &matrix)
+// Read the calibration run once into a contiguous event x channel matrix.
+// With reservoir > 0 at most that many events are kept, picked uniformly over the run
+// (fixed seed, so repeated calibrations of the same run give the same result)
+{
+  long entries = chain.GetEntries();
+
+  // first event is skipped like in the two-pass calibration
+  std::vector<long> selected;
+  if (reservoir > 0 && entries - 1 > reservoir)
+  {
+    std::mt19937_64 rng(12345);
+    selected.reserve(reservoir);
+    for (long index_event = 1; index_event < entries; index_event++)
+    {
+      if ((long)selected.size() < reservoir)
+      {
+        selected.push_back(index_event);
+      }
+      else
+      {
+        long slot = std::uniform_int_distribution<long>(0, index_event - 1)(rng);
+        if (slot < reservoir)
+        {
+          selected.at(slot) = index_event;
+        }
+      }
+    }
+    std::sort(selected.begin(), selected.end()); // read the chain sequentially
+  }
+  else
+  {
+    for (long index_event = 1; index_event < entries; index_event++)
+    {
+      selected.push_back(index_event);
+    }
+  }
+
+  matrix.NChannels = NChannels;
+  matrix.adc.clear();
+  matrix.adc.reserve(selected.size() * NChannels);
+
+  for (long index_event : selected)
+  {
+    INSTRUMENT_LAP(lap);
+    chain.GetEntry(index_event);
+    INSTRUMENT_STAGE(lap, "read");
+    if (raw_event->size() != (size_t)NChannels)
+    {
+      continue;
+    }
+    matrix.adc.insert(matrix.adc.end(), raw_event->begin(), raw_event->end());
+  }
 
-  std::vector<float> absdev;
-  absdev.reserve(tmp.size());
-  for (float x : tmp)
-    absdev.push_back(std::abs(x - med));
+  std::cout << "\tLoaded " << matrix.nevents() << " events in memory ("
+            << matrix.adc.size() * sizeof(uint16_t) / (1024. * 1024.) << " MB)" << std::endl;
 
-  return TMath::Median(absdev.size(), absdev.data());
+  return matrix.nevents();
 }
 
-int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1,
-                        float sigmaraw_cut = 3, float sigma_cut = 6,
-                        int board = 0, int side = 0, bool pdf_only = false, bool fast = true,
-                        bool fit = false, bool single_file = true, bool last_board = false, int max_ADC = -1,
-                        bool shoeCN = false, double cn_threshold = 4.5)
+gauss_estimate estimate_gauss(TH1D *h)
 {
-  TFile *foutput;
-  if (!pdf_only)
+  h->BufferEmpty(); // fix the range of auto-binned histograms
+  int nbins = h->GetNbinsX();
+  std::vector<double> content(nbins);
+  for (int bin = 0; bin < nbins; bin++)
   {
-    TString root_filename;
-    if (!single_file)
+    content[bin] = h->GetBinContent(bin + 1);
+  }
+  return truncated_gauss(content.data(), nbins, h->GetXaxis()->GetXmin(), h->GetXaxis()->GetXmax());
+}
+
+int fit_gauss(std::vector<TH1D *> &hists, std::vector<gauss_estimate> &est, bool fit_all,
+              const TF1 *gaus_proto, thread_pool *fit_pool)
+// Gaussian estimate for every channel, Minuit fits only where the estimate is not trusted (or everywhere with fit_all).
+// Fits run on fit_pool (if any), each worker thread with its own clone of gaus_proto
+{
+  std::vector<int> to_fit;
+  for (size_t ch = 0; ch < hists.size(); ch++)
+  {
+    est.at(ch) = estimate_gauss(hists[ch]);
+    if (est[ch].entries > 0 && (fit_all || !est[ch].gaussian))
     {
-      root_filename = output_filename + "_board-" + board + "_side-" + side + ".root";
+      to_fit.push_back(ch);
     }
-    else
+  }
+
+  auto fit_channels = [&](size_t first, size_t last)
+  {
+    thread_local std::unique_ptr<TF1> fgaus;
+    if (!fgaus)
+    {
+      size_t id = std::hash<std::thread::id>()(std::this_thread::get_id());
+      fgaus.reset((TF1 *)gaus_proto->Clone(Form("%s_%zu", gaus_proto->GetName(), id)));
+    }
+
+    for (size_t i = first; i < last; i++)
     {
-      root_filename = output_filename + ".root";
+      TH1D *h = hists[to_fit[i]];
+      gauss_estimate &e = est[to_fit[i]];
+      fgaus->SetParameters(h->GetMaximum(), e.mean, e.sigma > 0 ? e.sigma : h->GetRMS());
+      if ((int)h->Fit(fgaus.get(), "QN") == 0) // keep the estimate if the fit fails
+      {
+        e.mean = fgaus->GetParameter(1);
+        e.sigma = std::abs(fgaus->GetParameter(2));
+      }
+    }
+  };
+
+  const size_t chunk = 16;
+  if (fit_pool)
+  {
+    std::vector<std::future<void>> done;
+    for (size_t first = 0; first < to_fit.size(); first += chunk)
+    {
+      done.push_back(fit_pool->submit([&, first]
+                                      { fit_channels(first, std::min(first + chunk, to_fit.size())); }));
+    }
+    for (auto &d : done)
+    {
+      d.get();
     }
-    foutput = new TFile(root_filename.Data(), "UPDATE");
-    foutput->cd();
+  }
+  else
+  {
+    fit_channels(0, to_fit.size());
   }
 
-  std::string alphabet = "ABCDEFGHIJKLMNOPQRSTWXYZ";
+  return to_fit.size();
+}
+
+struct calibration_header
+{
+  std::string name;
+  std::string location;
+  std::string bias;
+  std::string leak;
+  std::string curr6v;
+  std::string curr3v;
+  std::string delay;
+}; // sensor info written at the top of each .cal block
+
+struct calibration_result
+{
+  int board = 0;
+  int side = 0;
+  int NChannels = 0;
+  int NVas = 0;
+
+  std::vector<float> pedestals;
+  std::vector<float> rsigma;
+  std::vector<float> sigma;     // CN corrected noise, for every channel
+  std::vector<int> badchan;     // 1 for channels flagged as too noisy or dead
+  std::vector<float> sigma_fit; // sigmas of channels with CN data (used for the summary)
+
+  float mean_pedestal = 0;
+  float median_pedestal = 0;
+  float rms_pedestal = 0;
+  float mad_pedestal = 0;
+  float mean_rsigma = 0;
+  float median_rsigma = 0;
+  float rms_rsigma = 0;
+  float mad_rsigma = 0;
+  float mean_sigma = 0;
+  float median_sigma = 0;
+  float rms_sigma = 0;
+  float mad_sigma = 0;
+  float max_sigma = 0;
+
+  std::vector<robust_summary> va_pedestal; // per-VA summaries, channels without data excluded
+  std::vector<robust_summary> va_rsigma;
+  std::vector<robust_summary> va_sigma;
+
+  std::vector<double> correlation; // channel x channel noise correlation (with --covariance)
+  std::vector<double> covariance;
+
+  TGraph *gr = nullptr;  // pedestals
+  TGraph *gr2 = nullptr; // raw sigmas
+  TGraph *gr3 = nullptr; // sigmas
+}; // per-detector calibration, filled by compute_calibration
+
+calibration_header ask_calibration_header(int board, int side, bool fast)
+{
+  calibration_header header;
+
+  if (!fast)
+  {
+    std::cout << "\n CALIBRATION FILE FOR BOARD " << board << " SIDE " << side << "\n";
+    std::cout << "\n Sensor Name: ";
+    std::cin >> header.name;
+    std::cout << "\n Location: ";
+    std::cin >> header.location;
+    std::cout << "\n Bias (V): ";
+    std::cin >> header.bias;
+    std::cout << "\n Leakage current (uA): ";
+    std::cin >> header.leak;
+    std::cout << "\n 6V current (mA): ";
+    std::cin >> header.curr6v;
+    std::cout << "\n 3V current (mA): ";
+    std::cin >> header.curr3v;
+    std::cout << "\n Hold Delay: ";
+    std::cin >> header.delay;
+    std::cout << "\n";
+  }
+  else
+  {
+    header.name = ((TString) "Board_" + board + (TString) "_Side_" + side).Data();
+    header.location = "nd ";
+    header.bias = "nd ";
+    header.leak = "nd ";
+    header.curr6v = "nd ";
+    header.curr3v = "nd ";
+    header.delay = "nd ";
+  }
+
+  return header;
+}
+
+int compute_calibration(TChain &chain, calibration_result &res,
+                        float sigmaraw_cut = 3, float sigma_cut = 6,
+                        int board = 0, int side = 0,
+                        bool fit = false, bool fit_all = false,
+                        const TF1 *gaus_proto = nullptr, thread_pool *fit_pool = nullptr,
+                        bool shoeCN = false, double cn_threshold = 4.5,
+                        bool in_memory = false, long reservoir = 0, bool covariance = false)
+// Only numeric work: no file is written and no global ROOT state is touched, so that
+// several detectors can be calibrated at the same time on different threads
+{
+  res.board = board;
+  res.side = side;
+
   // Read raw event from input chain TTree
   std::vector<unsigned int> *raw_event = 0;
   TBranch *RAW = 0;
@@ -79,14 +293,26 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1,
     return 1;
   }
 
+  std::cout << Form("\nProcessing data for detector on board %d on side %d\n", board, side) << std::flush;
+  int entries = chain.GetEntries();
+  std::cout << Form("\tBoard %d side %d: this run has %d entries\n", board, side, entries) << std::flush;
+
+  if (entries == 0)
+  {
+    std::cout << Form("\tERROR: skipping empty run for board %d side %d\n", board, side) << std::flush;
+    return -1;
+  }
+
   chain.GetEntry(0);
   int NChannels = raw_event->size();
   int NVas = NChannels / 64;
+  res.NChannels = NChannels;
+  res.NVas = NVas;
 
-  // histos
-  TH1D *hADC[NChannels];
-  TH1D *hSignal[NChannels];
-  TH1D *hCN[NChannels];
+  // histos (not attached to any directory, deleted at the end)
+  std::vector<TH1D *> hADC(NChannels);
+  std::vector<TH1D *> hSignal(NChannels);
+  std::vector<TH1D *> hCN(NChannels);
   for (int ch = 0; ch < NChannels; ch++)
   {
     hADC[ch] = new TH1D(Form("pedestal_channel_%d_board_%d_side_%d", ch, board, side), Form("Pedestal %d", ch), 1000, 0, -1);
@@ -97,11 +323,11 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1,
     hCN[ch]->GetXaxis()->SetTitle("ADC");
   }
 
-  TF1 *fittedgaus;
-
   TGraph *gr = new TGraph(NChannels);
   gr->SetName((TString) "Pedestals" + "_board-" + board + "_side-" + side);
   gr->SetTitle("Pedestals");
+  gr->GetXaxis()->SetTitle("channel");
+  gr->GetXaxis()->SetLimits(0, NChannels);
 
   TGraph *gr2 = new TGraph(NChannels);
   gr2->SetName((TString) "RawSigma" + "_board-" + board + "_side-" + side);
@@ -115,345 +341,406 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1,
   gr3->GetXaxis()->SetTitle("channel");
   gr3->GetXaxis()->SetLimits(0, NChannels);
 
-  std::vector<float> pedestals[NChannels];
-  float mean_pedestal = 0;
-  float median_pedestal = 0;
-  float rms_pedestal = 0;
-  float mad_pedestal = 0;
-  std::vector<float> rsigma[NChannels];
-  float mean_rsigma = 0;
-  float median_rsigma = 0;
-  float rms_rsigma = 0;
-  float mad_rsigma = 0;
-  std::vector<float> sigma[NChannels];
-  float mean_sigma = 0;
-  float median_sigma = 0;
-  float rms_sigma = 0;
-  float mad_sigma = 0;
-  float max_sigma = 0;
+  res.gr = gr;
+  res.gr2 = gr2;
+  res.gr3 = gr3;
 
-  char name[100];
-  char location[100];
-  char bias[100];
-  char leak[100];
-  char curr6v[100];
-  char curr3v[100];
-  char delay[100];
+  std::vector<float> &pedestals = res.pedestals;
+  std::vector<float> &rsigma = res.rsigma;
+  std::vector<float> &sigma = res.sigma_fit;
 
-  std::ofstream calfile;
-  if (!pdf_only)
-  {
-    if (!fast)
-    {
-      std::cout << "\n CALIBRATION FILE FOR SIDE " << side << "\n";
-      std::cout << "\n Sensor Name: ";
-      std::cin >> name;
-      std::cout << "\n Location: ";
-      std::cin >> location;
-      std::cout << "\n Bias (V): ";
-      std::cin >> bias;
-      std::cout << "\n Leakage current (uA): ";
-      std::cin >> leak;
-      std::cout << "\n 6V current (mA): ";
-      std::cin >> curr6v;
-      std::cout << "\n 3V current (mA): ";
-      std::cin >> curr3v;
-      std::cout << "\n Hold Delay: ";
-      std::cin >> delay;
-      std::cout << "\n";
-    }
-    else
+  event_matrix matrix;
+  if (in_memory)
+  {
+    // Single read of the run: both phases below use all the events held in memory
+    if (load_event_matrix(chain, raw_event, NChannels, reservoir, matrix) == 0)
     {
-      strcpy(name, (TString) "Board_" + board + (TString) "_Side_" + side);
-      strcpy(location, "nd ");
-      strcpy(bias, "nd ");
-      strcpy(leak, "nd ");
-      strcpy(curr6v, "nd ");
-      strcpy(curr3v, "nd ");
-      strcpy(delay, "nd ");
+      std::cout << "\tERROR: no complete event in this run" << std::endl;
+      for (int ch = 0; ch < NChannels; ch++)
+      {
+        delete hADC[ch];
+        delete hSignal[ch];
+        delete hCN[ch];
+      }
+      return -1;
     }
 
-    std::time_t result = std::time(nullptr);
-
-    if (!single_file)
+    INSTRUMENT_LAP(fill);
+    for (long index_event = 0; index_event < matrix.nevents(); index_event++)
     {
-      calfile.open(output_filename + "_board-" + Form("%d", board) + "_side-" + Form("%d", side) + ".cal");
+      const uint16_t *raw = matrix.row(index_event);
+      for (int k = 0; k < NChannels; k++)
+      {
+        hADC[k]->Fill(raw[k]);
+      }
     }
-    else
-    {
-      calfile.open(output_filename + ".cal", std::ofstream::out | std::ofstream::app);
-    }
-
-    calfile << "#temp_SN= NC\n";
-    calfile << "#temp_SN= NC\n";
-    calfile << "#name= " << name << "\n";
-    calfile << "#location= " << location << "\n";
-    calfile << "#bias_volt= " << bias << "V\n";
-    calfile << "#leak_curr= " << leak << "uA\n";
-    calfile << "#6v_curr= " << curr6v << "mA\n";
-    calfile << "#3v_curr= " << curr3v << "mA\n";
-    calfile << "#starting_time= " << std::asctime(std::localtime(&result));
-    calfile << "#temp_right= NC\n";
-    calfile << "#temp_left= NC\n";
-    calfile << "#hold_delay= " << delay << "\n";
-    calfile << "#sigmaraw_cut= " << sigmaraw_cut << "\n";
-    calfile << "#sigmaraw_noise_cut= NC\n";
-    calfile << "#sigma_cut= " << sigma_cut << "\n";
-    calfile << "#sigma_noise_cut= NC\n";
-    calfile << "#sigma_k= NC\n";
-    calfile << "#occupancy_k= NC\n";
-  }
-
-  std::cout << "\nProcessing data for detector on board " << board << " on side " << side << std::endl;
-  int entries = chain.GetEntries();
-  std::cout << "\tThis run has " << entries << " entries" << std::endl;
-
-  if (entries == 0)
-  {
-    std::cout << "\tERROR: skipping empty run" << std::endl;
-    return -1;
+    INSTRUMENT_STAGE(fill, "histograms");
   }
-
-  // First half of events are used to compute pedestals and raw_sigmas
-  for (int index_event = 1; index_event < entries / 2; index_event++)
+  else
   {
-    chain.GetEntry(index_event);
-    // if (index_event == 1)
-    // {
-    //   cout << "Reading event " << index_event << endl;
-    //   cout << "\tEvent size " << raw_event->size() << endl;
-    // }
-
-    if (raw_event->size() == NChannels)
+    // First half of events are used to compute pedestals and raw_sigmas
+    for (int index_event = 1; index_event < entries / 2; index_event++)
     {
-      for (int k = 0; k < raw_event->size(); k++)
+      INSTRUMENT_LAP(lap);
+      chain.GetEntry(index_event);
+      INSTRUMENT_STAGE(lap, "read");
+
+      if (raw_event->size() == NChannels)
       {
-        // Filling histos for each channel for Gaussian Fit
-        hADC[k]->Fill(raw_event->at(k));
+        for (int k = 0; k < raw_event->size(); k++)
+        {
+          // Filling histos for each channel for Gaussian Fit
+          hADC[k]->Fill(raw_event->at(k));
+        }
       }
+      INSTRUMENT_STAGE(lap, "histograms");
     }
   }
 
+  std::vector<gauss_estimate> est(NChannels);
+  if (fit)
+  {
+    INSTRUMENT_SCOPE("fit");
+    int fitted = fit_gauss(hADC, est, fit_all, gaus_proto, fit_pool);
+    std::cout << Form("\tBoard %d side %d: %d pedestal fits needed\n", board, side, fitted) << std::flush;
+  }
+
   for (int ch = 0; ch < NChannels; ch++)
   {
-    // Fitting histos with gaus to compute ped and raw_sigma
+    // Gaussian estimate (or mean and RMS) of the histos to compute ped and raw_sigma
     if (hADC[ch]->GetEntries())
     {
       if (fit)
       {
-        hADC[ch]->Fit("gaus", "QS");
-        fittedgaus = (TF1 *)hADC[ch]->GetListOfFunctions()->FindObject("gaus");
-        pedestals->push_back(fittedgaus->GetParameter(1));
-        rsigma->push_back(fittedgaus->GetParameter(2));
-        gr->SetPoint(ch, ch, fittedgaus->GetParameter(1));
-        gr2->SetPoint(ch, ch, fittedgaus->GetParameter(2));
+        pedestals.push_back(est[ch].mean);
+        rsigma.push_back(est[ch].sigma);
+        gr->SetPoint(ch, ch, est[ch].mean);
+        gr2->SetPoint(ch, ch, est[ch].sigma);
       }
       else
       {
-        if (ch == 100)
-        {
-          hADC[ch]->SaveAs("test.root");
-        }
-
-        pedestals->push_back(hADC[ch]->GetMean());
-        rsigma->push_back(hADC[ch]->GetRMS());
+        pedestals.push_back(hADC[ch]->GetMean());
+        rsigma.push_back(hADC[ch]->GetRMS());
         gr->SetPoint(ch, ch, hADC[ch]->GetMean());
         gr2->SetPoint(ch, ch, hADC[ch]->GetRMS());
       }
     }
     else
     {
-      pedestals->push_back(0);
-      rsigma->push_back(0);
+      pedestals.push_back(0);
+      rsigma.push_back(0);
       gr->SetPoint(ch, ch, 0);
       gr2->SetPoint(ch, ch, 0);
     }
   }
 
-  mean_pedestal = TMath::Mean(pedestals->begin(), pedestals->end());
-  rms_pedestal = TMath::RMS(pedestals->begin(), pedestals->end());
-  median_pedestal = TMath::Median(pedestals->size(), pedestals->data());
-  mad_pedestal = MAD(pedestals);
+  robust_summary summary = summarize(pedestals.data(), pedestals.size());
+  res.mean_pedestal = summary.mean;
+  res.rms_pedestal = summary.rms;
+  res.median_pedestal = summary.median;
+  res.mad_pedestal = summary.mad;
 
-  float num_ped = 0;
-  for (int i = 0; i < pedestals->size(); i++)
-  {
-    num_ped += pow(pedestals->at(i) - mean_pedestal, 2);
-  }
+  summary = summarize(rsigma.data(), rsigma.size());
+  res.mean_rsigma = summary.mean;
+  res.rms_rsigma = summary.rms;
+  res.median_rsigma = summary.median;
+  res.mad_rsigma = summary.mad;
 
-  mean_rsigma = TMath::Mean(rsigma->begin(), rsigma->end());
-  rms_rsigma = TMath::RMS(rsigma->begin(), rsigma->end());
-  median_rsigma = TMath::Median(rsigma->size(), rsigma->data());
-  mad_rsigma = MAD(rsigma);
-
-  gr->GetXaxis()->SetTitle("channel");
-  TAxis *axis = gr->GetXaxis();
-  axis->SetLimits(0, NChannels);
-  axis->SetNdivisions(NVas, false);
-  c1.cd(1);
-  gPad->SetGrid();
-  gr->SetMarkerSize(0.8);
-  gr->Draw("AL*");
-
-  gr2->GetXaxis()->SetTitle("channel");
-  TAxis *axis2 = gr2->GetXaxis();
-  axis2->SetLimits(0, NChannels);
-  axis2->SetNdivisions(NVas, false);
-  if (max_ADC != -1)
+  std::vector<char> has_data(NChannels);
+  for (int ch = 0; ch < NChannels; ch++)
   {
-    TAxis *axis2y = gr2->GetYaxis();
-    axis2y->SetRangeUser(0, max_ADC);
+    has_data[ch] = hADC[ch]->GetEntries() > 0;
   }
-
-  c1.cd(2);
-  gPad->SetGrid();
-  gr2->SetMarkerSize(0.8);
-  gr2->Draw("AL*");
+  res.va_pedestal = summarize_groups(pedestals.data(), has_data.data(), NChannels, 64);
+  res.va_rsigma = summarize_groups(rsigma.data(), has_data.data(), NChannels, 64);
 
   // Like before, but this time we correct for common noise
-  for (int index_event = entries / 2; index_event < entries; index_event++)
+  std::vector<float> signal(NChannels);
+  std::unique_ptr<noise_covariance> noise_cov;
+  if (covariance)
   {
-    chain.GetEntry(index_event);
+    noise_cov.reset(new noise_covariance(NChannels));
+  }
+  event_cn ecn; // common noise of the current event, memory reused for all the events
+  long first_cn_event = in_memory ? 0 : entries / 2;
+  long last_cn_event = in_memory ? matrix.nevents() : entries;
 
-    if (raw_event->size() == pedestals->size())
+  for (long index_event = first_cn_event; index_event < last_cn_event; index_event++)
+  {
+    INSTRUMENT_LAP(lap);
+    INSTRUMENT_EVENTS(1);
+    // Pedestal subtraction
+    if (in_memory)
     {
-      // Pedestal subtraction
-      std::vector<float> signal;
-      std::transform(raw_event->begin(), raw_event->end(), pedestals->begin(), std::back_inserter(signal), [&](double raw, double ped)
-                     { return raw - ped; });
+      const uint16_t *raw = matrix.row(index_event);
+      for (int ch = 0; ch < NChannels; ch++)
+      {
+        signal[ch] = (double)raw[ch] - pedestals.at(ch);
+      }
+    }
+    else
+    {
+      chain.GetEntry(index_event);
+      INSTRUMENT_STAGE(lap, "read");
 
-      // Chip-wise CN subtraction before filling the histos
-      for (int va = 0; va < NVas; va++) // Loop on VA
+      if (raw_event->size() != pedestals.size())
       {
-        float cn = -999;
-        if (!shoeCN)
-        {
-          cn = GetCN(&signal, va, 0);
-        }
-        else
-        {
-          std::vector<float> vaContent;
-          for (int i = 0; i < 64; i++)
-          {
-            vaContent.push_back(signal.at(64 * va + i));
-          }
+        continue;
+      }
+      std::transform(raw_event->begin(), raw_event->end(), pedestals.begin(), signal.begin(), [&](double raw, double ped)
+                     { return raw - ped; });
+    }
+    INSTRUMENT_STAGE(lap, "pedestals");
 
-          cn = ComputeCN_ty(&vaContent, 0, false, cn_threshold); // SHOE CN
-        }
+    if (noise_cov)
+    {
+      noise_cov->add_event(signal.data());
+      INSTRUMENT_STAGE(lap, "covariance");
+    }
 
-        if (cn != -999)
+    // Chip-wise CN subtraction before filling the histos
+    if (!shoeCN)
+    {
+      GetEventCN(ecn, signal);
+    }
+    else
+    {
+      ComputeEventCN_ty(ecn, signal, 0, cn_threshold); // SHOE CN
+    }
+    INSTRUMENT_STAGE(lap, "common noise");
+    for (int va = 0; va < NVas; va++) // Loop on VA
+    {
+      float cn = shoeCN ? ecn.shoe[va] : ecn.cn[0][va];
+
+      if (cn != -999)
+      {
+        for (int va_chan = 0; va_chan < 64; va_chan++)
         {
-          for (int va_chan = 0; va_chan < 64; va_chan++)
-          {
-            if (signal.size() == NChannels)
-            {
-              {
-                hSignal[64 * va + va_chan]->Fill(signal.at(64 * va + va_chan));
-                hCN[64 * va + va_chan]->Fill(signal.at(64 * va + va_chan) - cn);
-              }
-            }
-          }
+          hSignal[64 * va + va_chan]->Fill(signal.at(64 * va + va_chan));
+          hCN[64 * va + va_chan]->Fill(signal.at(64 * va + va_chan) - cn);
         }
       }
     }
+    INSTRUMENT_STAGE(lap, "histograms");
   }
 
-  // Fitting with gaus to compute sigmas
-  int va_chan = 0;
-  double sigma_value;
+  // Gaussian estimate to compute sigmas
+  if (fit)
+  {
+    INSTRUMENT_SCOPE("fit");
+    int fitted = fit_gauss(hCN, est, fit_all, gaus_proto, fit_pool);
+    std::cout << Form("\tBoard %d side %d: %d sigma fits needed\n", board, side, fitted) << std::flush;
+  }
 
   for (int ch = 0; ch < NChannels; ch++)
   {
     bool badchan = false;
+    double sigma_value = 0;
     if (hCN[ch]->GetEntries())
     {
       if (fit)
       {
-        hCN[ch]->Fit("gaus", "QS");
-        fittedgaus = (TF1 *)hCN[ch]->GetListOfFunctions()->FindObject("gaus");
-        gr3->SetPoint(ch, ch, fittedgaus->GetParameter(2));
-        sigma->push_back(fittedgaus->GetParameter(2));
-        // Flag for channels that are too noisy or dead
-        if (rsigma->at(ch) < 1.5 || rsigma->at(ch) > sigmaraw_cut)
-        {
-          if (fittedgaus->GetParameter(2) < 1 || fittedgaus->GetParameter(2) > sigma_cut)
-          {
-            badchan = true;
-          }
-        }
+        sigma_value = est[ch].sigma;
       }
       else
       {
-        gr3->SetPoint(ch, ch, hCN[ch]->GetRMS());
-        sigma->push_back(hCN[ch]->GetRMS());
-        // Flag for channels that are too noisy or dead
-        if (rsigma->at(ch) < 1.5 || rsigma->at(ch) > sigmaraw_cut)
+        sigma_value = hCN[ch]->GetRMS();
+      }
+      gr3->SetPoint(ch, ch, sigma_value);
+      sigma.push_back(sigma_value);
+
+      // Flag for channels that are too noisy or dead
+      if (rsigma.at(ch) < 1.5 || rsigma.at(ch) > sigmaraw_cut)
+      {
+        if (sigma_value < 1 || sigma_value > sigma_cut)
         {
-          if (hCN[ch]->GetRMS() < 1 || hCN[ch]->GetRMS() > sigma_cut)
-          {
-            badchan = true;
-          }
+          badchan = true;
         }
       }
     }
     else
     {
       gr3->SetPoint(ch, ch, 0);
-      rsigma->push_back(0);
       badchan = true;
     }
 
-    if (!pdf_only)
+    res.sigma.push_back(sigma_value);
+    res.badchan.push_back(badchan);
+  }
+
+  summary = summarize(sigma.data(), sigma.size());
+  res.mean_sigma = summary.mean;
+  res.median_sigma = summary.median;
+  res.mad_sigma = summary.mad;
+
+  for (int ch = 0; ch < NChannels; ch++)
+  {
+    has_data[ch] = hCN[ch]->GetEntries() > 0;
+  }
+  res.va_sigma = summarize_groups(res.sigma.data(), has_data.data(), NChannels, 64);
+
+  if (noise_cov)
+  {
+    res.covariance = noise_cov->covariance();
+    res.correlation = noise_cov->correlation(res.covariance);
+  }
+
+  if (!std::isnan(res.mean_sigma))
+  {
+    res.max_sigma = *std::max_element(sigma.begin(), sigma.end());
+  }
+  else
+  {
+    res.max_sigma = 0;
+  }
+
+  float num_sigma = 0;
+  for (int i = 0; i < sigma.size(); i++)
+  {
+    num_sigma += pow(sigma.at(i) - res.mean_sigma, 2);
+  }
+  res.rms_sigma = std::sqrt(num_sigma / sigma.size());
+
+  for (int ch = 0; ch < NChannels; ch++)
+  {
+    delete hADC[ch];
+    delete hSignal[ch];
+    delete hCN[ch];
+  }
+
+  return 0;
+}
+
+void write_calibration(const calibration_result &res, const calibration_header &header,
+                       TString output_filename, bool single_file,
+                       float sigmaraw_cut, float sigma_cut)
+// .cal block (should be backwards-compatible with miniTRB tools) and graphs in the ROOT file
+{
+  INSTRUMENT_SCOPE("write");
+  int board = res.board;
+  int side = res.side;
+
+  std::time_t result = std::time(nullptr);
+
+  std::ofstream calfile;
+  if (!single_file)
+  {
+    calfile.open(output_filename + "_board-" + Form("%d", board) + "_side-" + Form("%d", side) + ".cal");
+  }
+  else
+  {
+    calfile.open(output_filename + ".cal", std::ofstream::out | std::ofstream::app);
+  }
+
+  calfile << "#temp_SN= NC\n";
+  calfile << "#temp_SN= NC\n";
+  calfile << "#name= " << header.name << "\n";
+  calfile << "#location= " << header.location << "\n";
+  calfile << "#bias_volt= " << header.bias << "V\n";
+  calfile << "#leak_curr= " << header.leak << "uA\n";
+  calfile << "#6v_curr= " << header.curr6v << "mA\n";
+  calfile << "#3v_curr= " << header.curr3v << "mA\n";
+  calfile << "#starting_time= " << std::asctime(std::localtime(&result));
+  calfile << "#temp_right= NC\n";
+  calfile << "#temp_left= NC\n";
+  calfile << "#hold_delay= " << header.delay << "\n";
+  calfile << "#sigmaraw_cut= " << sigmaraw_cut << "\n";
+  calfile << "#sigmaraw_noise_cut= NC\n";
+  calfile << "#sigma_cut= " << sigma_cut << "\n";
+  calfile << "#sigma_noise_cut= NC\n";
+  calfile << "#sigma_k= NC\n";
+  calfile << "#occupancy_k= NC\n";
+
+  int va_chan = 0;
+  for (int ch = 0; ch < res.NChannels; ch++)
+  {
+    calfile << ch << ", " << ch / 64 << ", "
+            << va_chan
+            << ", " << res.pedestals.at(ch) << ", " << res.rsigma.at(ch) << ", "
+            << res.sigma.at(ch)
+            << ", "
+            << res.badchan.at(ch)
+            << ", "
+            << "0.000"
+            << "\n";
+    va_chan++;
+    if (va_chan == 64)
     {
-      if (fit)
-      {
-        sigma_value = fittedgaus->GetParameter(2);
-      }
-      else
-      {
-        sigma_value = hCN[ch]->GetRMS();
-      }
-      // Writing info in .cal file (should be backwards-compatible with miniTRB tools)
-      calfile << ch << ", " << ch / 64 << ", "
-              << va_chan
-              << ", " << pedestals->at(ch) << ", " << rsigma->at(ch) << ", "
-              << sigma_value
-              << ", "
-              << badchan
-              << ", "
-              << "0.000"
-              << "\n";
-      va_chan++;
-      if (va_chan == 64)
-      {
-        va_chan = 0;
-      }
+      va_chan = 0;
     }
   }
-  mean_sigma = TMath::Mean(sigma->begin(), sigma->end());
-  rms_sigma = TMath::RMS(sigma->begin(), sigma->end());
-  median_sigma = TMath::Median(sigma->size(), sigma->data());
-  mad_sigma = MAD(sigma);
+  calfile.close();
 
-  if (!std::isnan(mean_sigma))
+  TString root_filename;
+  if (!single_file)
   {
-    max_sigma = *std::max_element(sigma->begin(), sigma->end());
+    root_filename = output_filename + "_board-" + board + "_side-" + side + ".root";
   }
   else
   {
-    max_sigma = 0;
+    root_filename = output_filename + ".root";
   }
+  TFile *foutput = new TFile(root_filename.Data(), "UPDATE");
+  foutput->cd();
+  res.gr->Write();
+  res.gr2->Write();
+  res.gr3->Write();
 
-  float num_sigma = 0;
-  for (int i = 0; i < sigma->size(); i++)
+  if (!res.correlation.empty())
+  {
+    int N = res.NChannels;
+    TH2D hcov(Form("covariance_board_%d_side_%d", board, side), Form("Noise covariance board %d side %d;channel;channel", board, side),
+              N, 0, N, N, 0, N);
+    TH2D hcorr(Form("correlation_board_%d_side_%d", board, side), Form("Noise correlation board %d side %d;channel;channel", board, side),
+               N, 0, N, N, 0, N);
+    for (int i = 0; i < N; i++)
+    {
+      for (int j = 0; j < N; j++)
+      {
+        hcov.SetBinContent(i + 1, j + 1, res.covariance[(size_t)i * N + j]);
+        hcorr.SetBinContent(i + 1, j + 1, res.correlation[(size_t)i * N + j]);
+      }
+    }
+    hcov.Write();
+    hcorr.Write();
+  }
+  foutput->Close();
+  delete foutput;
+}
+
+void draw_calibration(const calibration_result &res, TCanvas &c1, TString output_filename,
+                      int max_ADC, bool first_page)
+// One PDF page per detector: the PDF file must be opened with "[" and closed with "]" by the caller
+{
+  TGraph *gr = res.gr;
+  TGraph *gr2 = res.gr2;
+  TGraph *gr3 = res.gr3;
+
+  TAxis *axis = gr->GetXaxis();
+  axis->SetLimits(0, res.NChannels);
+  axis->SetNdivisions(res.NVas, false);
+  c1.cd(1);
+  gPad->SetGrid();
+  gr->SetMarkerSize(0.8);
+  gr->Draw("AL*");
+
+  TAxis *axis2 = gr2->GetXaxis();
+  axis2->SetLimits(0, res.NChannels);
+  axis2->SetNdivisions(res.NVas, false);
+  if (max_ADC != -1)
   {
-    num_sigma += pow(sigma->at(i) - mean_sigma, 2);
+    TAxis *axis2y = gr2->GetYaxis();
+    axis2y->SetRangeUser(0, max_ADC);
   }
-  rms_sigma = std::sqrt(num_sigma / sigma->size());
+
+  c1.cd(2);
+  gPad->SetGrid();
+  gr2->SetMarkerSize(0.8);
+  gr2->Draw("AL*");
 
   TAxis *axis3 = gr3->GetXaxis();
-  axis3->SetLimits(0, NChannels);
-  axis3->SetNdivisions(NVas, false);
+  axis3->SetLimits(0, res.NChannels);
+  axis3->SetNdivisions(res.NVas, false);
   if (max_ADC != -1)
   {
     TAxis *axis3y = gr3->GetYaxis();
@@ -468,49 +755,60 @@ int compute_calibration(TChain &chain, TString output_filename, TCanvas &c1,
   c1.cd(4);
   TPaveText *pt = new TPaveText(.05, .1, .95, .8);
 
-  pt->AddText(Form("Pedestal mean value: %f \t Pedestal RMS value: %f", mean_pedestal, rms_pedestal));
-  pt->AddText(Form("Pedestal median value: %f \t Pedestal MAD value: %f", median_pedestal, mad_pedestal));
-  pt->AddText(Form("Raw sigma mean value: %f \t Raw sigma RMS value: %f", mean_rsigma, rms_rsigma));
-  pt->AddText(Form("Raw sigma median value: %f \t Raw sigma MAD value: %f", median_rsigma, mad_rsigma));
-  pt->AddText(Form("Sigma mean value: %f \t Sigma RMS value: %f \t Max Sigma: %f", mean_sigma, rms_sigma, max_sigma));
-  pt->AddText(Form("Sigma median value: %f \t Sigma MAD value: %f", median_sigma, mad_sigma));
+  pt->AddText(Form("Pedestal mean value: %f \t Pedestal RMS value: %f", res.mean_pedestal, res.rms_pedestal));
+  pt->AddText(Form("Pedestal median value: %f \t Pedestal MAD value: %f", res.median_pedestal, res.mad_pedestal));
+  pt->AddText(Form("Raw sigma mean value: %f \t Raw sigma RMS value: %f", res.mean_rsigma, res.rms_rsigma));
+  pt->AddText(Form("Raw sigma median value: %f \t Raw sigma MAD value: %f", res.median_rsigma, res.mad_rsigma));
+  pt->AddText(Form("Sigma mean value: %f \t Sigma RMS value: %f \t Max Sigma: %f", res.mean_sigma, res.rms_sigma, res.max_sigma));
+  pt->AddText(Form("Sigma median value: %f \t Sigma MAD value: %f", res.median_sigma, res.mad_sigma));
   pt->AddText("Calibration file " + output_filename);
-  pt->AddText(Form("Detector: %d", 2 * board + side));
-  pt->AddText(Form("Board: %i \t Side: %i", board, side));
+  pt->AddText(Form("Detector: %d", 2 * res.board + res.side));
+  pt->AddText(Form("Board: %i \t Side: %i", res.board, res.side));
   pt->Draw();
 
-  if (board == 0 && !last_board)
+  if (first_page)
   {
     c1.SetGrid();
-    c1.Print(output_filename + ".pdf(", "pdf");
-  }
-  else if (last_board)
-  {
-    c1.Print(output_filename + ".pdf)", "pdf");
-  }
-  else
-  {
-    c1.Print(output_filename + ".pdf", "pdf");
   }
+  c1.Print(output_filename + ".pdf", "pdf");
+  delete pt;
+}
 
+void print_calibration_summary(const calibration_result &res)
+{
+  std::cout << "\nCalibration of detector on board " << res.board << " on side " << res.side << std::endl;
   std::cout << "\tMean pedestal \t\t Mean RSigma \t\t Mean Sigma \t\t Max Sigma " << std::endl;
-  std::cout << Form("\t%f \t\t %f \t\t %f \t\t %f", mean_pedestal, mean_rsigma, mean_sigma, max_sigma) << std::endl;
+  std::cout << Form("\t%f \t\t %f \t\t %f \t\t %f", res.mean_pedestal, res.mean_rsigma, res.mean_sigma, res.max_sigma) << std::endl;
   std::cout << "\tRMS pedestal \t\t RMS RSigma \t\t RMS Sigma " << std::endl;
-  std::cout << Form("\t%f \t\t %f \t\t %f", rms_pedestal, rms_rsigma, rms_sigma) << std::endl;
+  std::cout << Form("\t%f \t\t %f \t\t %f", res.rms_pedestal, res.rms_rsigma, res.rms_sigma) << std::endl;
   std::cout << "\tMedian pedestal \t Median RSigma \t\t Median Sigma " << std::endl;
-  std::cout << Form("\t%f \t\t %f \t\t %f", median_pedestal, median_rsigma, median_sigma) << std::endl;
+  std::cout << Form("\t%f \t\t %f \t\t %f", res.median_pedestal, res.median_rsigma, res.median_sigma) << std::endl;
   std::cout << "\tMAD pedestal \t\t MAD RSigma \t\t MAD Sigma " << std::endl;
-  std::cout << Form("\t%f \t\t %f \t\t %f", mad_pedestal, mad_rsigma, mad_sigma) << std::endl;
-  if (!pdf_only)
+  std::cout << Form("\t%f \t\t %f \t\t %f", res.mad_pedestal, res.mad_rsigma, res.mad_sigma) << std::endl;
+
+  std::cout << "\tVA \t Median (MAD) pedestal \t Median (MAD) RSigma \t Median (MAD) Sigma " << std::endl;
+  for (size_t va = 0; va < res.va_sigma.size(); va++)
   {
-    calfile.close();
-    gr->Write();
-    gr2->Write();
-    gr3->Write();
-    foutput->Close();
+    std::cout << Form("\t%zu \t %.2f (%.2f) \t\t %.2f (%.2f) \t\t %.2f (%.2f)", va,
+                      res.va_pedestal.at(va).median, res.va_pedestal.at(va).mad,
+                      res.va_rsigma.at(va).median, res.va_rsigma.at(va).mad,
+                      res.va_sigma.at(va).median, res.va_sigma.at(va).mad)
+              << std::endl;
   }
 
-  return 0;
+  if (!res.correlation.empty())
+  {
+    // pickup common to a whole ADC shows up as correlation between its two VAs
+    for (int group_size : {64, 128})
+    {
+      std::cout << "\t" << (group_size == 64 ? "VA " : "ADC") << " \t Mean noise correlation inside \t with other channels" << std::endl;
+      std::vector<group_correlation> groups = summarize_correlation(res.correlation, res.NChannels, group_size);
+      for (size_t g = 0; g < groups.size(); g++)
+      {
+        std::cout << Form("\t%zu \t %.3f \t\t\t\t %.3f", g, groups[g].inside, groups[g].outside) << std::endl;
+      }
+    }
+  }
 }
 
 std::string convert_raw_to_temp_root(const std::string &input_file, int boards, bool gsi, bool verbose, int nevents)
@@ -595,7 +893,9 @@ std::string convert_raw_to_temp_root(const std::string &input_file, int boards,
 
   while (!file.eof())
   {
+    INSTRUMENT_LAP(lap);
     auto maka_ret = read_evt_header(file, offset, verbose);
+    INSTRUMENT_STAGE(lap, "headers");
     if (!std::get<0>(maka_ret))
       break;
 
@@ -603,6 +903,7 @@ std::string convert_raw_to_temp_root(const std::string &input_file, int boards,
     for (size_t de10 = 0; de10 < std::get<4>(maka_ret); de10++)
     {
       auto de10_ret = read_de10_header(file, offset, verbose);
+      INSTRUMENT_STAGE(lap, "headers");
       if (!std::get<0>(de10_ret))
         break;
 
@@ -625,6 +926,7 @@ std::string convert_raw_to_temp_root(const std::string &input_file, int boards,
         padding_offset = 0;
         raw_event_buffer = reorder(read_event(file, offset, evt_size, verbose, false));
       }
+      INSTRUMENT_STAGE(lap, "decode");
 
       int det_idx = is_new_format ? detector_ids_map.at(board_id) : board_id;
 
@@ -643,6 +945,7 @@ std::string convert_raw_to_temp_root(const std::string &input_file, int boards,
         raw_event_vector.at(2 * det_idx).assign(raw_event_buffer.begin(), raw_event_buffer.end());
         raw_events_tree.at(2 * det_idx)->Fill();
       }
+      INSTRUMENT_STAGE(lap, "tree fill");
 
       offset += evt_size * 4 + 8 + 36;
     }
@@ -654,6 +957,7 @@ std::string convert_raw_to_temp_root(const std::string &input_file, int boards,
   }
 
   std::cout << "\n\t[raw convert] " << evtnum << " events converted" << std::endl;
+  INSTRUMENT_LAP(write);
 
   int filled = 0;
   for (int detector = 0; detector < max_detectors; detector++)
@@ -677,20 +981,24 @@ std::string convert_raw_to_temp_root(const std::string &input_file, int boards,
   }
 
   foutput->Close();
+  INSTRUMENT_STAGE(write, "write");
   file.close();
   return tmp_root;
 }
 
 int main(int argc, char *argv[])
 {
+  INSTRUMENT_PROGRAM("calibration");
   gErrorIgnoreLevel = kWarning;
 
   CLI::App app{"calibration"};
 
   bool verb = false;
   bool pdf_only = false;
+  bool no_pdf = false;
   bool fast_mode = false;
   bool fit_mode = false;
+  bool fit_all = false;
   bool multiple = false;
   bool raw_input = false;
   bool gsi = false;
@@ -698,17 +1006,30 @@ int main(int argc, char *argv[])
   int nevents = -1;
   int max_ADC = -1;
   bool shoeCN = false;
+  bool in_memory = false;
+  long reservoir = 0;
+  bool covariance = false;
   double cn_threshold = 4.5;
   int cntype = 0;
+  int nthreads = 0;
   std::string output_filename;
   std::vector<std::string> input_files;
+  std::string online_file;
+  int online_port = 0;
+  std::string online_address = "localhost";
+  online_options online;
 
   app.add_flag("-v,--verbose", verb, "Verbose output");
-  app.add_flag("--pdf", pdf_only, "PDF only, no .cal file");
+  auto pdf_option = app.add_flag("--pdf", pdf_only, "PDF only, no .cal file");
+  app.add_flag("--no-pdf", no_pdf, "No PDF report, only .cal and ROOT files")->excludes(pdf_option);
   app.add_flag("--fast", fast_mode, "No info prompt");
-  app.add_flag("--fit", fit_mode, "Compute calibration parameters with gaussian fits");
+  app.add_flag("--fit", fit_mode, "Compute calibration parameters with gaussian estimates, fitting only non-gaussian channels");
+  app.add_flag("--fit_all", fit_all, "Like --fit, but with a gaussian fit for every channel");
   app.add_flag("-m,--multiple", multiple, "Save calibrations in multiple .cal files");
   app.add_flag("--shoeCN", shoeCN, "Use SHOE CN algorithm");
+  app.add_flag("--in_memory", in_memory, "Read the run once into memory and use all events for both calibration steps");
+  app.add_flag("--covariance", covariance, "Save the channel x channel noise covariance and correlation (after pedestal subtraction) in the ROOT file");
+  app.add_option("--reservoir", reservoir, "Keep at most this many (uniformly sampled) events in memory, implies --in_memory");
 
   auto group = app.add_option_group("Raw input options");
   group->add_flag("--raw", raw_input, "Input files are PAPERO raw binary files (converted on-the-fly)");
@@ -719,11 +1040,42 @@ int main(int argc, char *argv[])
   app.add_option("--threshold", cn_threshold, "Threshold for SHOE CN algorithm");
   app.add_option("--cn", cntype, "CN algorithm selection (0,1,2)");
   app.add_option("--max_ADC", max_ADC, "Maximum ADC value for noise plots");
+  app.add_option("-j,--threads", nthreads, "Number of detectors calibrated in parallel (default: all cores)");
   app.add_option("--output", output_filename, "Output .cal file")->required();
-  app.add_option("input_files", input_files, "Input ROOT files (or raw files with --raw)")->required()->expected(-1);
+  app.add_option("input_files", input_files, "Input ROOT files (or raw files with --raw)")->expected(-1);
+
+  auto online_group = app.add_option_group("Online calibration options");
+  online_group->add_option("--follow", online_file, "Rolling calibration of a PAPERO raw file while it is being written");
+  online_group->add_option("--udp", online_port, "Rolling calibration of the on-line monitor UDP stream on this port");
+  online_group->add_option("--udp_address", online_address, "Address of the on-line monitor UDP stream");
+  online_group->add_option("--seed", online.seed_calibration, "Starting calibration file");
+  online_group->add_option("--window", online.window, "Number of events remembered by the running estimates");
+  online_group->add_option("--ped_drift", online.ped_drift, "Pedestal drift (VA median, in sigmas) for a new calibration version");
+  online_group->add_option("--noise_drift", online.noise_drift, "Relative noise drift (VA median) for a new calibration version");
+  online_group->add_option("--check_every", online.check_every, "Number of events between two drift checks");
+  online_group->add_option("--monitor_events", online.monitor_events, "Events before each drift check clusterized to monitor the occupancy (0: none)");
+  online_group->add_option("--idle_timeout", online.idle_timeout, "Seconds without new data before closing a followed raw file");
 
   CLI11_PARSE(app, argc, argv);
 
+  // Online mode: versioned <output>_v<N>_<date>.cal files written whenever the calibration drifts
+  if (!online_file.empty() || online_port > 0)
+  {
+    online.output = output_filename;
+    online.verb = verb;
+    if (!online_file.empty())
+    {
+      return run_online_file(online_file, online);
+    }
+    return run_online_udp(online_address, online_port, online);
+  }
+
+  if (input_files.empty())
+  {
+    std::cerr << "ERROR: no input files" << std::endl;
+    return 2;
+  }
+
   std::vector<std::string> tmp_files_to_delete;
   if (raw_input)
   {
@@ -747,75 +1099,146 @@ int main(int argc, char *argv[])
   }
 
   bool single_file = !multiple;
-
-  TChain *chain = new TChain("raw_events");
-  for (auto const &f : input_files)
-  {
-    std::cout << "\nAdding file " << f << " to the chain..." << std::endl;
-    chain->Add(f.c_str());
-  }
+  if (reservoir > 0)
+    in_memory = true;
 
   if (single_file && std::ifstream(output_filename + ".cal"))
   {
     remove((output_filename + ".cal").c_str());
   }
 
-  TCanvas *c1 = new TCanvas("calibration", "Canvas", 1920, 1080);
-  c1->Divide(2, 2);
-
   TFile tempfile(input_files[0].c_str());
   TIter list(tempfile.GetListOfKeys());
   TKey *key;
-  int detectors = 0;
+  std::vector<std::string> tree_names; // one TTree for each detector
   while ((key = (TKey *)list()))
   {
     if (!strcmp(key->GetClassName(), "TTree"))
     {
-      detectors++;
+      tree_names.push_back(key->GetName());
     }
   }
+  tempfile.Close();
+  int detectors = tree_names.size();
   std::cout << "File with " << detectors << " detector(s)" << std::endl;
 
-  bool newDAQ = true;
   if (detectors == 1)
-    newDAQ = false;
-
-  if (!newDAQ)
   {
-    compute_calibration(*chain, output_filename, *c1,
-                        /*sigmaraw_cut*/ 15, /*sigma_cut*/ 10,
-                        /*board*/ 0, /*side*/ 0,
-                        pdf_only, fast_mode, fit_mode,
-                        single_file, true,
-                        max_ADC, shoeCN, cn_threshold);
+    tree_names.at(0) = "raw_events"; // old DAQ
   }
   else
   {
     std::cout << "\nNEW DAQ FILE" << std::endl;
-    TIter list2(tempfile.GetListOfKeys());
-    int detector_num = 0;
-    int ladder_side = 0;
-    while ((key = (TKey *)list2()))
+  }
+
+  // Sensor info is asked for all the detectors before starting the (parallel) processing
+  std::vector<calibration_header> headers;
+  for (int detector_num = 0; detector_num < detectors; detector_num++)
+  {
+    if (!pdf_only)
     {
-      if (!strcmp(key->GetClassName(), "TTree"))
-      {
-        TChain *chain2 = new TChain(key->GetName());
+      headers.push_back(ask_calibration_header(detector_num / 2, detector_num % 2, fast_mode));
+    }
+  }
+
+  if (nthreads <= 0)
+  {
+    nthreads = thread_pool::default_threads();
+  }
+  int fit_threads = nthreads;
+  nthreads = std::min(nthreads, detectors);
+  if (fit_all)
+  {
+    fit_mode = true;
+  }
+
+  ROOT::EnableThreadSafety();
+  gROOT->SetBatch(kTRUE); // the PDF report is drawn by a background thread
+  TH1::AddDirectory(kFALSE);
+  TF1::DefaultAddToGlobalList(kFALSE);
+  ROOT::Math::MinimizerOptions::SetDefaultMinimizer("Minuit2"); // TMinuit is not thread safe
+  TF1 gaus_proto("calib_gaus", "gaus", 0, 1);                   // cloned by each fitting thread
+  std::cout << "Calibrating with " << nthreads << " thread(s)" << std::endl;
+
+  // Detectors are independent: each one is calibrated on its own TChain by the thread pool,
+  // results are then committed (.cal block, ROOT graphs) in detector order.
+  // PDF pages are rendered afterwards by a single background thread, so they never hold up the numbers
+  std::vector<calibration_result> results(detectors);
+  std::vector<std::future<int>> done;
+  {
+    thread_pool fit_pool(fit_threads); // channel fits, shared by all the detectors
+    thread_pool pool(nthreads);
+    for (int detector_num = 0; detector_num < detectors; detector_num++)
+    {
+      done.push_back(pool.submit([&, detector_num]
+                                 {
+        TChain chain(tree_names.at(detector_num).c_str());
         for (auto const &f : input_files)
         {
-          chain2->Add(f.c_str());
+          chain.Add(f.c_str());
         }
-        bool last = (detector_num / 2 == detectors / 2 - 1 && ladder_side == 1);
-        compute_calibration(*chain2, output_filename, *c1,
-                            /*sigmaraw_cut*/ 15, /*sigma_cut*/ 10,
-                            detector_num / 2, ladder_side,
-                            pdf_only, fast_mode, fit_mode,
-                            single_file, last,
-                            max_ADC, shoeCN, cn_threshold);
-        detector_num++;
-        ladder_side = 1 - ladder_side;
+        return compute_calibration(chain, results.at(detector_num),
+                                   /*sigmaraw_cut*/ 15, /*sigma_cut*/ 10,
+                                   detector_num / 2, detector_num % 2,
+                                   fit_mode, fit_all, &gaus_proto, &fit_pool,
+                                   shoeCN, cn_threshold,
+                                   in_memory, reservoir, covariance); }));
+    }
+
+    thread_pool pdf_pool(1); // one thread: pages are drawn in submission order on the same canvas
+    TCanvas *c1 = nullptr;
+
+    for (int detector_num = 0; detector_num < detectors; detector_num++)
+    {
+      calibration_result &res = results.at(detector_num);
+      if (done.at(detector_num).get() != 0)
+      {
+        delete res.gr;
+        delete res.gr2;
+        delete res.gr3;
+        continue;
+      }
+
+      if (!pdf_only)
+      {
+        write_calibration(res, headers.at(detector_num), output_filename, single_file,
+                          /*sigmaraw_cut*/ 15, /*sigma_cut*/ 10);
       }
+      print_calibration_summary(res);
+
+      if (no_pdf)
+      {
+        delete res.gr;
+        delete res.gr2;
+        delete res.gr3;
+        continue;
+      }
+
+      pdf_pool.submit([&, detector_num]
+                      {
+        calibration_result &res = results.at(detector_num);
+        bool first_page = !c1;
+        if (first_page)
+        {
+          c1 = new TCanvas("calibration", "Canvas", 1920, 1080);
+          c1->Divide(2, 2);
+          c1->Print((TString)output_filename + ".pdf[", "pdf");
+        }
+        draw_calibration(res, *c1, output_filename, max_ADC, first_page);
+
+        delete res.gr;
+        delete res.gr2;
+        delete res.gr3; });
     }
-    tempfile.Close();
+
+    pdf_pool.submit([&]
+                    {
+      if (c1)
+      {
+        c1->Print((TString)output_filename + ".pdf]", "pdf");
+        std::cout << "PDF report written to " << output_filename << ".pdf" << std::endl;
+        delete c1;
+      } });
   }
 
   // Delete temp ROOT files produced from raw conversion
@@ -827,4 +1250,4 @@ int main(int argc, char *argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,10 @@
+// Dictionary of the std::vector<cluster> clusters TTree of older files (rootcling, see the Makefile),
+// built into libcluster.so. types.C has the same classes for ROOT sessions that compile it with ACLiC
+#ifdef __CLING__
+#pragma link off all globals;
+#pragma link off all classes;
+#pragma link off all functions;
+
+#pragma link C++ class cluster+;
+#pragma link C++ class std::vector<cluster>+;
+#endif
@@ -0,0 +1,164 @@
+#include "covariance.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+  const int tile_size = 64; // 64 x 64 floats: 16 kB, fits L1 together with the input rows
+}
+
+noise_covariance::noise_covariance(int NChannels, int block_size)
+    : NChannels(NChannels), block_size(std::max(block_size, 1)),
+      block(this->block_size * NChannels), sum(NChannels, 0), cross((size_t)NChannels * NChannels, 0),
+      tile(tile_size * tile_size)
+{
+}
+
+void noise_covariance::add_event(const float *signal)
+{
+  std::copy(signal, signal + NChannels, block.begin() + (size_t)buffered * NChannels);
+  buffered++;
+  nevents++;
+  if (buffered == block_size)
+  {
+    flush();
+  }
+}
+
+void noise_covariance::flush()
+{
+  for (int e = 0; e < buffered; e++)
+  {
+    const float *row = block.data() + (size_t)e * NChannels;
+    for (int ch = 0; ch < NChannels; ch++)
+    {
+      sum[ch] += row[ch];
+    }
+  }
+
+  for (int ti = 0; ti < NChannels; ti += tile_size)
+  {
+    int ni = std::min(tile_size, NChannels - ti);
+    for (int tj = ti; tj < NChannels; tj += tile_size) // upper triangle of tiles only
+    {
+      int nj = std::min(tile_size, NChannels - tj);
+      std::fill(tile.begin(), tile.end(), 0);
+
+      // rank-k update of the tile: tile(i, j) += x(e, ti + i) * x(e, tj + j) over the buffered events
+      for (int e = 0; e < buffered; e++)
+      {
+        const float *row = block.data() + (size_t)e * NChannels;
+        const float *xj = row + tj;
+        for (int i = 0; i < ni; i++)
+        {
+          const float xi = row[ti + i];
+          float *t = tile.data() + i * tile_size;
+          for (int j = 0; j < nj; j++)
+          {
+            t[j] += xi * xj[j];
+          }
+        }
+      }
+
+      for (int i = 0; i < ni; i++)
+      {
+        double *c = cross.data() + (size_t)(ti + i) * NChannels + tj;
+        const float *t = tile.data() + i * tile_size;
+        for (int j = 0; j < nj; j++)
+        {
+          c[j] += t[j];
+        }
+      }
+    }
+  }
+  buffered = 0;
+}
+
+std::vector<double> noise_covariance::covariance()
+{
+  flush();
+  std::vector<double> cov((size_t)NChannels * NChannels, 0);
+  if (nevents == 0)
+  {
+    return cov;
+  }
+
+  for (int i = 0; i < NChannels; i++)
+  {
+    double mean_i = sum[i] / nevents;
+    for (int j = i; j < NChannels; j++)
+    {
+      // i <= j is always in the computed upper triangle (diagonal tiles are computed in full)
+      double c = cross[(size_t)i * NChannels + j] / nevents - mean_i * sum[j] / nevents;
+      cov[(size_t)i * NChannels + j] = c;
+      cov[(size_t)j * NChannels + i] = c;
+    }
+  }
+  return cov;
+}
+
+std::vector<double> noise_covariance::correlation()
+{
+  return correlation(covariance());
+}
+
+std::vector<double> noise_covariance::correlation(const std::vector<double> &cov) const
+{
+  std::vector<double> corr = cov;
+  std::vector<double> sigma(NChannels);
+  for (int ch = 0; ch < NChannels; ch++)
+  {
+    sigma[ch] = std::sqrt(std::max(corr[(size_t)ch * NChannels + ch], 0.));
+  }
+
+  for (int i = 0; i < NChannels; i++)
+  {
+    for (int j = 0; j < NChannels; j++)
+    {
+      double norm = sigma[i] * sigma[j];
+      corr[(size_t)i * NChannels + j] = norm > 0 ? corr[(size_t)i * NChannels + j] / norm : 0;
+    }
+  }
+  return corr;
+}
+
+std::vector<group_correlation> summarize_correlation(const std::vector<double> &correlation, int NChannels, int group_size)
+{
+  std::vector<group_correlation> groups;
+  for (int first = 0; first < NChannels; first += group_size)
+  {
+    group_correlation g;
+    g.first = first;
+    g.size = std::min(group_size, NChannels - first);
+
+    double inside = 0;
+    double outside = 0;
+    long ninside = 0;
+    long noutside = 0;
+    for (int i = first; i < first + g.size; i++)
+    {
+      for (int j = 0; j < NChannels; j++)
+      {
+        if (i == j)
+        {
+          continue;
+        }
+        if (j >= first && j < first + g.size)
+        {
+          inside += correlation[(size_t)i * NChannels + j];
+          ninside++;
+        }
+        else
+        {
+          outside += correlation[(size_t)i * NChannels + j];
+          noutside++;
+        }
+      }
+    }
+    g.inside = ninside ? inside / ninside : 0;
+    g.outside = noutside ? outside / noutside : 0;
+    groups.push_back(g);
+  }
+  return groups;
+}
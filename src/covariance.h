@@ -0,0 +1,49 @@
+#ifndef COVARIANCE_H_
+#define COVARIANCE_H_
+
+#include <vector>
+
+// Channel x channel noise covariance of pedestal subtracted events.
+// Events are buffered in blocks of block_size rows and added to the upper triangle of the
+// cross-product matrix with a tiled rank-k update (float tiles that the compiler vectorizes,
+// summed into double accumulators once per block), so the cost per event stays a few
+// multiply-adds per channel pair and memory traffic stays in cache
+
+class noise_covariance
+{
+public:
+  explicit noise_covariance(int NChannels, int block_size = 64);
+
+  void add_event(const float *signal);
+
+  long entries() const { return nevents; }
+  int channels() const { return NChannels; }
+
+  std::vector<double> covariance();  // NChannels x NChannels, row-major
+  std::vector<double> correlation(); // 0 for channels without noise
+  std::vector<double> correlation(const std::vector<double> &cov) const; // from the result of covariance()
+
+private:
+  void flush();
+
+  int NChannels;
+  int block_size;
+  long nevents = 0;
+  int buffered = 0;
+  std::vector<float> block;   // block_size x NChannels buffered events
+  std::vector<double> sum;    // per channel sum
+  std::vector<double> cross;  // upper triangle (row-major, full storage) of sum x_i x_j
+  std::vector<float> tile;    // tile accumulator
+};
+
+struct group_correlation
+{
+  int first = 0;      // first channel of the group
+  int size = 0;       // channels in the group
+  double inside = 0;  // mean off-diagonal correlation between channels of the group
+  double outside = 0; // mean correlation with the channels of the other groups
+}; // summary of a correlation matrix for groups of channels (VA, ADC)
+
+std::vector<group_correlation> summarize_correlation(const std::vector<double> &correlation, int NChannels, int group_size);
+
+#endif
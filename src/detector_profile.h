@@ -0,0 +1,61 @@
+#ifndef DETECTOR_PROFILE_H_
+#define DETECTOR_PROFILE_H_
+
+// Detector geometry and readout of every DAQ board version, in one place for all the programs.
+// The table is constexpr: the kernels in event.cpp are instantiated for the channel and VA
+// counts listed here, and the runtime --version only selects which instantiation runs
+
+struct detector_profile
+{
+  int version;        // DAQ board version (--version)
+  const char *name;
+  int NChannels;      // readout channels
+  int NVas;           // VA readout chips with common noise subtraction, 64 channels each
+  int minStrip;
+  int maxStrip;
+  float sensor_pitch; // mm
+  int maxADC_h;       // upper edge of the ADC histograms
+  bool newDAQ;        // PAPERO data format
+};
+
+constexpr detector_profile detector_profiles[] = {
+    {1212, "DaMPE miniTRB", 384, 6, 0, 383, 0.242, 500, false},
+    {1313, "FOOT prototype miniTRB", 640, 10, 0, 639, 0.150, 500, false},
+    {2020, "FOOT ADC boards + DE10Nano", 640, 10, 0, 639, 0.150, 500, true},
+    {2021, "PAN StripX", 2048, 32, 0, 2047, 0.050, 500, false},
+    {2022, "PAN StripY", 128, 1, 0, 127, 0.400, 500, false},
+    {2023, "AMSL0", 1024, 16, 0, 1023, 0.109, 2000, false},
+    {2024, "AMSL0 BL Monster", 1024, 16, 0, 1023, 0.109, 200, false},
+    {2025, "ASTRA", 64, 1, 0, 63, 0.150, 200, false},
+};
+
+constexpr int n_detector_profiles = sizeof(detector_profiles) / sizeof(detector_profiles[0]);
+
+constexpr const detector_profile *find_detector_profile(int version) // nullptr for unknown versions
+{
+  for (int i = 0; i < n_detector_profiles; i++)
+  {
+    if (detector_profiles[i].version == version)
+    {
+      return &detector_profiles[i];
+    }
+  }
+  return nullptr;
+}
+
+constexpr bool detector_profiles_consistent()
+{
+  for (int i = 0; i < n_detector_profiles; i++)
+  {
+    const detector_profile &p = detector_profiles[i];
+    if (64 * p.NVas > p.NChannels || p.minStrip < 0 || p.maxStrip >= p.NChannels || p.minStrip > p.maxStrip)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(detector_profiles_consistent(), "detector profile with more VAs than channels or strips outside the detector");
+
+#endif
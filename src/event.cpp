@@ -1,6 +1,15 @@
 #include "event.h"
+#include "calib_io.h"
+#include "detector_profile.h"
 
-int PrintCluster(cluster clus)
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+int PrintCluster(const cluster &clus)
 {
   std::cout << "######## Cluster Info ########" << std::endl;
 
@@ -20,169 +29,140 @@ int PrintCluster(cluster clus)
   return 0;
 }
 
-int GetClusterAddress(cluster clus) { return clus.address; }
-int GetClusterWidth(cluster clus) { return clus.width; }
-int GetClusterOver(cluster clus) { return clus.over; }
-int GetClusterBoard(cluster clus) { return clus.board; }
-int GetClusterSide(cluster clus) { return clus.side; }
-std::vector<float> GetClusterADC(cluster clus) { return clus.ADC; }
-
-float GetClusterSignal(cluster clus) // ADC of whole cluster
+cluster_features GetClusterFeatures(const cluster &clus, calib *cal)
 {
-  float signal = 0;
-  std::vector<float> ADC = GetClusterADC(clus);
-
-  for (auto &n : ADC)
-  {
-    signal += n;
-  }
-  return signal;
-}
+  cluster_features f;
+  const std::vector<float> &ADC = clus.ADC;
+  int address = clus.address;
+  int nstrips = ADC.size();
 
-float GetClusterCOG(cluster clus) // Center Of Gravity of cluster
-{
-  int address = GetClusterAddress(clus);
-  std::vector<float> ADC = GetClusterADC(clus);
+  // Signal and Center Of Gravity
   float num = 0;
-  float den = 0;
-  float cog = -999;
-
-  for (uint i = 0; i < ADC.size(); i++)
-  {
-    num += ADC.at(i) * (address + i);
-    den += ADC.at(i);
-  }
-  if (den != 0)
+  int max_pos = 0;
+  for (int i = 0; i < nstrips; i++)
   {
-    cog = num / den;
-  }
-
-  return cog;
-}
-
-int GetClusterSeed(cluster clus, calib *cal) // Strip corresponding to the seed
-{
-  int seed = -999;
-  std::vector<float> ADC = GetClusterADC(clus);
-
-  float sn_max = 0; // seed is defined as the strip with highest S/N value
-
-  for (uint i = 0; i < ADC.size(); i++)
-  {
-    if (ADC.at(i) / cal->sig.at(clus.address + i) > sn_max)
+    num += ADC[i] * (unsigned)(address + i);
+    f.signal += ADC[i];
+    if (ADC[i] > ADC[max_pos])
     {
-      sn_max = ADC.at(i) / cal->sig.at(clus.address + i);
-      seed = clus.address + i;
+      max_pos = i;
     }
   }
-  return seed;
-}
-
-int GetClusterSecond(cluster clus, calib *cal) // Strip corresponding to the second strip by ADC
-{
-  int seed = GetClusterSeed(clus, cal);
-  int second = -999;
-
-  std::vector<float> ADC = GetClusterADC(clus);
-
-  if (seed == clus.address)
+  if (f.signal != 0)
   {
-    second = clus.address + 1;
+    f.cog = num / f.signal;
   }
-  else if (seed == clus.address + clus.width - 1)
+
+  // Eta, from the highest strip and its highest neighbour
+  if (nstrips == 1)
   {
-    second = clus.address + clus.width - 2;
+    f.eta = 1.0;
   }
-  else
+  else if (nstrips > 1)
   {
-    if (ADC.at(seed - clus.address - 1) > ADC.at(seed - clus.address + 1))
+    if (max_pos == 0)
+    {
+      f.eta = ADC[0] / (ADC[0] + ADC[1]);
+    }
+    else if (max_pos == nstrips - 1)
     {
-      second = seed - 1;
+      f.eta = ADC[max_pos - 1] / (ADC[max_pos - 1] + ADC[max_pos]);
+    }
+    else if (ADC[max_pos - 1] > ADC[max_pos + 1])
+    {
+      f.eta = ADC[max_pos - 1] / (ADC[max_pos - 1] + ADC[max_pos]);
     }
     else
     {
-      second = seed + 1;
+      f.eta = ADC[max_pos] / (ADC[max_pos] + ADC[max_pos + 1]);
     }
   }
 
-  return second;
-}
-
-int GetClusterSeedIndex(cluster clus, calib *cal) // Position of the seed in the cluster
-{
-  int seed_idx = -999;
-  std::vector<float> ADC = GetClusterADC(clus);
+  if (!cal)
+  {
+    return f;
+  }
 
+  // Seed is defined as the strip with highest S/N value, S/N of the cluster from all the strips
   float sn_max = 0;
-
-  for (uint i = 0; i < ADC.size(); i++)
+  float sn = 0;
+  for (int i = 0; i < nstrips; i++)
   {
-    if (ADC.at(i) / cal->sig.at(clus.address + i) > sn_max)
+    float strip_sn = ADC[i] / cal->sig.at(address + i);
+    if (strip_sn > sn_max)
     {
-      sn_max = ADC.at(i) / cal->sig.at(clus.address + i);
-      seed_idx = i;
+      sn_max = strip_sn;
+      f.seed_index = i;
     }
+    sn += pow(strip_sn, 2);
+  }
+  if (sn > 0)
+  {
+    f.sn = sqrt(sn);
   }
-  return seed_idx;
-}
-
-int GetClusterSecondIndex(cluster clus, calib *cal)
-{
-  int seed = GetClusterSeed(clus, cal);
-  int second = -999;
-
-  std::vector<float> ADC = GetClusterADC(clus);
 
-  if (ADC.size() != 1)
+  if (f.seed_index < 0)
   {
+    return f;
+  }
+  f.seed = address + f.seed_index;
+  f.seed_adc = ADC[f.seed_index];
+  float noise = cal->sig.at(f.seed);
+  if (noise)
+  {
+    f.seed_sn = f.seed_adc / noise;
+  }
 
-    if (seed == clus.address)
-    {
-      second = 1;
-    }
-    else if (seed == clus.address + clus.width - 1)
-    {
-      second = clus.width - 2;
-    }
-    else
-    {
-      if (ADC.at(seed - clus.address - 1) > ADC.at(seed - clus.address + 1))
-      {
-        second = seed - clus.address - 1;
-      }
-      else
-      {
-        second = seed - clus.address + 1;
-      }
-    }
+  // Second strip: the highest neighbour of the seed
+  if (f.seed_index == 0)
+  {
+    f.second_index = 1;
+  }
+  else if (f.seed_index == clus.width - 1)
+  {
+    f.second_index = clus.width - 2;
+  }
+  else if (ADC.at(f.seed_index - 1) > ADC.at(f.seed_index + 1))
+  {
+    f.second_index = f.seed_index - 1;
   }
   else
   {
-    second = -1;
+    f.second_index = f.seed_index + 1;
+  }
+  f.second = address + f.second_index;
+  if (nstrips == 1)
+  {
+    f.second_index = -1; // the second strip (address + 1) is outside the cluster
   }
 
-  return second;
+  return f;
 }
 
-float GetClusterSeedADC(cluster clus, calib *cal)
-{
-  int seed_idx = GetClusterSeedIndex(clus, cal);
+int GetClusterAddress(const cluster &clus) { return clus.address; }
+int GetClusterWidth(const cluster &clus) { return clus.width; }
+int GetClusterOver(const cluster &clus) { return clus.over; }
+int GetClusterBoard(const cluster &clus) { return clus.board; }
+int GetClusterSide(const cluster &clus) { return clus.side; }
+const std::vector<float> &GetClusterADC(const cluster &clus) { return clus.ADC; }
 
-  return clus.ADC.at(seed_idx);
-}
+float GetClusterSignal(const cluster &clus) { return GetClusterFeatures(clus).signal; } // ADC of whole cluster
 
-float GetClusterSecondADC(cluster clus, calib *cal)
-{
-  int second_idx = GetClusterSecondIndex(clus, cal);
-  return clus.ADC.at(second_idx);
-}
+float GetClusterCOG(const cluster &clus) { return GetClusterFeatures(clus).cog; } // Center Of Gravity of cluster
 
-int GetClusterVA(cluster clus, calib *cal)
-{
-  int seed = GetClusterSeed(clus, cal);
+int GetClusterSeed(const cluster &clus, calib *cal) { return GetClusterFeatures(clus, cal).seed; } // Strip corresponding to the seed
 
-  return seed / 64;
-}
+int GetClusterSecond(const cluster &clus, calib *cal) { return GetClusterFeatures(clus, cal).second; } // Strip corresponding to the second strip by ADC
+
+int GetClusterSeedIndex(const cluster &clus, calib *cal) { return GetClusterFeatures(clus, cal).seed_index; } // Position of the seed in the cluster
+
+int GetClusterSecondIndex(const cluster &clus, calib *cal) { return GetClusterFeatures(clus, cal).second_index; }
+
+float GetClusterSeedADC(const cluster &clus, calib *cal) { return clus.ADC.at(GetClusterSeedIndex(clus, cal)); }
+
+float GetClusterSecondADC(const cluster &clus, calib *cal) { return clus.ADC.at(GetClusterSecondIndex(clus, cal)); }
+
+int GetClusterVA(const cluster &clus, calib *cal) { return GetClusterSeed(clus, cal) / 64; }
 
 float GetCN(std::vector<float> *signal, int va, int type) // common mode noise calculation with 3 possible algos: done on a VA (readout ASIC) base
 {
@@ -273,6 +253,378 @@ float GetCN(std::vector<float> *signal, int va, int type) // common mode noise c
   }
 }
 
+namespace
+{
+  // (Re)allocates the buffers of cn when the number of VAs changes
+  void size_event_cn(event_cn &cn, int NVas)
+  {
+    if (cn.NVas != NVas || cn.strips.empty())
+    {
+      cn.NVas = NVas;
+      cn.lanes = (NVas + 7) / 8 * 8;
+      cn.strips.assign(64 * cn.lanes, 0);
+      cn.mean.assign(NVas, 0);
+      cn.rms.assign(NVas, 0);
+      for (int type = 0; type < 3; type++)
+      {
+        cn.cn[type].assign(NVas, -999);
+        cn.valid[type].assign(NVas, 0);
+      }
+      cn.shoe.assign(NVas, 0);
+    }
+  }
+
+  // Transposes the event into cn.strips
+  void transpose_event(event_cn &cn, const std::vector<float> &signal)
+  {
+    int NVas = signal.size() / 64;
+    size_event_cn(cn, NVas);
+
+    const int L = cn.lanes;
+    for (int va = 0; va < NVas; va++)
+    {
+      for (int i = 0; i < 64; i++)
+      {
+        cn.strips[i * L + va] = signal[64 * va + i];
+      }
+    }
+  }
+
+  constexpr int lanes_for(int NVas) { return (NVas + 7) / 8 * 8; }
+
+  // Runs kernel(std::integral_constant<int, lanes>()) with the lane count of the detector profile
+  // matching the event, or with 0 (lane count known only at run time) for other sizes
+  template <typename Kernel, size_t... I>
+  void with_lanes(int lanes, Kernel &&kernel, std::index_sequence<I...>)
+  {
+    bool found = ((lanes == lanes_for(detector_profiles[I].NVas) &&
+                   (kernel(std::integral_constant<int, lanes_for(detector_profiles[I].NVas)>()), true)) ||
+                  ...);
+    if (!found)
+    {
+      kernel(std::integral_constant<int, 0>());
+    }
+  }
+
+  template <typename Kernel>
+  void with_lanes(int lanes, Kernel &&kernel)
+  {
+    with_lanes(lanes, kernel, std::make_index_sequence<n_detector_profiles>());
+  }
+
+  // Same for the number of channels of the event
+  template <typename Kernel, size_t... I>
+  void with_channels(int NChannels, Kernel &&kernel, std::index_sequence<I...>)
+  {
+    bool found = ((NChannels == detector_profiles[I].NChannels &&
+                   (kernel(std::integral_constant<int, detector_profiles[I].NChannels>()), true)) ||
+                  ...);
+    if (!found)
+    {
+      kernel(std::integral_constant<int, 0>());
+    }
+  }
+
+  template <typename Kernel>
+  void with_channels(int NChannels, Kernel &&kernel)
+  {
+    with_channels(NChannels, kernel, std::make_index_sequence<n_detector_profiles>());
+  }
+}
+
+// Every VA is a SIMD lane: the event is transposed to strip-major order and each lane goes through
+// its strips in the same order and with the same arithmetic as GetCN (double sums for TMath::Mean and
+// TMath::RMS, float sums for the CN), so the loops on the VAs vectorize without changing the result.
+// The cuts are selects instead of branches: adding 0 to a sum that starts from +0 leaves it unchanged.
+// VAs are processed in blocks of 8 lanes, whose sums stay in registers
+void event_cn_block(event_cn &cn, int first, int L)
+{
+  const float *strips = cn.strips.data() + first;
+  double sum[8] = {0}, tot[8] = {0};
+  float mean[8], rms[8];
+  float acc[8], acc2[8];
+  int cnt[8], cnt2[8];
+
+  // TMath::Mean and TMath::RMS (two pass, around the double precision mean)
+  for (int i = 0; i < 64; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      sum[va] += strips[i * L + va];
+    }
+  }
+  for (int va = 0; va < 8; va++)
+  {
+    sum[va] = sum[va] / 64.;
+  }
+  for (int i = 0; i < 64; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      double x = strips[i * L + va];
+      tot[va] += (x - sum[va]) * (x - sum[va]);
+    }
+  }
+  for (int va = 0; va < 8; va++)
+  {
+    mean[va] = sum[va];
+    rms[va] = std::sqrt(tot[va] / 63.);
+  }
+
+  // Algorithm 0: strips within 2 RMS from the VA mean
+  // Algorithm 1: strips below half a MIP
+  // Algorithm 2: baseline from strips 8-22, then strips 23-54 within 2 RMS from it
+  float acc1[8] = {0};
+  int cnt1[8] = {0};
+  std::fill(acc, acc + 8, 0.f);
+  std::fill(cnt, cnt + 8, 0);
+  std::fill(acc2, acc2 + 8, 0.f);
+  std::fill(cnt2, cnt2 + 8, 0);
+  for (int i = 0; i < 64; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      float x = strips[i * L + va];
+      bool in = (x > mean[va] - 2 * rms[va]) & (x < mean[va] + 2 * rms[va]);
+      acc[va] += in ? x : 0.f;
+      cnt[va] += in;
+      bool in1 = x < MIP_ADC / 2;
+      acc1[va] += in1 ? x : 0.f;
+      cnt1[va] += in1;
+    }
+  }
+  for (int va = 0; va < 8 && first + va < cn.NVas; va++)
+  {
+    cn.mean[first + va] = mean[va];
+    cn.rms[first + va] = rms[va];
+    cn.valid[0][first + va] = cnt[va] != 0;
+    cn.cn[0][first + va] = cnt[va] != 0 ? acc[va] / cnt[va] : -999;
+    cn.valid[1][first + va] = cnt1[va] != 0;
+    cn.cn[1][first + va] = cnt1[va] != 0 ? acc1[va] / cnt1[va] : -999;
+  }
+
+  std::fill(acc, acc + 8, 0.f);
+  std::fill(cnt, cnt + 8, 0);
+  for (int i = 8; i < 23; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      float x = strips[i * L + va];
+      bool in = x < 1.5 * MIP_ADC;
+      acc2[va] += in ? x : 0.f;
+      cnt2[va] += in;
+    }
+  }
+  for (int va = 0; va < 8; va++)
+  {
+    acc2[va] = cnt2[va] != 0 ? acc2[va] / cnt2[va] : 0.f; // hard_cm
+  }
+  for (int i = 23; i < 55; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      float x = strips[i * L + va];
+      bool in = (x > acc2[va] - 2 * rms[va]) & (x < acc2[va] + 2 * rms[va]);
+      acc[va] += in ? x : 0.f;
+      cnt[va] += in;
+    }
+  }
+  for (int va = 0; va < 8 && first + va < cn.NVas; va++)
+  {
+    cn.valid[2][first + va] = cnt2[va] != 0 && cnt[va] != 0;
+    cn.cn[2][first + va] = cn.valid[2][first + va] ? acc[va] / cnt[va] : -999;
+  }
+}
+
+// Same lane layout as GetEventCN. The mean and RMS of the channels below threshold are computed
+// with masked sums in the order TMath::Mean and TMath::RMS would see the selected values
+void shoe_cn_block(event_cn &cn, int first, int L, int type, double threshold)
+{
+  const float *strips = cn.strips.data() + first;
+  double sum[8] = {0}, tot[8] = {0}, nok[8] = {0};
+  float mean[8], rms[8];
+  float acc[8] = {0}, acc2[8] = {0};
+  int cnt[8] = {0}, cnt2[8] = {0};
+
+  // in float, |x| < threshold * MIP_ADC is |x| <= cut for the largest float cut below it
+  const double cut_d = threshold * MIP_ADC;
+  float cut = cut_d;
+  if (cut >= cut_d)
+  {
+    cut = std::nextafter(cut, -INFINITY);
+  }
+
+  // Mean and RMS of the channels below threshold (NaN mean and 0 RMS when there are none, as TMath)
+  for (int i = 0; i < 64; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      double x = strips[i * L + va];
+      bool ok = (x != -999.) & (std::fabs(x) < cut_d);
+      sum[va] += ok ? x : 0.;
+      nok[va] += ok ? 1. : 0.; // selected channels, counted in the lane width of the sums
+    }
+  }
+  for (int va = 0; va < 8; va++)
+  {
+    sum[va] = sum[va] / nok[va];
+  }
+  for (int i = 0; i < 64; i++)
+  {
+    for (int va = 0; va < 8; va++)
+    {
+      double x = strips[i * L + va];
+      bool ok = (x != -999.) & (std::fabs(x) < cut_d);
+      double d = (ok ? x : sum[va]) - sum[va]; // 0 for the channels not selected
+      tot[va] += d * d;
+    }
+  }
+  for (int va = 0; va < 8; va++)
+  {
+    mean[va] = sum[va];
+    rms[va] = nok[va] > 1 ? std::sqrt(tot[va] / (nok[va] - 1)) : 0.;
+  }
+
+  if (type == 0) // strips within 2 RMS from the mean
+  {
+    for (int i = 0; i < 64; i++)
+    {
+      for (int va = 0; va < 8; va++)
+      {
+        float x = strips[i * L + va];
+        bool in = (x > mean[va] - 2 * rms[va]) & (x < mean[va] + 2 * rms[va]);
+        acc[va] += in ? x : 0.f;
+        cnt[va] += in;
+      }
+    }
+  }
+  else if (type == 1) // strips below half a MIP
+  {
+    for (int i = 0; i < 64; i++)
+    {
+      for (int va = 0; va < 8; va++)
+      {
+        float x = strips[i * L + va];
+        bool in = x < MIP_ADC / 2;
+        acc[va] += in ? x : 0.f;
+        cnt[va] += in;
+      }
+    }
+  }
+  else // self tuning: baseline from strips 8-23, then strips 24-55 within 3 RMS from it, only for VAs with RMS < 10
+  {
+    for (int i = 8; i < 24; i++)
+    {
+      for (int va = 0; va < 8; va++)
+      {
+        float x = strips[i * L + va];
+        bool ok = (std::fabs(x) <= cut) & (x != -999.f);
+        acc2[va] += ok ? x : 0.f;
+        cnt2[va] += ok;
+      }
+    }
+    for (int va = 0; va < 8; va++)
+    {
+      acc2[va] = cnt2[va] != 0 ? acc2[va] / cnt2[va] : 0.f; // hard_cm
+    }
+    for (int i = 24; i < 56; i++)
+    {
+      for (int va = 0; va < 8; va++)
+      {
+        float x = strips[i * L + va];
+        bool in = (x > (acc2[va] - 3 * rms[va])) & (x < (acc2[va] + 3 * rms[va])) & (x != -999.f) & (rms[va] < 10);
+        acc[va] += in ? x : 0.f;
+        cnt[va] += in;
+      }
+    }
+  }
+
+  for (int va = 0; va < 8 && first + va < cn.NVas; va++)
+  {
+    cn.mean[first + va] = mean[va];
+    cn.rms[first + va] = rms[va];
+    cn.shoe[first + va] = cnt[va] != 0 ? acc[va] / cnt[va] : 0.f;
+  }
+}
+
+// Lanes is the lane count of a detector profile (a compile-time number of blocks and stride), 0 for other sizes
+template <int Lanes>
+void event_cn_kernel(event_cn &cn)
+{
+  const int L = Lanes ? Lanes : cn.lanes;
+  for (int first = 0; first < L; first += 8)
+  {
+    event_cn_block(cn, first, L);
+  }
+}
+
+template <int Lanes>
+void shoe_cn_kernel(event_cn &cn, int type, double threshold)
+{
+  const int L = Lanes ? Lanes : cn.lanes;
+  for (int first = 0; first < L; first += 8)
+  {
+    shoe_cn_block(cn, first, L, type, threshold);
+  }
+}
+
+void GetEventCN(event_cn &cn, const std::vector<float> &signal)
+{
+  transpose_event(cn, signal);
+  with_lanes(cn.lanes, [&](auto lanes)
+             { event_cn_kernel<decltype(lanes)::value>(cn); });
+}
+
+void GetRawEventCN(event_cn &cn, std::vector<float> &signal, const std::vector<unsigned int> &raw, const calib &cal, bool invert)
+{
+  const int n = raw.size();
+  signal.resize(n);
+  size_event_cn(cn, n / 64);
+  const int L = cn.lanes;
+
+  for (int va = 0; va < cn.NVas; va++) // pedestal subtraction and transposition in the same pass
+  {
+    for (int i = 0; i < 64; i++)
+    {
+      const int ch = 64 * va + i;
+      float value = 0; // bad channels are set to 0
+      if (cal.status[ch] == 0)
+      {
+        value = raw[ch] - cal.ped[ch];
+        if (invert)
+        {
+          value = -value;
+        }
+      }
+      signal[ch] = value;
+      cn.strips[i * L + va] = value;
+    }
+  }
+  for (int ch = 64 * cn.NVas; ch < n; ch++) // channels after the last full VA
+  {
+    float value = 0;
+    if (cal.status[ch] == 0)
+    {
+      value = raw[ch] - cal.ped[ch];
+      if (invert)
+      {
+        value = -value;
+      }
+    }
+    signal[ch] = value;
+  }
+
+  with_lanes(cn.lanes, [&](auto lanes)
+             { event_cn_kernel<decltype(lanes)::value>(cn); });
+}
+
+void ComputeEventCN_ty(event_cn &cn, const std::vector<float> &signal, int type, double threshold)
+{
+  transpose_event(cn, signal);
+  with_lanes(cn.lanes, [&](auto lanes)
+             { shoe_cn_kernel<decltype(lanes)::value>(cn, type, threshold); });
+}
+
 float ComputeCN_ty(std::vector<float> *vaContent, int type, bool debug, double threshold)
 {
   float cn = 0., sumSq = 0.;
@@ -281,21 +633,32 @@ float ComputeCN_ty(std::vector<float> *vaContent, int type, bool debug, double t
   double cn_final = 0.;
   double rms_cn_final = 0.;
 
+  // Mean and RMS of the channels below threshold, as TMath::Mean and TMath::RMS of the selected
+  // values but without copying them: two passes over the same selection
   int chok = 0;
-  std::vector<double> vaContent_ok;
-  vaContent_ok.clear();
-
-  for (int VaChan = 0; VaChan < vaContent->size(); VaChan++)
+  double sum_ok = 0.;
+  for (size_t VaChan = 0; VaChan < vaContent->size(); VaChan++)
   {
-    if (vaContent->at(VaChan) != -999. && fabs(vaContent->at(VaChan)) < (threshold * MIP_ADC))
+    float x = (*vaContent)[VaChan];
+    if (x != -999. && fabs(x) < (threshold * MIP_ADC))
     {
       chok++;
-      vaContent_ok.push_back(vaContent->at(VaChan));
+      sum_ok += x;
+    }
+  }
+  double mean_ok = sum_ok / chok;
+  double tot_ok = 0.;
+  for (size_t VaChan = 0; VaChan < vaContent->size(); VaChan++)
+  {
+    double x = (*vaContent)[VaChan];
+    if ((*vaContent)[VaChan] != -999. && fabs((*vaContent)[VaChan]) < (threshold * MIP_ADC))
+    {
+      tot_ok += (x - mean_ok) * (x - mean_ok);
     }
   }
 
-  float mean = TMath::Mean(vaContent_ok.size(), vaContent_ok.data());
-  float rms = TMath::RMS(vaContent_ok.size(), vaContent_ok.data());
+  float mean = mean_ok;
+  float rms = chok > 1 ? sqrt(tot_ok / (chok - 1)) : 0.;
 
   if (debug)
     std::cout << "CN cal:: mean  " << mean << " rms " << rms << " ; " << chok << " ok values" << std::endl;
@@ -455,109 +818,39 @@ float ComputeCN_ty(std::vector<float> *vaContent, int type, bool debug, double t
     }
     }
 
-    }//close else rms > 10
-    */
-
-    if (debug)
-      std::cout << " Here's my CN 0::  " << cn_final << " +- " << rms_cn_final << std::endl;
-
-    return cn_final;
-  }
-}
-
-float GetClusterSN(cluster clus, calib *cal)
-{
-  float sn = 0;
-
-  for (int i = 0; i < GetClusterWidth(clus); i++)
-  {
-    sn += pow(clus.ADC.at(i) / cal->sig.at(i + GetClusterAddress(clus)), 2);
-  }
-
-  if (sn > 0)
-  {
-    return sqrt(sn);
-  }
-  else
-  {
-    return -999;
-  }
-}
-
-float GetSeedSN(cluster clus, calib *cal)
-{
-  float signal = GetClusterSeedADC(clus, cal);
-  float noise = cal->sig.at(GetClusterSeed(clus, cal));
-
-  if (noise)
-  {
-    return signal / noise;
-  }
-  else
-  {
-    return -999;
-  }
-}
-
-float GetClusterEta(cluster clus)
-{
-  std::vector<float> ADC = GetClusterADC(clus);
-
-  Int_t nstrips = ADC.size();
-  Float_t eta = -999;
-  Float_t max_adc = -1;
-  Int_t max_pos = 0;
-
-  if (nstrips == 1)
-  {
-    eta = 1.0;
-  }
-  else
-  {
-    max_pos = std::max_element(ADC.begin(), ADC.end()) - ADC.begin();
-    max_adc = ADC.at(max_pos);
-
-    if (max_pos == 0)
-    {
-      eta = ADC.at(0) / (ADC.at(0) + ADC.at(1));
-    }
-    else if (max_pos == nstrips - 1)
-    {
-      eta = ADC.at(max_pos - 1) / (ADC.at(max_pos - 1) + ADC.at(max_pos));
-    }
-    else
-    {
-      if (ADC.at(max_pos - 1) > ADC.at(max_pos + 1))
-      {
-        eta = ADC.at(max_pos - 1) / (ADC.at(max_pos - 1) + ADC.at(max_pos));
-      }
-      else
-      {
-        eta = ADC.at(max_pos) / (ADC.at(max_pos) + ADC.at(max_pos + 1));
-      }
-    }
-  }
+    }//close else rms > 10
+    */
+
+    if (debug)
+      std::cout << " Here's my CN 0::  " << cn_final << " +- " << rms_cn_final << std::endl;
 
-  return eta;
+    return cn_final;
+  }
 }
 
-float GetPosition(cluster clus, float sensor_pitch) // conversion to mm
+float GetClusterSN(const cluster &clus, calib *cal) { return GetClusterFeatures(clus, cal).sn; }
+
+float GetSeedSN(const cluster &clus, calib *cal) { return GetClusterFeatures(clus, cal).seed_sn; }
+
+float GetClusterEta(const cluster &clus) { return GetClusterFeatures(clus).eta; }
+
+float GetPosition(const cluster &clus, float sensor_pitch) // conversion to mm
 {
   float position_mm = GetClusterCOG(clus) * sensor_pitch;
   return position_mm;
 }
 
-float GetClusterMIPCharge(cluster clus) // conversion to "Z" charge of the cluster
+float GetClusterMIPCharge(const cluster &clus) // conversion to "Z" charge of the cluster
 {
   return sqrt(GetClusterSignal(clus) / MIP_ADC);
 }
 
-float GetSeedMIPCharge(cluster clus, calib *cal)
+float GetSeedMIPCharge(const cluster &clus, calib *cal)
 {
   return sqrt(GetClusterSeedADC(clus, cal) / MIP_ADC); // conversion to "Z" charge of the cluster seed
 }
 
-bool GoodCluster(cluster clus, calib *cal) // cluster is good if all the strips are "good" in the calibration
+bool GoodCluster(const cluster &clus, calib *cal) // cluster is good if all the strips are "good" in the calibration
 {
   bool good = true;
   int pos = 0;
@@ -578,6 +871,23 @@ bool GoodCluster(cluster clus, calib *cal) // cluster is good if all the strips
 
 bool read_calib(const char *calib_file, calib *cal, int NChannels, int detector, bool verb) // read ASCII calib file: based on DaMPE calibration files (multiple detectors in one file)
 {
+  if (is_binary_calib(calib_file))
+  {
+    mapped_calib mapped(calib_file, verb);
+    calib_view v = mapped.view(detector);
+    if (v.nchannels == 0)
+      return 0;
+
+    int read_channels = std::min(v.nchannels, NChannels);
+    cal->ped.insert(cal->ped.end(), v.ped, v.ped + read_channels);
+    cal->rsig.insert(cal->rsig.end(), v.rsig, v.rsig + read_channels);
+    cal->sig.insert(cal->sig.end(), v.sig, v.sig + read_channels);
+    cal->status.insert(cal->status.end(), v.status, v.status + read_channels);
+    if (verb)
+      std::cout << "Read " << read_channels << " channels from binary calib file" << std::endl;
+    return 1;
+  }
+
   std::ifstream in;
   in.open(calib_file);
 
@@ -634,6 +944,14 @@ bool read_calib(const char *calib_file, calib *cal, int NChannels, int detector,
 
 std::vector<calib> read_calib_all(const char *calib_file, bool verb) // TODO:scrivere bene e aggiornare gli altri eseguibili per usare la nuova calib single file
 {
+  if (is_binary_calib(calib_file))
+  {
+    std::vector<calib> calib_vec;
+    if (!read_calib_binary(calib_file, calib_vec, nullptr, verb))
+      exit(1);
+    return calib_vec;
+  }
+
   std::ifstream in;
   in.open(calib_file);
 
@@ -746,20 +1064,344 @@ std::vector<std::pair<float, bool>> read_alignment(const char *alignment_file) /
   return alignment;
 }
 
-std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
-                                      float highThresh, float lowThresh,
-                                      bool symmetric, int symmetric_width,
-                                      bool absoluteThresholds = false,
-                                      int board = 0,
-                                      int side = 0,
-                                      bool verbose = false)
+void cluster_arena::clear()
+{
+  candidate_seeds.clear();
+  seeds.clear();
+  address.clear();
+  width.clear();
+  over.clear();
+  offset.clear();
+  adc.clear();
+}
+
+void cluster_arena::add(unsigned short first_strip, int nstrips, int nover, const float *ADC)
+{
+  address.push_back(first_strip);
+  width.push_back(nstrips);
+  over.push_back(nover);
+  offset.push_back(adc.size());
+  adc.insert(adc.end(), ADC, ADC + nstrips);
+}
+
+void to_clusters(const cluster_arena &arena, std::vector<cluster> &clusters)
+{
+  clusters.resize(arena.size());
+  for (size_t i = 0; i < arena.size(); i++)
+  {
+    clusters[i].address = arena.address[i];
+    clusters[i].width = arena.width[i];
+    clusters[i].over = arena.over[i];
+    clusters[i].ADC.assign(arena.ADC(i), arena.ADC(i) + arena.width[i]);
+    clusters[i].board = arena.board;
+    clusters[i].side = arena.side;
+  }
+}
+
+namespace
+{
+  // Largest cut with fl(cut / sigma) <= thresh. The float division is monotonic in the numerator
+  // for sigma > 0, so fl(adc / sigma) > thresh <=> adc > cut, with the same rounding as the S/N.
+  // False when there is no such cut (sigma negative, -0 or infinite)
+  bool sn_cut(float thresh, float sigma, float &cut)
+  {
+    if (std::isnan(sigma)) // adc / NaN > thresh is never true, adc > NaN neither
+    {
+      cut = sigma;
+      return true;
+    }
+    if (!std::isfinite(thresh) || std::isinf(sigma) || std::signbit(sigma))
+    {
+      return false;
+    }
+    if (sigma == 0) // adc / +0 is +inf only for adc > 0
+    {
+      cut = 0;
+      return true;
+    }
+
+    const float inf = std::numeric_limits<float>::infinity();
+    cut = thresh * sigma;
+    for (int step = 0; step < 64; step++) // a few ulps from the product
+    {
+      if (cut / sigma > thresh)
+      {
+        cut = std::nextafter(cut, -inf);
+      }
+      else if (std::nextafter(cut, inf) / sigma <= thresh)
+      {
+        cut = std::nextafter(cut, inf);
+      }
+      else
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Sets bits first..last of mask as in bits
+  void copy_bits(uint64_t *mask, const uint64_t *bits, int first, int last)
+  {
+    for (int w = first / 64; w <= last / 64; w++)
+    {
+      int lo = std::max(first - 64 * w, 0);
+      int hi = std::min(last - 64 * w, 63);
+      uint64_t range = (~0ULL >> (63 - hi)) & (~0ULL << lo);
+      mask[w] = (mask[w] & ~range) | (bits[w] & range);
+    }
+  }
+
+  // Set bits between first and last
+  int count_bits(const uint64_t *mask, int first, int last)
+  {
+    int count = 0;
+    for (int w = first / 64; w <= last / 64; w++)
+    {
+      int lo = std::max(first - 64 * w, 0);
+      int hi = std::min(last - 64 * w, 63);
+      count += __builtin_popcountll(mask[w] & (~0ULL >> (63 - hi)) & (~0ULL << lo));
+    }
+    return count;
+  }
+
+  // Consecutive set bits going down from strip (not included)
+  int run_down(const uint64_t *mask, int strip)
+  {
+    int pos = strip - 1;
+    while (pos >= 0)
+    {
+      int w = pos / 64;
+      uint64_t clear = ~mask[w] & (~0ULL >> (63 - pos % 64)); // unset bits at or below pos
+      if (clear)
+      {
+        return strip - 1 - (64 * w + 63 - __builtin_clzll(clear));
+      }
+      pos = 64 * w - 1;
+    }
+    return strip;
+  }
+
+  // Consecutive set bits going up from strip (not included): the masks end with unset bits
+  int run_up(const uint64_t *mask, int strip)
+  {
+    int pos = strip + 1;
+    while (true)
+    {
+      int w = pos / 64;
+      uint64_t clear = ~mask[w] & (~0ULL << pos % 64);
+      if (clear)
+      {
+        return 64 * w + __builtin_ctzll(clear) - strip - 1;
+      }
+      pos = 64 * (w + 1);
+    }
+  }
+
+  // Eight 0/1 bytes to eight bits (little endian)
+  inline uint64_t pack_bytes(const unsigned char *flags)
+  {
+    uint64_t v;
+    std::memcpy(&v, flags, 8);
+    return (v * 0x0102040810204080ULL) >> 56;
+  }
+
+  // Per strip cuts in ADC of the high and low thresholds, bad strips get +inf.
+  // Recomputed only when the calibration or the thresholds change; false if a cut is not exact
+  bool update_cuts(strip_cuts &cuts, const calib &cal, int n, float highThresh, float lowThresh, bool absolute)
+  {
+    if ((int)cuts.high.size() == n && cuts.highThresh == highThresh && cuts.lowThresh == lowThresh &&
+        cuts.absolute == absolute && std::memcmp(cal.status.data(), cuts.status.data(), n * sizeof(int)) == 0 &&
+        (absolute || std::memcmp(cal.sig.data(), cuts.sig.data(), n * sizeof(float)) == 0)) // bitwise, also for NaN
+    {
+      return cuts.exact;
+    }
+
+    cuts.sig.assign(cal.sig.begin(), cal.sig.begin() + n);
+    cuts.status.assign(cal.status.begin(), cal.status.begin() + n);
+    cuts.highThresh = highThresh;
+    cuts.lowThresh = lowThresh;
+    cuts.absolute = absolute;
+    cuts.high.resize(n);
+    cuts.low.resize(n);
+    cuts.zero_high.assign(n / 64 + 1, 0);
+    cuts.zero_low.assign(n / 64 + 1, 0);
+    cuts.exact = true;
+
+    const float inf = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < n; i++)
+    {
+      if (cal.status[i] != 0)
+      {
+        cuts.high[i] = inf;
+        cuts.low[i] = inf;
+      }
+      else if (absolute)
+      {
+        cuts.high[i] = highThresh;
+        cuts.low[i] = lowThresh;
+      }
+      else if (!sn_cut(highThresh, cal.sig[i], cuts.high[i]) || !sn_cut(lowThresh, cal.sig[i], cuts.low[i]))
+      {
+        cuts.exact = false;
+      }
+      cuts.zero_high[i / 64] |= (uint64_t)(0.f > cuts.high[i]) << (i % 64);
+      cuts.zero_low[i / 64] |= (uint64_t)(0.f > cuts.low[i]) << (i % 64);
+    }
+    return cuts.exact;
+  }
+
+  // Bits of the m <= 64 strips from adc over the cuts (float, or int16 for the fixed point pipeline).
+  // The comparisons are done as bytes (vectorized) and packed 8 at a time
+  template <typename Sample>
+  inline void mask_block(const Sample *adc, const Sample *high, const Sample *low, int m,
+                         uint64_t &high_bits, uint64_t &low_bits)
+  {
+    unsigned char over_high[64] = {0};
+    unsigned char over_low[64] = {0};
+    for (int i = 0; i < m; i++)
+    {
+      over_high[i] = adc[i] > high[i];
+      over_low[i] = adc[i] > low[i];
+    }
+
+    high_bits = 0;
+    low_bits = 0;
+    for (int byte = 0; byte < 64; byte += 8)
+    {
+      high_bits |= pack_bytes(over_high + byte) << byte;
+      low_bits |= pack_bytes(over_low + byte) << byte;
+    }
+  }
+
+  // Bitmasks of the strips over the cuts, one extra word of unset bits at the end.
+  // NChannels is the channel count of a detector profile, or 0 for any other size
+  template <int NChannels>
+  void build_masks(cluster_arena &arena, const float *adc, int size)
+  {
+    const int n = NChannels ? NChannels : size;
+    arena.high_mask.assign(n / 64 + 1, 0);
+    arena.low_mask.assign(n / 64 + 1, 0);
+
+    for (int first = 0; first < n; first += 64)
+    {
+      mask_block(adc + first, arena.cuts.high.data() + first, arena.cuts.low.data() + first, std::min(64, n - first),
+                 arena.high_mask[first / 64], arena.low_mask[first / 64]);
+    }
+  }
+
+  // ADC values of the strips of a cluster: float samples are used as they are, fixed point ones
+  // are converted in the scratch space of the arena
+  inline const float *cluster_adc(cluster_arena &, const float *first, int)
+  {
+    return first;
+  }
+
+  inline const float *cluster_adc(cluster_arena &clusters, const int16_t *first, int width)
+  {
+    clusters.converted.resize(width);
+    for (int i = 0; i < width; i++)
+    {
+      clusters.converted[i] = first[i] * (1.f / FIXED_SCALE);
+    }
+    return clusters.converted.data();
+  }
+
+  // clusterize_event on the bitmasks already in the arena. zero_high and zero_low are the bits of
+  // a strip set to 0, for the strips of each cluster added
+  template <typename Sample>
+  clusterize_status clusterize_masks(cluster_arena &clusters, Sample *signal, int n,
+                                     const uint64_t *zero_high, const uint64_t *zero_low,
+                                     bool symmetric, int symmetric_width, bool truncate)
+  {
+    std::vector<int> &seeds = clusters.seeds;
+
+    // seeds are the first strip of each run of strips over the high threshold
+    uint64_t *high = clusters.high_mask.data();
+    uint64_t *low = clusters.low_mask.data();
+    uint64_t previous = 0; // last bit of the previous word
+    for (size_t w = 0; w < clusters.high_mask.size(); w++)
+    {
+      uint64_t first_bits = high[w] & ~(high[w] << 1 | previous);
+      previous = high[w] >> 63;
+      while (first_bits && seeds.size() <= maxClusters) // one more than maxClusters is enough to know
+      {
+        seeds.push_back(64 * w + __builtin_ctzll(first_bits));
+        first_bits &= first_bits - 1;
+      }
+    }
+
+    if (seeds.size() == 0)
+    {
+      return CLUSTERIZE_no_seed;
+    }
+
+    clusterize_status status = CLUSTERIZE_ok;
+    if (seeds.size() > maxClusters)
+    {
+      status = CLUSTERIZE_overflow;
+      if (!truncate)
+      {
+        return status;
+      }
+      seeds.resize(maxClusters);
+    }
+
+    for (int seed : seeds)
+    {
+      if (symmetric)
+      {
+        if (seed - symmetric_width > 0 && seed + symmetric_width < n)
+        {
+          int width = 2 * symmetric_width + 1;
+          const float *clusterADC = cluster_adc(clusters, signal + (seed - symmetric_width), width);
+          if (std::accumulate(clusterADC, clusterADC + width, 0) > 0)
+          {
+            clusters.add(seed - symmetric_width, width, -999, clusterADC);
+          }
+        }
+        continue;
+      }
+
+      // cluster edges from the bitmask of the strips over the low threshold
+      int L = run_down(low, seed);
+      int R = run_up(low, seed);
+      int width = (R + L) + 1;
+      const float *clusterADC = cluster_adc(clusters, signal + (seed - L), width);
+
+      if (std::accumulate(clusterADC, clusterADC + width, 0) > 0)
+      {
+        int overSEED = 1 + count_bits(high, seed - L, seed + R) - (int)(high[seed / 64] >> (seed % 64) & 1);
+        clusters.add(seed - L, width, overSEED, clusterADC);
+
+        // the clustered strips are set to 0, in the signal and in the masks
+        std::fill(signal + (seed - L), signal + (seed + R) + 1, 0);
+        copy_bits(high, zero_high, seed - L, seed + R);
+        copy_bits(low, zero_low, seed - L, seed + R);
+      }
+    }
+    return status;
+  }
+}
+
+clusterize_status clusterize_event(cluster_arena &clusters, calib *cal, std::vector<float> *signal,
+                                   float highThresh, float lowThresh,
+                                   bool symmetric, int symmetric_width,
+                                   bool absoluteThresholds,
+                                   int board,
+                                   int side,
+                                   bool verbose,
+                                   bool truncate)
 {
   int nclust = 0;
-  std::vector<cluster> clusters; // Vector returned with all found clusters
-  cluster new_cluster;           // Struct for a new cluster to add to the results
+  clusters.clear();
+  clusters.board = board;
+  clusters.side = side;
 
-  std::vector<int> candidate_seeds; // candidate "seeds" are defined as strips with a value higher than the high_threshold (defined in terms or S/N or absolute value)
-  std::vector<int> seeds;           // some of the candidate seed might actually be part of the same cluster: seed is redefined after the cluster is constructed
+  std::vector<int> &candidate_seeds = clusters.candidate_seeds; // candidate "seeds" are defined as strips with a value higher than the high_threshold (defined in terms or S/N or absolute value)
+  std::vector<int> &seeds = clusters.seeds;                     // some of the candidate seed might actually be part of the same cluster: seed is redefined after the cluster is constructed
+  candidate_seeds.clear();
+  seeds.clear();
 
   if (highThresh < lowThresh)
   {
@@ -772,6 +1414,17 @@ std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
     highThresh = temp;
   }
 
+  const int n = signal->size();
+  if (!verbose && (int)cal->status.size() >= n && (int)cal->sig.size() >= n &&
+      update_cuts(clusters.cuts, *cal, n, highThresh, lowThresh, absoluteThresholds))
+  {
+    with_channels(n, [&](auto channels)
+                  { build_masks<decltype(channels)::value>(clusters, signal->data(), n); });
+    return clusterize_masks(clusters, signal->data(), n, clusters.cuts.zero_high.data(), clusters.cuts.zero_low.data(),
+                            symmetric, symmetric_width, truncate);
+  }
+
+  // scalar version: verbose, or some strip without an exact cut in ADC
   for (uint i = 0; i < signal->size(); i++)
   {
     if (absoluteThresholds) // Thresholds are in units of ADC
@@ -790,24 +1443,37 @@ std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
     }
   }
 
-  if (candidate_seeds.size() != 0)
+  if (candidate_seeds.size() == 0)
   {
-    seeds.push_back(candidate_seeds.at(0));
+    if (verbose)
+    {
+      std::cout << "Candidate seeds 0" << std::endl;
+    }
+    return CLUSTERIZE_no_seed;
+  }
 
-    if (candidate_seeds.size() > 1)
+  seeds.push_back(candidate_seeds.at(0));
+  for (uint i = 1; i < candidate_seeds.size(); i++)
+  {
+    if (std::abs(candidate_seeds.at(i) - candidate_seeds.at(i - 1)) != 1) // Removing adjacent candidate seeds for the cluster: keeping only the first, the second will be naturally part of the cluster at the end
     {
-      for (uint i = 1; i < candidate_seeds.size(); i++)
-      {
-        if (std::abs(candidate_seeds.at(i) - candidate_seeds.at(i - 1)) != 1) // Removing adjacent candidate seeds for the cluster: keeping only the first, the second will be naturally part of the cluster at the end
-        {
-          seeds.push_back(candidate_seeds.at(i));
-        }
-      }
+      seeds.push_back(candidate_seeds.at(i));
     }
-    if (seeds.size() > maxClusters || seeds.size() == 0) // cut on max number of clusters
+  }
+
+  clusterize_status status = CLUSTERIZE_ok;
+  if (seeds.size() > maxClusters) // cut on max number of clusters
+  {
+    status = CLUSTERIZE_overflow;
+    if (!truncate)
     {
-      throw "Error: too many or no seeds. ";
+      if (verbose)
+      {
+        std::cout << "Too many seeds: " << seeds.size() << std::endl;
+      }
+      return status;
     }
+    seeds.resize(maxClusters);
   }
 
   if (verbose)
@@ -829,27 +1495,16 @@ std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
       int R = 0;
       //
 
-      int width = 0;                 // cluster width
-      std::vector<float> clusterADC; // ADC value of strips in the clusters
-
       if (symmetric) // Cluster is defined as a fixed number of strips neighboring the seed
       {
         if (seeds.at(current_seed_numb) - symmetric_width > 0 && (uint)(seeds.at(current_seed_numb) + symmetric_width) < signal->size())
         {
-          std::copy(signal->begin() + (seeds.at(current_seed_numb) - symmetric_width),
-                    signal->begin() + (seeds.at(current_seed_numb) + symmetric_width) + 1,
-                    back_inserter(clusterADC));
+          const float *clusterADC = signal->data() + (seeds.at(current_seed_numb) - symmetric_width); // ADC value of strips in the clusters
+          int width = 2 * symmetric_width + 1;
 
-          if (std::accumulate(clusterADC.begin(), clusterADC.end(), 0) > 0)
+          if (std::accumulate(clusterADC, clusterADC + width, 0) > 0)
           {
-
-            new_cluster.address = seeds.at(current_seed_numb) - symmetric_width;
-            new_cluster.width = 2 * symmetric_width + 1;
-            new_cluster.ADC = clusterADC;
-            new_cluster.over = -999;
-            new_cluster.board = board;
-            new_cluster.side = side;
-            clusters.push_back(new_cluster);
+            clusters.add(seeds.at(current_seed_numb) - symmetric_width, width, -999, clusterADC);
           }
         }
         else // Cluster can't be contained in the detector
@@ -950,20 +1605,12 @@ std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
           }
         }
 
-        std::copy(signal->begin() + (seeds.at(current_seed_numb) - L),
-                  signal->begin() + (seeds.at(current_seed_numb) + R) + 1,
-                  back_inserter(clusterADC)); // we copy the strips that are part of the cluster to the buffer vector
+        const float *clusterADC = signal->data() + (seeds.at(current_seed_numb) - L); // strips that are part of the cluster
+        int width = (R + L) + 1;
 
-        if (std::accumulate(clusterADC.begin(), clusterADC.end(), 0) > 0)
+        if (std::accumulate(clusterADC, clusterADC + width, 0) > 0)
         {
-          // setting parameters to the correct value in the cluster struct
-          new_cluster.address = seeds.at(current_seed_numb) - L;
-          new_cluster.width = (R + L) + 1;
-          new_cluster.ADC = clusterADC;
-          new_cluster.over = overSEED;
-          new_cluster.board = board;
-          new_cluster.side = side;
-          clusters.push_back(new_cluster); // adding new cluster to cluster result vector
+          clusters.add(seeds.at(current_seed_numb) - L, width, overSEED, clusterADC); // adding new cluster to cluster result
 
           nclust++;
 
@@ -979,5 +1626,304 @@ std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
       }
     }
   }
-  return clusters;
+  return status;
+}
+
+clusterize_status clusterize_event_cn(cluster_arena &clusters, calib *cal, std::vector<float> *signal,
+                                     const std::vector<float> &va_cn, float &highest,
+                                     float highThresh, float lowThresh,
+                                     bool symmetric, int symmetric_width,
+                                     bool absoluteThresholds,
+                                     int board,
+                                     int side,
+                                     bool truncate)
+{
+  const int n = signal->size();
+  float *adc = signal->data();
+  float high = std::max(highThresh, lowThresh); // same swap as clusterize_event
+  float low = std::min(highThresh, lowThresh);
+  bool masks = (int)cal->status.size() >= n && (int)cal->sig.size() >= n &&
+               update_cuts(clusters.cuts, *cal, n, high, low, absoluteThresholds);
+  if (masks)
+  {
+    clusters.high_mask.assign(n / 64 + 1, 0);
+    clusters.low_mask.assign(n / 64 + 1, 0);
+  }
+
+  highest = 0;
+  for (int first = 0; first < n; first += 64) // one VA at a time, while it is in L1
+  {
+    const int m = std::min(64, n - first);
+    float *block = adc + first;
+    if (first / 64 < (int)va_cn.size())
+    {
+      const float cn = va_cn[first / 64];
+      for (int i = 0; i < m; i++)
+      {
+        block[i] = std::isnan(cn) ? 0 : block[i] - cn; // invalid common noise: VA set to 0
+      }
+    }
+
+    if (first == 0)
+    {
+      highest = block[0];
+    }
+    for (int i = 0; i < m; i++) // as std::max_element
+    {
+      if (highest < block[i])
+      {
+        highest = block[i];
+      }
+    }
+
+    if (masks)
+    {
+      mask_block(block, clusters.cuts.high.data() + first, clusters.cuts.low.data() + first, m,
+                 clusters.high_mask[first / 64], clusters.low_mask[first / 64]);
+    }
+  }
+
+  if (!masks)
+  {
+    return clusterize_event(clusters, cal, signal, highThresh, lowThresh, symmetric, symmetric_width,
+                            absoluteThresholds, board, side, false, truncate);
+  }
+
+  clusters.clear();
+  clusters.board = board;
+  clusters.side = side;
+  return clusterize_masks(clusters, adc, n, clusters.cuts.zero_high.data(), clusters.cuts.zero_low.data(),
+                          symmetric, symmetric_width, truncate);
+}
+
+namespace
+{
+  inline int16_t saturate(int32_t value)
+  {
+    return std::min<int32_t>(std::max<int32_t>(value, INT16_MIN), INT16_MAX);
+  }
+
+  // Cut in 1/8 ADC for thresh (ADC or S/N): signal > cut <=> signal / FIXED_SCALE > thresh * sigma
+  int16_t fixed_cut(float thresh, float sigma, bool absolute)
+  {
+    double cut = (double)thresh * (absolute ? 1 : sigma) * FIXED_SCALE;
+    if (std::isnan(cut) || cut >= INT16_MAX)
+    {
+      return INT16_MAX; // never over threshold
+    }
+    return std::max<double>(std::floor(cut), INT16_MIN);
+  }
+
+  // Sum and count of the strips strictly between lo and hi, in 1/8 ADC
+  inline void band_sum(const int16_t *strips, int count, double lo, double hi, int32_t &sum, int &cnt)
+  {
+    const int32_t l = std::max<double>(std::floor(lo), INT16_MIN - 1); // s > lo <=> s > floor(lo) for integer s
+    const int32_t h = std::min<double>(std::ceil(hi), INT16_MAX + 1);  // s < hi <=> s < ceil(hi)
+    sum = 0;
+    cnt = 0;
+    for (int i = 0; i < count; i++)
+    {
+      const bool in = strips[i] > l && strips[i] < h;
+      sum += in ? strips[i] : 0;
+      cnt += in;
+    }
+  }
+
+  inline float fixed_cn(int32_t sum, int cnt) // mean rounded to 1/8 ADC, in ADC
+  {
+    return std::lround((double)sum / cnt) * (1.f / FIXED_SCALE);
+  }
+}
+
+void make_fixed_calib(fixed_calib &fc, const calib &cal, int n, float highThresh, float lowThresh, bool absoluteThresholds)
+{
+  float high = std::max(highThresh, lowThresh); // same swap as clusterize_event
+  float low = std::min(highThresh, lowThresh);
+  fc.ped.resize(n);
+  fc.good.resize(n);
+  fc.high.resize(n);
+  fc.low.resize(n);
+  fc.zero_high.assign(n / 64 + 1, 0);
+  fc.zero_low.assign(n / 64 + 1, 0);
+  for (int i = 0; i < n; i++)
+  {
+    fc.ped[i] = std::lround((double)cal.ped.at(i) * FIXED_SCALE);
+    fc.good[i] = cal.status.at(i) == 0;
+    float sigma = absoluteThresholds ? 1 : cal.sig.at(i);
+    fc.high[i] = fc.good[i] ? fixed_cut(high, sigma, absoluteThresholds) : INT16_MAX;
+    fc.low[i] = fc.good[i] ? fixed_cut(low, sigma, absoluteThresholds) : INT16_MAX;
+    fc.zero_high[i / 64] |= (uint64_t)(0 > fc.high[i]) << (i % 64);
+    fc.zero_low[i / 64] |= (uint64_t)(0 > fc.low[i]) << (i % 64);
+  }
+}
+
+void GetFixedEventCN(event_cn &cn, std::vector<int16_t> &signal, const std::vector<unsigned int> &raw, const fixed_calib &fc, bool invert)
+{
+  const int n = raw.size();
+  signal.resize(n);
+  size_event_cn(cn, n / 64);
+
+  for (int ch = 0; ch < n; ch++) // pedestal subtraction, bad channels set to 0
+  {
+    int32_t value = (int32_t)(raw[ch] * FIXED_SCALE) - fc.ped[ch];
+    value = invert ? -value : value;
+    signal[ch] = fc.good[ch] ? saturate(value) : 0;
+  }
+
+  for (int va = 0; va < cn.NVas; va++)
+  {
+    const int16_t *strips = signal.data() + 64 * va;
+    int64_t sum = 0;
+    int64_t sum2 = 0;
+    for (int i = 0; i < 64; i++)
+    {
+      sum += strips[i];
+      sum2 += strips[i] * strips[i];
+    }
+    const double mean = sum / 64.;
+    const double rms = std::sqrt(std::max((sum2 - sum * mean) / 63., 0.)); // as TMath::RMS
+    cn.mean[va] = mean / FIXED_SCALE;
+    cn.rms[va] = rms / FIXED_SCALE;
+
+    int32_t band;
+    int cnt;
+    band_sum(strips, 64, mean - 2 * rms, mean + 2 * rms, band, cnt); // type 0: around the VA mean
+    cn.valid[0][va] = cnt != 0;
+    cn.cn[0][va] = cnt ? fixed_cn(band, cnt) : -999;
+
+    band_sum(strips, 64, -HUGE_VAL, MIP_ADC / 2 * FIXED_SCALE, band, cnt); // type 1: below half a MIP
+    cn.valid[1][va] = cnt != 0;
+    cn.cn[1][va] = cnt ? fixed_cn(band, cnt) : -999;
+
+    int32_t hard;
+    int hard_cnt;
+    band_sum(strips + 8, 15, -HUGE_VAL, 1.5 * MIP_ADC * FIXED_SCALE, hard, hard_cnt); // type 2: baseline, then a band around it
+    cnt = 0;
+    if (hard_cnt)
+    {
+      const double baseline = (double)hard / hard_cnt;
+      band_sum(strips + 23, 32, baseline - 2 * rms, baseline + 2 * rms, band, cnt);
+    }
+    cn.valid[2][va] = cnt != 0;
+    cn.cn[2][va] = cnt ? fixed_cn(band, cnt) : -999;
+  }
+}
+
+clusterize_status clusterize_fixed_event(cluster_arena &clusters, const fixed_calib &fc, std::vector<int16_t> &signal,
+                                         const std::vector<float> &va_cn, float &highest,
+                                         bool symmetric, int symmetric_width,
+                                         int board,
+                                         int side,
+                                         bool truncate)
+{
+  const int n = signal.size();
+  int16_t *adc = signal.data();
+  clusters.high_mask.assign(n / 64 + 1, 0);
+  clusters.low_mask.assign(n / 64 + 1, 0);
+
+  int16_t max = n ? INT16_MIN : 0;
+  for (int first = 0; first < n; first += 64) // one VA at a time, as clusterize_event_cn
+  {
+    const int m = std::min(64, n - first);
+    int16_t *block = adc + first;
+    if (first / 64 < (int)va_cn.size() && std::isnan(va_cn[first / 64]))
+    {
+      std::fill(block, block + m, 0); // invalid common noise: VA set to 0
+    }
+    else if (first / 64 < (int)va_cn.size())
+    {
+      const int32_t cn = std::lround(va_cn[first / 64] * FIXED_SCALE);
+      for (int i = 0; i < m; i++)
+      {
+        block[i] = saturate(block[i] - cn);
+      }
+    }
+    for (int i = 0; i < m; i++)
+    {
+      max = std::max(max, block[i]);
+    }
+    mask_block(block, fc.high.data() + first, fc.low.data() + first, m,
+               clusters.high_mask[first / 64], clusters.low_mask[first / 64]);
+  }
+  highest = max * (1.f / FIXED_SCALE);
+
+  clusters.clear();
+  clusters.board = board;
+  clusters.side = side;
+  return clusterize_masks(clusters, adc, n, fc.zero_high.data(), fc.zero_low.data(),
+                          symmetric, symmetric_width, truncate);
+}
+
+void cluster_table::clear()
+{
+  event.clear();
+  address.clear();
+  width.clear();
+  over.clear();
+  offset.clear();
+  adc.clear();
+  status.clear();
+}
+
+int clusterize_events(cluster_table &table, calib *cal, std::vector<float> &events, const std::vector<char> &valid,
+                      int NChannels, float highThresh, float lowThresh,
+                      bool symmetric, int symmetric_width,
+                      bool absoluteThresholds,
+                      int board,
+                      int side,
+                      bool truncate)
+{
+  table.clear();
+  table.board = board;
+  table.side = side;
+  const int nevents = valid.size();
+  const size_t complete = NChannels > 0 ? events.size() / NChannels : 0; // events entirely in the block
+
+  cluster_arena &arena = table.arena;
+  float high = std::max(highThresh, lowThresh); // same swap as clusterize_event
+  float low = std::min(highThresh, lowThresh);
+  bool covered = NChannels > 0 && (int)cal->status.size() >= NChannels && (int)cal->sig.size() >= NChannels;
+  bool masks = covered && update_cuts(arena.cuts, *cal, NChannels, high, low, absoluteThresholds);
+  std::vector<float> row; // scalar version, with a std::vector for each event
+
+  for (int ev = 0; ev < nevents; ev++)
+  {
+    if (!valid[ev] || !covered || (size_t)ev >= complete)
+    {
+      table.status.push_back(CLUSTERIZE_invalid);
+      continue;
+    }
+
+    float *signal = events.data() + (size_t)ev * NChannels;
+    clusterize_status status;
+    if (masks)
+    {
+      arena.clear();
+      arena.board = board;
+      arena.side = side;
+      with_channels(NChannels, [&](auto channels)
+                    { build_masks<decltype(channels)::value>(arena, signal, NChannels); });
+      status = clusterize_masks(arena, signal, NChannels, arena.cuts.zero_high.data(), arena.cuts.zero_low.data(),
+                                symmetric, symmetric_width, truncate);
+    }
+    else
+    {
+      row.assign(signal, signal + NChannels);
+      status = clusterize_event(arena, cal, &row, highThresh, lowThresh, symmetric, symmetric_width,
+                                absoluteThresholds, board, side, false, truncate);
+      std::copy(row.begin(), row.end(), signal);
+    }
+    table.status.push_back(status);
+
+    for (size_t i = 0; i < arena.size(); i++)
+    {
+      table.event.push_back(ev);
+      table.address.push_back(arena.address[i]);
+      table.width.push_back(arena.width[i]);
+      table.over.push_back(arena.over[i]);
+      table.offset.push_back(table.adc.size());
+      table.adc.insert(table.adc.end(), arena.ADC(i), arena.ADC(i) + arena.width[i]);
+    }
+  }
+  return table.size();
 }
@@ -3,6 +3,7 @@
 
 #include "TMath.h"
 #include "TROOT.h"
+#include <cstdint>
 #include <fstream>
 #include <iterator>
 #include <vector>
@@ -13,6 +14,7 @@
 
 #define MIP_ADC 18 // 50ADC: DAMPE 300um 15ADC:FOOT 150um
 #define maxClusters 100
+#define FIXED_SCALE 8 // fixed point (int16) signal pipeline: units of 1/8 ADC
 
 struct cluster
 {
@@ -24,6 +26,43 @@ struct cluster
   int side;               // side number
 };                // Cluster structure
 
+struct strip_cuts
+{
+  std::vector<float> high; // signal > high[i] <=> strip i is good and over the high threshold
+  std::vector<float> low;  // same for the low threshold
+  std::vector<uint64_t> zero_high, zero_low; // the same bits for a strip set to 0 (already clustered)
+  bool exact = false; // false when some strip can't be cut this way (sigma <= 0 or inf): no bitmasks
+
+  std::vector<float> sig; // calibration and thresholds the cuts were computed for
+  std::vector<int> status;
+  float highThresh = 0;
+  float lowThresh = 0;
+  bool absolute = false;
+}; // per strip thresholds of clusterize_event, in ADC
+
+struct cluster_arena
+{
+  std::vector<unsigned short> address; // first strip of each cluster
+  std::vector<int> width;              // width of each cluster
+  std::vector<int> over;               // number of strips over high threshold
+  std::vector<int> offset;             // position of the first ADC value of each cluster in adc
+  std::vector<float> adc;              // ADC content of all the clusters, one after the other
+  int board = 0;
+  int side = 0;
+
+  std::vector<int> candidate_seeds; // clusterize_event scratch space, kept to avoid allocations
+  std::vector<int> seeds;
+  strip_cuts cuts;                  // recomputed only when the calibration or the thresholds change
+  std::vector<uint64_t> high_mask;  // one bit per strip: over the high threshold
+  std::vector<uint64_t> low_mask;   // over the low threshold
+  std::vector<float> converted;      // fixed point strips of a cluster converted to ADC
+
+  size_t size() const { return address.size(); }
+  const float *ADC(size_t i) const { return adc.data() + offset[i]; }
+  void clear(); // keeps the allocated memory for the next event, scratch space included
+  void add(unsigned short first_strip, int nstrips, int nover, const float *ADC);
+}; // clusters of one event (structure of arrays), reused from event to event
+
 struct calib
 {
   std::vector<float> ped;  // pedestals
@@ -32,50 +71,91 @@ struct calib
   std::vector<int> status; // status of strip (0 good, !0 bad)
 };                   // calibration structure
 
-int PrintCluster(cluster clus);
+struct cluster_features
+{
+  float signal = 0;        // ADC of the whole cluster
+  float cog = -999;        // center of gravity, in strips
+  float eta = -999;        // charge sharing between the two highest strips
+  int seed = -999;         // strip with the highest S/N (-999 without calibration)
+  int seed_index = -999;   // position of the seed in the cluster
+  int second = -999;       // strip next to the seed with the highest ADC
+  int second_index = -999; // its position in the cluster, -1 for single strip clusters
+  float seed_adc = -999;   // ADC of the seed
+  float sn = -999;         // S/N of the whole cluster
+  float seed_sn = -999;    // S/N of the seed
+}; // everything the analysis needs from a cluster, computed in one pass
 
-int GetClusterAddress(cluster clus);
-int GetClusterWidth(cluster clus);
-int GetClusterOver(cluster clus);
-int GetClusterBoard(cluster clus);
-int GetClusterSide(cluster clus);
-std::vector<float> GetClusterADC(cluster clus);
+struct event_cn
+{
+  int NVas = 0;
+  int lanes = 0;             // NVas rounded up to a multiple of 8, the padding VAs are ignored
+  std::vector<float> strips; // transposed event: strips[strip * lanes + va]
+  std::vector<float> mean;   // per VA, TMath::Mean as in GetCN (of the channels below threshold for SHOE)
+  std::vector<float> rms;    // per VA, TMath::RMS as in GetCN
+  std::vector<float> cn[3];  // per algorithm and VA, -999 when it cannot be computed
+  std::vector<char> valid[3];
+  std::vector<float> shoe;   // per VA, SHOE common noise from ComputeEventCN_ty (0 when it cannot be computed)
+
+  float get(int va, int type) const { return cn[type == 0 || type == 1 ? type : 2][va]; } // same type convention as GetCN
+}; // common noise of every VA of an event, for the three GetCN algorithms and the SHOE one
+
+// Features of a cluster: the ones depending on the noise (seed, second, S/N) are computed only when cal is given
+cluster_features GetClusterFeatures(const cluster &clus, calib *cal = nullptr);
+
+int PrintCluster(const cluster &clus);
 
-float GetClusterSignal(cluster clus);
+int GetClusterAddress(const cluster &clus);
+int GetClusterWidth(const cluster &clus);
+int GetClusterOver(const cluster &clus);
+int GetClusterBoard(const cluster &clus);
+int GetClusterSide(const cluster &clus);
+const std::vector<float> &GetClusterADC(const cluster &clus);
 
-float GetClusterCOG(cluster clus);
+float GetClusterSignal(const cluster &clus);
 
-int GetClusterSeed(cluster clus, calib *cal);
+float GetClusterCOG(const cluster &clus);
 
-int GetClusterSecond(cluster clus, calib *cal);
+int GetClusterSeed(const cluster &clus, calib *cal);
 
-int GetClusterSeedIndex(cluster clus, calib *cal);
+int GetClusterSecond(const cluster &clus, calib *cal);
 
-int GetClusterSecondIndex(cluster clus, calib *cal);
+int GetClusterSeedIndex(const cluster &clus, calib *cal);
 
-float GetClusterSeedADC(cluster clus, calib *cal);
+int GetClusterSecondIndex(const cluster &clus, calib *cal);
 
-float GetClusterSecondADC(cluster clus, calib *cal);
+float GetClusterSeedADC(const cluster &clus, calib *cal);
 
-int GetClusterVA(cluster clus, calib *cal);
+float GetClusterSecondADC(const cluster &clus, calib *cal);
+
+int GetClusterVA(const cluster &clus, calib *cal);
 
 float GetCN(std::vector<float> *signal, int va, int type);
 
+// All the VAs of an event at once, bit-for-bit equal to GetCN(signal, va, type) for every va and type
+void GetEventCN(event_cn &cn, const std::vector<float> &signal);
+
 float ComputeCN_ty(std::vector<float> *vaContent, int type, bool debug, double threshold);
 
-float GetClusterSN(cluster clus, calib *cal);
+// Pedestal subtraction of a raw event (bad channels set to 0, inverted if invert), written in signal
+// and in the transposed buffer of cn in the same pass, then GetEventCN. cal must cover the event
+void GetRawEventCN(event_cn &cn, std::vector<float> &signal, const std::vector<unsigned int> &raw, const calib &cal, bool invert);
+
+// SHOE common noise of all the VAs of an event into cn.shoe, bit-for-bit equal to ComputeCN_ty on each VA
+void ComputeEventCN_ty(event_cn &cn, const std::vector<float> &signal, int type, double threshold);
 
-float GetSeedSN(cluster clus, calib *cal);
+float GetClusterSN(const cluster &clus, calib *cal);
 
-float GetClusterEta(cluster clus);
+float GetSeedSN(const cluster &clus, calib *cal);
 
-float GetPosition(cluster clus, float sensor_pitch);
+float GetClusterEta(const cluster &clus);
 
-float GetClusterMIPCharge(cluster clus);
+float GetPosition(const cluster &clus, float sensor_pitch);
 
-float GetSeedMIPCharge(cluster clus, calib *cal);
+float GetClusterMIPCharge(const cluster &clus);
 
-bool GoodCluster(cluster clus, calib *cal);
+float GetSeedMIPCharge(const cluster &clus, calib *cal);
+
+bool GoodCluster(const cluster &clus, calib *cal);
 
 bool read_calib(const char *calib_file, calib *cal, int NChannels, int detector, bool verb);
 
@@ -83,12 +163,96 @@ std::vector<calib> read_calib_all(const char *calib_file, bool verb);
 
 std::vector<std::pair<float, bool>> read_alignment(const char *alignment_file);
 
-std::vector<cluster> clusterize_event(calib *cal, std::vector<float> *signal,
-                                      float highThresh, float lowThresh,
-                                      bool symmetric, int symmetric_width,
-                                      bool absoluteThresholds,
-                                      int board,
-                                      int side,
-                                      bool verbose);
+enum clusterize_status
+{
+  CLUSTERIZE_ok = 0,      // clusters built from all the seeds (possibly none passed the cuts)
+  CLUSTERIZE_no_seed = 1, // no strip over the high threshold
+  CLUSTERIZE_overflow = 2, // more than maxClusters seeds: no clusters, or the first maxClusters if truncate
+  CLUSTERIZE_invalid = 3   // clusterize_events: event not valid or not covered by the block or the calibration, not clusterized
+};
+
+// Does not throw: busy events are reported with CLUSTERIZE_overflow
+clusterize_status clusterize_event(cluster_arena &clusters, calib *cal, std::vector<float> *signal,
+                                   float highThresh, float lowThresh,
+                                   bool symmetric, int symmetric_width,
+                                   bool absoluteThresholds,
+                                   int board,
+                                   int side,
+                                   bool verbose,
+                                   bool truncate = false);
+
+void to_clusters(const cluster_arena &arena, std::vector<cluster> &clusters); // reuses the memory of clusters
+
+// Second half of the fused event kernel (after GetRawEventCN): subtracts va_cn[va] from the strips of
+// every VA (no subtraction for VAs past va_cn.size(), a NaN va_cn[va] sets the VA to 0, as an invalid
+// common noise in raw_clusterize), sets highest as std::max_element and builds the
+// bitmasks of clusterize_event in the same pass, one VA at a time. Same clusters as clusterize_event
+clusterize_status clusterize_event_cn(cluster_arena &clusters, calib *cal, std::vector<float> *signal,
+                                     const std::vector<float> &va_cn, float &highest,
+                                     float highThresh, float lowThresh,
+                                     bool symmetric, int symmetric_width,
+                                     bool absoluteThresholds,
+                                     int board,
+                                     int side,
+                                     bool truncate = false);
+
+struct fixed_calib
+{
+  std::vector<int32_t> ped;  // pedestals in 1/8 ADC
+  std::vector<char> good;    // status 0
+  std::vector<int16_t> high; // signal > high[i] <=> good strip over the high threshold, in 1/8 ADC
+  std::vector<int16_t> low;  // same for the low threshold
+  std::vector<uint64_t> zero_high, zero_low; // the same bits for a strip set to 0
+}; // calibration and thresholds of the fixed point pipeline, converted once
+
+// Fixed point version of the calibration for the first n channels: pedestals rounded to 1/8 ADC,
+// S/N thresholds turned into cuts in 1/8 ADC (rounded down), bad strips never over threshold
+void make_fixed_calib(fixed_calib &fc, const calib &cal, int n, float highThresh, float lowThresh, bool absoluteThresholds);
+
+// Fixed point GetRawEventCN: pedestal subtracted signal in 1/8 ADC (saturated to int16) and the three
+// common noise algorithms of GetCN on int sums. cn.cn holds the common noise rounded to 1/8 ADC, in ADC,
+// and cn.mean, cn.rms the VA mean and RMS in ADC
+void GetFixedEventCN(event_cn &cn, std::vector<int16_t> &signal, const std::vector<unsigned int> &raw, const fixed_calib &fc, bool invert);
+
+// Fixed point clusterize_event_cn: common noise subtraction (va_cn in ADC, rounded to 1/8 ADC, NaN for 0), highest
+// strip (in ADC) and clustering on the int16 signal. The cluster ADC values are converted to float
+clusterize_status clusterize_fixed_event(cluster_arena &clusters, const fixed_calib &fc, std::vector<int16_t> &signal,
+                                         const std::vector<float> &va_cn, float &highest,
+                                         bool symmetric, int symmetric_width,
+                                         int board,
+                                         int side,
+                                         bool truncate = false);
+
+struct cluster_table
+{
+  std::vector<int> event;              // event of each cluster, position in the block
+  std::vector<unsigned short> address; // first strip of each cluster
+  std::vector<int> width;              // width of each cluster
+  std::vector<int> over;               // number of strips over high threshold
+  std::vector<int> offset;             // position of the first ADC value of each cluster in adc
+  std::vector<float> adc;              // ADC content of all the clusters, one after the other
+  std::vector<clusterize_status> status; // outcome of each event of the block
+  int board = 0;
+  int side = 0;
+
+  cluster_arena arena; // single event scratch space and strip cuts, reused from block to block
+
+  size_t size() const { return address.size(); }
+  const float *ADC(size_t i) const { return adc.data() + offset[i]; }
+  void clear(); // keeps the allocated memory for the next block
+}; // clusters of a block of events (structure of arrays)
+
+// Clusterizes a block of valid.size() pedestal and common noise subtracted events, stored one after
+// the other in events (NChannels values each). The strip cuts are checked once for the whole block;
+// the clusters of each event are the ones of clusterize_event. As in clusterize_event the clustered
+// strips are set to 0. Does not throw: events with valid[i] == 0, past the end of events, or with a
+// calibration shorter than NChannels get CLUSTERIZE_invalid. Returns the number of clusters in the table
+int clusterize_events(cluster_table &table, calib *cal, std::vector<float> &events, const std::vector<char> &valid,
+                      int NChannels, float highThresh, float lowThresh,
+                      bool symmetric, int symmetric_width,
+                      bool absoluteThresholds,
+                      int board,
+                      int side,
+                      bool truncate = false);
 
 #endif
@@ -0,0 +1,176 @@
+#include "instrument.h"
+
+#ifdef INSTRUMENT
+
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include "TString.h"
+
+namespace
+{
+  std::atomic<long long> allocations{0};
+  std::atomic<long long> allocated_bytes{0};
+
+  struct instrument_registry
+  {
+    std::mutex mutex;
+    std::deque<instrument_entry> entries; // stable addresses
+    std::string program;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  };
+
+  instrument_registry &registry() // never destroyed: still there for the report at exit
+  {
+    static instrument_registry *r = new instrument_registry;
+    return *r;
+  }
+
+  void report()
+  {
+    instrument_registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.start).count();
+    long long nalloc = allocations.load();
+    long long nbytes = allocated_bytes.load();
+
+    long long events = 0;
+    for (const instrument_entry &e : r.entries)
+    {
+      if (!e.timer && !strcmp(e.name, "events"))
+      {
+        events = e.count.load();
+      }
+    }
+
+    std::cout << "\n==================== Instrumentation: " << r.program << " ====================" << std::endl;
+    std::cout << Form("wall time %.3f s, %lld events, %.1f events/s", wall, events, wall > 0 ? events / wall : 0.) << std::endl;
+    std::cout << Form("%-24s %12s %12s %8s %12s", "stage", "calls", "time (s)", "% wall", "us/call") << std::endl;
+    for (const instrument_entry &e : r.entries)
+    {
+      if (e.timer)
+      {
+        double seconds = e.ns.load() * 1e-9;
+        long long calls = e.count.load();
+        std::cout << Form("%-24s %12lld %12.3f %8.1f %12.2f", e.name, calls, seconds, wall > 0 ? 100 * seconds / wall : 0.,
+                          calls ? 1e6 * seconds / calls : 0.)
+                  << std::endl;
+      }
+    }
+    for (const instrument_entry &e : r.entries)
+    {
+      if (!e.timer)
+      {
+        std::cout << Form("%-24s %12lld", e.name, e.count.load()) << std::endl;
+      }
+    }
+    std::cout << Form("heap allocations: %lld (%.1f MB), %.1f per event", nalloc, nbytes / (1024. * 1024.),
+                      events ? (double)nalloc / events : 0.)
+              << std::endl;
+
+    const char *json = getenv("INSTRUMENT_JSON");
+    if (!json || !*json)
+    {
+      return;
+    }
+    std::ofstream out(json);
+    if (!out)
+    {
+      std::cout << "ERROR: can't write the instrumentation report to " << json << std::endl;
+      return;
+    }
+    out << "{\"program\": \"" << r.program << "\", \"wall_s\": " << wall << ", \"events\": " << events
+        << ", \"events_per_s\": " << (wall > 0 ? events / wall : 0.) << ",\n \"stages\": [";
+    bool first = true;
+    for (const instrument_entry &e : r.entries)
+    {
+      if (e.timer)
+      {
+        out << (first ? "" : ",") << "\n  {\"name\": \"" << e.name << "\", \"calls\": " << e.count.load()
+            << ", \"seconds\": " << e.ns.load() * 1e-9 << "}";
+        first = false;
+      }
+    }
+    out << "],\n \"counters\": {";
+    first = true;
+    for (const instrument_entry &e : r.entries)
+    {
+      if (!e.timer)
+      {
+        out << (first ? "" : ", ") << "\"" << e.name << "\": " << e.count.load();
+        first = false;
+      }
+    }
+    out << "},\n \"allocations\": " << nalloc << ", \"allocated_bytes\": " << nbytes << "}" << std::endl;
+  }
+}
+
+instrument_entry &instrument_find(const char *name, bool timer)
+{
+  instrument_registry &r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  for (instrument_entry &e : r.entries) // the same stage can be timed at several call sites
+  {
+    if (e.timer == timer && !strcmp(e.name, name))
+    {
+      return e;
+    }
+  }
+  r.entries.emplace_back();
+  r.entries.back().name = name;
+  r.entries.back().timer = timer;
+  return r.entries.back();
+}
+
+void instrument_program(const char *name)
+{
+  instrument_registry &r = registry();
+  r.program = name;
+  r.start = std::chrono::steady_clock::now();
+  std::atexit(report);
+}
+
+// Heap allocations of the whole program, ROOT included
+void *operator new(std::size_t size)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef INSTRUMENT_H_
+#define INSTRUMENT_H_
+
+// Per-stage timers and counters of the analysis tools, compiled in with make INSTRUMENT=1
+// (-DINSTRUMENT) and expanding to nothing otherwise. At exit the program prints the events/s,
+// the time spent in each stage and the heap allocations; with INSTRUMENT_JSON=<file> in the
+// environment the same report is written as JSON. Stage times of multithreaded loops are summed
+// over the threads, so they can add up to more than the wall time
+//
+//   INSTRUMENT_PROGRAM("raw_cn");    start of main: name of the report, start of the wall time
+//   INSTRUMENT_SCOPE("write");       time until the end of the enclosing block
+//   INSTRUMENT_LAP(lap);             stopwatch for the consecutive stages of a loop body,
+//   INSTRUMENT_STAGE(lap, "read");   the time since the previous stage goes to "read"
+//   INSTRUMENT_COUNT("clusters", n); counter
+//   INSTRUMENT_EVENTS(n);            events processed, for the events/s
+
+#ifdef INSTRUMENT
+
+#include <atomic>
+#include <chrono>
+
+struct instrument_entry
+{
+  const char *name;
+  bool timer;                      // stage, otherwise counter
+  std::atomic<long long> ns{0};    // stages: time
+  std::atomic<long long> count{0}; // stages: calls
+};
+
+// Entry of a call site, registered once in order of first use: the macros keep it in a static
+instrument_entry &instrument_find(const char *name, bool timer);
+void instrument_program(const char *name); // report at exit
+
+class instrument_lap
+{
+public:
+  instrument_lap() : last(std::chrono::steady_clock::now()) {}
+
+  void stop(instrument_entry &stage)
+  {
+    auto now = std::chrono::steady_clock::now();
+    stage.ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count(), std::memory_order_relaxed);
+    stage.count.fetch_add(1, std::memory_order_relaxed);
+    last = now;
+  }
+
+private:
+  std::chrono::steady_clock::time_point last;
+};
+
+class instrument_scope
+{
+public:
+  explicit instrument_scope(instrument_entry &stage) : stage(stage) {}
+  ~instrument_scope() { lap.stop(stage); }
+
+private:
+  instrument_entry &stage;
+  instrument_lap lap;
+};
+
+#define INSTRUMENT_CAT2(a, b) a##b
+#define INSTRUMENT_CAT(a, b) INSTRUMENT_CAT2(a, b)
+
+#define INSTRUMENT_PROGRAM(name) instrument_program(name)
+#define INSTRUMENT_SCOPE(name)                                                                              \
+  static instrument_entry &INSTRUMENT_CAT(instrument_stage_, __LINE__) = instrument_find(name, true);       \
+  instrument_scope INSTRUMENT_CAT(instrument_scope_, __LINE__)(INSTRUMENT_CAT(instrument_stage_, __LINE__))
+#define INSTRUMENT_LAP(lap) instrument_lap lap
+#define INSTRUMENT_STAGE(lap, name)                                          \
+  do                                                                         \
+  {                                                                          \
+    static instrument_entry &instrument_stage = instrument_find(name, true); \
+    lap.stop(instrument_stage);                                              \
+  } while (0)
+#define INSTRUMENT_COUNT(name, n)                                               \
+  do                                                                            \
+  {                                                                             \
+    static instrument_entry &instrument_counter = instrument_find(name, false); \
+    instrument_counter.count.fetch_add((n), std::memory_order_relaxed);         \
+  } while (0)
+#define INSTRUMENT_EVENTS(n) INSTRUMENT_COUNT("events", n)
+
+#else
+
+#define INSTRUMENT_PROGRAM(name)
+#define INSTRUMENT_SCOPE(name)
+#define INSTRUMENT_LAP(lap)
+#define INSTRUMENT_STAGE(lap, name)
+#define INSTRUMENT_COUNT(name, n)
+#define INSTRUMENT_EVENTS(n)
+
+#endif
+
+#endif
@@ -0,0 +1,546 @@
+#include "event.h"
+#include "detector_profile.h"
+
+#include <CLI/CLI.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+
+// Bit-for-bit check of the event kernels against the code they replace, on random and edge case
+// events (bad channels, dead and saturated VAs, invalid common noise, busy events, -999 values)
+// of every detector profile:
+// - GetEventCN and GetRawEventCN against GetCN
+// - ComputeEventCN_ty against ComputeCN_ty on each VA
+// - the bitmask clusterize_event against its scalar version
+// - clusterize_event_cn (raw_clusterize --fused) against the common noise loop of raw_clusterize
+//   followed by clusterize_event, invalid common noise included
+// - clusterize_fixed_event (--fixed) against clusterize_event_cn where the fixed point pipeline is
+//   exact: pedestals, common noise and absolute thresholds on the 1/8 ADC grid
+// - clusterize_events on blocks of events against clusterize_event on each event, with events flagged
+//   as not valid, a block cut in the middle of an event and a calibration shorter than the events
+// Any difference is printed and the exit code is 1
+
+namespace
+{
+  struct checker
+  {
+    long checks = 0;
+    long failures = 0;
+    std::string context; // profile and event of the current checks
+
+    void expect(bool ok, const std::string &what)
+    {
+      checks++;
+      if (!ok)
+      {
+        failures++;
+        if (failures <= 20)
+        {
+          std::cout << "MISMATCH " << context << ": " << what << std::endl;
+        }
+      }
+    }
+  };
+
+  bool same_bits(float a, float b, bool signed_zero = true) // any NaN matches any NaN, +0 matches -0 only if !signed_zero
+  {
+    if ((std::isnan(a) && std::isnan(b)) || (!signed_zero && a == 0 && b == 0))
+    {
+      return true;
+    }
+    uint32_t x, y;
+    std::memcpy(&x, &a, sizeof x);
+    std::memcpy(&y, &b, sizeof y);
+    return x == y;
+  }
+
+  // Empty if the same. The int16 pipeline has no -0: signed_zero false to compare it with float
+  std::string first_difference(const std::vector<float> &a, const std::vector<float> &b, bool signed_zero = true)
+  {
+    if (a.size() != b.size())
+    {
+      return "size " + std::to_string(a.size()) + " vs " + std::to_string(b.size());
+    }
+    for (size_t i = 0; i < a.size(); i++)
+    {
+      if (!same_bits(a[i], b[i], signed_zero))
+      {
+        return "strip " + std::to_string(i) + ": " + std::to_string(a[i]) + " vs " + std::to_string(b[i]);
+      }
+    }
+    return "";
+  }
+
+  std::string first_difference(const cluster_arena &a, const cluster_arena &b, bool signed_zero = true)
+  {
+    if (a.size() != b.size())
+    {
+      return std::to_string(a.size()) + " vs " + std::to_string(b.size()) + " clusters";
+    }
+    for (size_t i = 0; i < a.size(); i++)
+    {
+      std::string which = "cluster " + std::to_string(i) + " ";
+      if (a.address[i] != b.address[i] || a.width[i] != b.width[i] || a.over[i] != b.over[i])
+      {
+        return which + "address/width/over " + std::to_string(a.address[i]) + "/" + std::to_string(a.width[i]) + "/" +
+               std::to_string(a.over[i]) + " vs " + std::to_string(b.address[i]) + "/" + std::to_string(b.width[i]) +
+               "/" + std::to_string(b.over[i]);
+      }
+      for (int s = 0; s < a.width[i]; s++)
+      {
+        if (!same_bits(a.ADC(i)[s], b.ADC(i)[s], signed_zero))
+        {
+          return which + "ADC " + std::to_string(s) + ": " + std::to_string(a.ADC(i)[s]) + " vs " + std::to_string(b.ADC(i)[s]);
+        }
+      }
+    }
+    return "";
+  }
+
+  enum event_kind
+  {
+    NORMAL,    // noise, common noise and a few clusters
+    BUSY,      // more seeds than maxClusters
+    QUIET,     // noise only
+    DEAD_VA,   // a VA with all channels bad: flat at 0, type 0 common noise -999
+    HOT_VA,    // a VA far over threshold: type 1 and 2 common noise -999
+    EXTREME,   // ADC 0 and 4095, -999 values in the signal
+    KINDS
+  };
+
+  struct generator
+  {
+    std::mt19937 rng;
+    explicit generator(unsigned seed) : rng(seed) {}
+
+    float uniform(float a, float b) { return std::uniform_real_distribution<float>(a, b)(rng); }
+    float gauss(float sigma) { return std::normal_distribution<float>(0, sigma)(rng); }
+    int integer(int a, int b) { return std::uniform_int_distribution<int>(a, b)(rng); }
+    bool chance(double p) { return std::bernoulli_distribution(p)(rng); }
+
+    // cal with arbitrary pedestals, cal8 the same on the 1/8 ADC grid of the fixed point pipeline
+    void calibration(calib &cal, calib &cal8, int n)
+    {
+      cal.ped.resize(n);
+      cal.rsig.resize(n);
+      cal.sig.resize(n);
+      cal.status.resize(n);
+      for (int i = 0; i < n; i++)
+      {
+        cal.ped[i] = uniform(300, 700);
+        cal.rsig[i] = uniform(2, 8);
+        cal.sig[i] = chance(0.005) ? 0 : uniform(1.5, 6); // sigma 0: cut at 0
+        cal.status[i] = chance(0.03) ? integer(1, 3) : 0;
+      }
+      if (chance(0.1))
+      {
+        cal.sig[integer(0, n - 1)] = -1; // no exact S/N cut: scalar fallback of the clusterizer
+      }
+      cal8 = cal;
+      for (float &ped : cal8.ped)
+      {
+        ped = std::round(ped * FIXED_SCALE) / FIXED_SCALE;
+      }
+    }
+
+    void event(std::vector<unsigned int> &raw, calib &cal, const calib &ped, int kind, bool invert)
+    {
+      const int n = ped.ped.size();
+      std::vector<float> adc(n);
+      float sign = invert ? -1 : 1;
+      for (int first = 0; first < n; first += 64)
+      {
+        float cn = chance(0.1) ? uniform(-80, 80) : gauss(4); // some over maxCN
+        for (int i = first; i < std::min(first + 64, n); i++)
+        {
+          adc[i] = sign * (cn + gauss(kind == QUIET ? 1 : ped.rsig[i]));
+        }
+      }
+
+      int clusters = kind == BUSY ? 150 : kind == QUIET ? 0 : integer(0, 8);
+      for (int c = 0; c < clusters; c++)
+      {
+        int first = integer(0, n - 1);
+        float amplitude = uniform(15, 150);
+        for (int i = first; i < std::min(first + integer(1, 4), n); i++)
+        {
+          adc[i] += sign * amplitude * uniform(0.2, 1);
+        }
+      }
+
+      if (kind == DEAD_VA || kind == HOT_VA)
+      {
+        int first = 64 * integer(0, std::max(n / 64 - 1, 0));
+        for (int i = first; i < std::min(first + 64, n); i++)
+        {
+          if (kind == DEAD_VA)
+          {
+            cal.status[i] = 1;
+          }
+          else
+          {
+            adc[i] = sign * uniform(200, 400);
+          }
+        }
+      }
+
+      raw.resize(n);
+      for (int i = 0; i < n; i++)
+      {
+        raw[i] = std::min(std::max<long>(std::lround(ped.ped[i] + adc[i]), 0), 4095L);
+        if (kind == EXTREME && chance(0.05))
+        {
+          raw[i] = chance(0.5) ? 0 : 4095;
+        }
+      }
+    }
+  };
+
+  struct thresholds
+  {
+    float high, low;
+    bool absolute;
+  };
+
+  // S/N and ADC thresholds, swapped ones included. The absolute ones are on the 1/8 ADC grid
+  const thresholds threshold_sets[] = {{3.5, 1.0, false}, {5, 2, false}, {1.0, 3.5, false}, {25, 8, true}, {12.5, 3.875, true}};
+  const int n_threshold_sets = sizeof(threshold_sets) / sizeof(threshold_sets[0]);
+  const float maxCN = 20;
+
+  std::vector<float> subtract_pedestals(const std::vector<unsigned int> &raw, const calib &cal, bool invert) // as raw_clusterize
+  {
+    std::vector<float> signal(raw.size());
+    for (size_t i = 0; i != raw.size(); i++)
+    {
+      if (cal.status[i] != 0)
+      {
+        signal.at(i) = 0;
+      }
+      else
+      {
+        signal.at(i) = (raw.at(i) - cal.ped[i]);
+        if (invert)
+        {
+          signal.at(i) = -signal.at(i);
+        }
+      }
+    }
+    return signal;
+  }
+
+  bool good_cn(float cn)
+  {
+    return cn != -999 && std::abs(cn) < maxCN;
+  }
+
+  clusterize_status clusterize_scalar(cluster_arena &arena, calib *cal, std::vector<float> *signal, const thresholds &t,
+                                      bool symmetric, int width, bool truncate)
+  // verbose mode runs the scalar clusterizer: its printout is dropped
+  {
+    std::streambuf *out = std::cout.rdbuf(nullptr);
+    clusterize_status status = clusterize_event(arena, cal, signal, t.high, t.low, symmetric, width, t.absolute, 0, 0, true, truncate);
+    std::cout.rdbuf(out);
+    return status;
+  }
+
+  void check_event(checker &check, generator &gen, const std::vector<unsigned int> &raw, calib &cal, calib &cal8,
+                   int NVas, bool invert)
+  {
+    const int n = raw.size();
+    const int nva = n / 64; // VAs of the common noise kernels, including the ones past NVas
+    static event_cn ecn, rcn, shoe, fcn;
+    static std::vector<float> rsignal;
+    static std::vector<int16_t> fsignal;
+    static cluster_arena a1, a2, a3, af;
+
+    // common noise kernels
+    std::vector<float> signal = subtract_pedestals(raw, cal, invert);
+    GetEventCN(ecn, signal);
+    for (int type = 0; type < 3; type++)
+    {
+      for (int va = 0; va < nva; va++)
+      {
+        float ref = GetCN(&signal, va, type);
+        std::string where = "type " + std::to_string(type) + " VA " + std::to_string(va);
+        check.expect(same_bits(ecn.cn[type][va], ref), "GetEventCN " + where + ": " + std::to_string(ecn.cn[type][va]) + " vs GetCN " + std::to_string(ref));
+        check.expect(ecn.valid[type][va] == (ref != -999), "GetEventCN valid flag " + where);
+      }
+    }
+
+    GetRawEventCN(rcn, rsignal, raw, cal, invert);
+    std::string diff = first_difference(rsignal, signal);
+    check.expect(diff.empty(), "GetRawEventCN signal " + diff);
+    for (int type = 0; type < 3; type++)
+    {
+      for (int va = 0; va < nva; va++)
+      {
+        check.expect(same_bits(rcn.cn[type][va], ecn.cn[type][va]) && rcn.valid[type][va] == ecn.valid[type][va],
+                     "GetRawEventCN type " + std::to_string(type) + " VA " + std::to_string(va));
+      }
+    }
+
+    std::vector<float> edge = signal; // -999 channels are skipped by the SHOE selection
+    for (int i = 0; i < n; i++)
+    {
+      if (gen.chance(0.02))
+      {
+        edge[i] = -999;
+      }
+    }
+    for (const std::vector<float> *input : {&signal, &edge})
+    {
+      for (int type = 0; type < 3; type++)
+      {
+        for (double threshold : {3.0, 4.5})
+        {
+          ComputeEventCN_ty(shoe, *input, type, threshold);
+          for (int va = 0; va < nva; va++)
+          {
+            std::vector<float> content(input->begin() + 64 * va, input->begin() + 64 * (va + 1));
+            float ref = ComputeCN_ty(&content, type, false, threshold);
+            check.expect(same_bits(shoe.shoe[va], ref), "ComputeEventCN_ty type " + std::to_string(type) + " VA " + std::to_string(va) +
+                                                            ": " + std::to_string(shoe.shoe[va]) + " vs ComputeCN_ty " + std::to_string(ref));
+          }
+        }
+      }
+    }
+
+    // clusterizers, for a random choice of thresholds and options
+    const thresholds &t = threshold_sets[gen.integer(0, n_threshold_sets - 1)];
+    const bool symmetric = gen.chance(0.3);
+    const int width = gen.integer(0, 3);
+    const bool truncate = gen.chance(0.3);
+    const int cntype = gen.integer(-1, 2);
+
+    std::vector<float> s1 = signal; // common noise loop of raw_clusterize
+    bool good1 = true;
+    for (int va = 0; cntype >= 0 && va < NVas; va++)
+    {
+      float cn = ecn.get(va, cntype);
+      good1 = good_cn(cn);
+      for (int ch = va * 64; ch < (va + 1) * 64; ch++)
+      {
+        s1.at(ch) = good1 ? s1.at(ch) - cn : 0;
+      }
+    }
+    std::vector<float> s3 = s1;
+    float highest1 = *std::max_element(s1.begin(), s1.end());
+    clusterize_status status1 = clusterize_event(a1, &cal, &s1, t.high, t.low, symmetric, width, t.absolute, 0, 0, false, truncate);
+
+    clusterize_status status3 = clusterize_scalar(a3, &cal, &s3, t, symmetric, width, truncate);
+    check.expect(status1 == status3, "clusterize_event status " + std::to_string(status1) + " vs scalar " + std::to_string(status3));
+    diff = first_difference(a1, a3);
+    check.expect(diff.empty(), "clusterize_event clusters vs scalar: " + diff);
+    diff = first_difference(s1, s3);
+    check.expect(diff.empty(), "clusterize_event zeroed signal vs scalar: " + diff);
+
+    std::vector<float> va_cn; // --fused: one entry per VA, NaN for an invalid common noise
+    bool good2 = true;
+    for (int va = 0; cntype >= 0 && va < NVas; va++)
+    {
+      float cn = ecn.get(va, cntype);
+      good2 = good_cn(cn);
+      va_cn.push_back(good2 ? cn : NAN);
+    }
+    float highest2;
+    clusterize_status status2 = clusterize_event_cn(a2, &cal, &rsignal, va_cn, highest2, t.high, t.low, symmetric, width, t.absolute, 0, 0, truncate);
+    check.expect(good1 == good2, "common noise cut of the event");
+    check.expect(same_bits(highest1, highest2), "clusterize_event_cn highest " + std::to_string(highest2) + " vs " + std::to_string(highest1));
+    check.expect(status1 == status2, "clusterize_event_cn status " + std::to_string(status2) + " vs " + std::to_string(status1));
+    diff = first_difference(a2, a1);
+    check.expect(diff.empty(), "clusterize_event_cn clusters: " + diff);
+    diff = first_difference(rsignal, s1);
+    check.expect(diff.empty(), "clusterize_event_cn zeroed signal: " + diff);
+
+    // fixed point pipeline on the 1/8 ADC grid: absolute thresholds, common noise rounded to 1/8 ADC
+    if (!t.absolute)
+    {
+      return;
+    }
+    static fixed_calib fc;
+    make_fixed_calib(fc, cal8, n, t.high, t.low, true);
+    GetFixedEventCN(fcn, fsignal, raw, fc, invert);
+    GetRawEventCN(rcn, rsignal, raw, cal8, invert);
+    bool same_signal = true;
+    for (int i = 0; i < n; i++)
+    {
+      same_signal = same_signal && fsignal[i] == rsignal[i] * FIXED_SCALE;
+    }
+    check.expect(same_signal, "GetFixedEventCN signal");
+
+    for (float &cn : va_cn)
+    {
+      cn = std::round(cn * FIXED_SCALE) / FIXED_SCALE; // NaN stays NaN
+    }
+    float fhighest;
+    clusterize_status fstatus = clusterize_fixed_event(af, fc, fsignal, va_cn, fhighest, symmetric, width, 0, 0, truncate);
+    status2 = clusterize_event_cn(a2, &cal8, &rsignal, va_cn, highest2, t.high, t.low, symmetric, width, true, 0, 0, truncate);
+    check.expect(same_bits(fhighest, highest2, false), "clusterize_fixed_event highest " + std::to_string(fhighest) + " vs " + std::to_string(highest2));
+    check.expect(fstatus == status2, "clusterize_fixed_event status " + std::to_string(fstatus) + " vs " + std::to_string(status2));
+    diff = first_difference(af, a2, false);
+    check.expect(diff.empty(), "clusterize_fixed_event clusters: " + diff);
+    std::vector<float> converted(fsignal.begin(), fsignal.end());
+    for (float &value : converted)
+    {
+      value /= FIXED_SCALE;
+    }
+    diff = first_difference(converted, rsignal, false);
+    check.expect(diff.empty(), "clusterize_fixed_event zeroed signal: " + diff);
+  }
+
+  // Clusters of event ev of the table in an arena, to compare them with clusterize_event
+  void table_event(cluster_arena &arena, const cluster_table &table, int ev)
+  {
+    arena.clear();
+    for (size_t i = 0; i < table.size(); i++)
+    {
+      if (table.event[i] == ev)
+      {
+        arena.add(table.address[i], table.width[i], table.over[i], table.ADC(i));
+      }
+    }
+  }
+
+  void check_block(checker &check, generator &gen, const calib &ped, int NVas)
+  {
+    const int n = ped.ped.size();
+    const int nblock = 16;
+    static cluster_table table; // reused: the strip cuts are cached from block to block
+    static cluster_arena reference, from_table;
+
+    const thresholds &t = threshold_sets[gen.integer(0, n_threshold_sets - 1)];
+    const bool symmetric = gen.chance(0.3);
+    const int width = gen.integer(0, 3);
+    const bool truncate = gen.chance(0.3);
+    const int cntype = gen.integer(-1, 2);
+    calib cal = ped;
+
+    std::vector<float> block; // pedestal and common noise subtracted events, as in raw_clusterize
+    std::vector<char> valid;
+    std::vector<unsigned int> raw;
+    static event_cn ecn;
+    for (int ev = 0; ev < nblock; ev++)
+    {
+      bool invert = gen.chance(0.25);
+      calib event_cal = ped; // DEAD_VA: channels bad for the event only, not in the block calibration
+      gen.event(raw, event_cal, ped, ev % KINDS, invert);
+      std::vector<float> signal = subtract_pedestals(raw, event_cal, invert);
+      GetEventCN(ecn, signal);
+      for (int va = 0; cntype >= 0 && va < NVas; va++)
+      {
+        float cn = ecn.get(va, cntype);
+        for (int ch = va * 64; ch < (va + 1) * 64; ch++)
+        {
+          signal[ch] = good_cn(cn) ? signal[ch] - cn : 0;
+        }
+      }
+      block.insert(block.end(), signal.begin(), signal.end());
+      valid.push_back(!gen.chance(0.2));
+    }
+
+    // whole block, then cut in the middle of its last event: that one is not clusterized
+    for (size_t size : {block.size(), block.size() - n / 2})
+    {
+      std::vector<float> events(block.begin(), block.begin() + size);
+      int nclusters = clusterize_events(table, &cal, events, valid, n, t.high, t.low, symmetric, width, t.absolute, 0, 0, truncate);
+      check.expect(nclusters == (int)table.size() && (int)table.status.size() == nblock, "clusterize_events table size");
+
+      size_t clusters = 0;
+      for (int ev = 0; ev < nblock && ev < (int)table.status.size(); ev++)
+      {
+        std::string where = "block event " + std::to_string(ev) + (size < block.size() ? " (short block)" : "");
+        table_event(from_table, table, ev);
+        if (!valid[ev] || (size_t)(ev + 1) * n > size)
+        {
+          check.expect(table.status[ev] == CLUSTERIZE_invalid && from_table.size() == 0, "clusterize_events " + where + " not flagged as invalid");
+          continue;
+        }
+        std::vector<float> signal(block.begin() + (size_t)ev * n, block.begin() + (size_t)(ev + 1) * n);
+        clusterize_status status = clusterize_event(reference, &cal, &signal, t.high, t.low, symmetric, width, t.absolute, 0, 0, false, truncate);
+        clusters += reference.size();
+        check.expect(table.status[ev] == status, "clusterize_events " + where + " status " + std::to_string(table.status[ev]) +
+                                                     " vs clusterize_event " + std::to_string(status));
+        std::string diff = first_difference(from_table, reference);
+        check.expect(diff.empty(), "clusterize_events " + where + " clusters: " + diff);
+        std::vector<float> zeroed(events.begin() + (size_t)ev * n, events.begin() + (size_t)(ev + 1) * n);
+        diff = first_difference(zeroed, signal);
+        check.expect(diff.empty(), "clusterize_events " + where + " zeroed signal: " + diff);
+      }
+      check.expect(clusters == table.size(), "clusterize_events " + std::to_string(table.size()) + " clusters vs " + std::to_string(clusters));
+    }
+
+    // calibration shorter than the events: nothing clusterized, no exception
+    calib short_cal = ped;
+    short_cal.sig.pop_back();
+    std::vector<float> events = block;
+    int nclusters = clusterize_events(table, &short_cal, events, valid, n, t.high, t.low, symmetric, width, t.absolute, 0, 0, truncate);
+    bool all_invalid = (int)table.status.size() == nblock;
+    for (clusterize_status status : table.status)
+    {
+      all_invalid = all_invalid && status == CLUSTERIZE_invalid;
+    }
+    check.expect(nclusters == 0 && all_invalid, "clusterize_events with a short calibration");
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int nevents = 2000;
+  unsigned seed = 1;
+
+  CLI::App app{"kernel_check"};
+  app.add_option("-n,--events", nevents, "Events per detector profile")->check(CLI::PositiveNumber);
+  app.add_option("--seed", seed, "Seed of the random events");
+
+  CLI11_PARSE(app, argc, argv);
+
+  checker check;
+  generator gen(seed);
+  for (int p = 0; p < n_detector_profiles; p++)
+  {
+    const detector_profile &profile = detector_profiles[p];
+    bool done = false; // same channels and VAs as an earlier profile
+    for (int q = 0; q < p; q++)
+    {
+      done = done || (detector_profiles[q].NChannels == profile.NChannels && detector_profiles[q].NVas == profile.NVas);
+    }
+    if (done)
+    {
+      continue;
+    }
+
+    long failures = check.failures;
+    long checks = check.checks;
+    calib ped, ped8, cal, cal8;
+    std::vector<unsigned int> raw;
+    for (int ev = 0; ev < nevents; ev++)
+    {
+      if (ev % 16 == 0) // the clusterizers cache their cuts as long as the calibration does not change
+      {
+        gen.calibration(ped, ped8, profile.NChannels);
+        check.context = std::string(profile.name) + " block of event " + std::to_string(ev);
+        check_block(check, gen, ped, profile.NVas);
+      }
+      cal = ped;
+      cal8 = ped8;
+      int kind = ev % KINDS;
+      bool invert = gen.chance(0.25);
+      gen.event(raw, cal, ped, kind, invert);
+      cal8.status = cal.status;
+      check.context = std::string(profile.name) + " event " + std::to_string(ev);
+      check_event(check, gen, raw, cal, cal8, profile.NVas, invert);
+    }
+    std::cout << profile.name << " (" << profile.NChannels << " channels, " << profile.NVas << " VAs): " << nevents
+              << " events, " << check.checks - checks << " checks, " << check.failures - failures << " mismatches" << std::endl;
+  }
+
+  if (check.failures)
+  {
+    std::cout << "ERROR: " << check.failures << " mismatches in " << check.checks << " checks" << std::endl;
+    return 1;
+  }
+  std::cout << "All " << check.checks << " checks passed" << std::endl;
+  return 0;
+}
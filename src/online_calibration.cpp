@@ -0,0 +1,502 @@
+#include "online_calibration.h"
+#include "calib_io.h"
+#include "stats.h"
+#include "PAPERO.h"
+#include "udpSocket.h"
+
+#include "TString.h"
+
+#include <chrono>
+#include <csignal>
+#include <cmath>
+#include <ctime>
+#include <map>
+#include <sys/stat.h>
+#include <thread>
+
+namespace
+{
+  volatile std::sig_atomic_t stop_requested = 0;
+
+  void request_stop(int) { stop_requested = 1; }
+
+  long file_size(const std::string &path)
+  {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+  }
+
+  std::string calib_header(const std::string &name, const std::string &location, std::time_t when)
+  // same 18 lines as the calibration executable
+  {
+    std::string header;
+    header += "#temp_SN= NC\n";
+    header += "#temp_SN= NC\n";
+    header += "#name= " + name + "\n";
+    header += "#location= " + location + "\n";
+    header += "#bias_volt= NC\n";
+    header += "#leak_curr= NC\n";
+    header += "#6v_curr= NC\n";
+    header += "#3v_curr= NC\n";
+    header += std::string("#starting_time= ") + std::asctime(std::localtime(&when));
+    header += "#temp_right= NC\n";
+    header += "#temp_left= NC\n";
+    header += "#hold_delay= NC\n";
+    header += "#sigmaraw_cut= 15\n";
+    header += "#sigmaraw_noise_cut= NC\n";
+    header += "#sigma_cut= 10\n";
+    header += "#sigma_noise_cut= NC\n";
+    header += "#sigma_k= NC\n";
+    header += "#occupancy_k= NC\n";
+    return header;
+  }
+}
+
+online_calibration::online_calibration(const online_options &opt, const std::string &source)
+    : opt(opt), source(source)
+{
+  if (!opt.seed_calibration.empty())
+  {
+    seed = read_calib_all(opt.seed_calibration.c_str(), opt.verb);
+  }
+  std::signal(SIGINT, request_stop);
+  std::signal(SIGTERM, request_stop);
+}
+
+void online_calibration::add_event(int detector, const std::vector<uint32_t> &raw)
+{
+  if (detector >= (int)trackers.size())
+  {
+    trackers.resize(detector + 1);
+    seeded.resize(detector + 1, false);
+    monitors.resize(detector + 1);
+  }
+  if (!trackers[detector])
+  {
+    std::cout << "Tracking detector " << detector << " with " << raw.size() << " channels" << std::endl;
+    trackers[detector].reset(new pedestal_tracker(raw.size(), opt.window, opt.outlier_cut));
+    monitors[detector].NChannels = raw.size();
+    if (detector < (int)seed.size() && seed[detector].ped.size() == raw.size())
+    {
+      trackers[detector]->seed(seed[detector], opt.window);
+      seeded[detector] = true;
+    }
+    else if (detector < (int)seed.size())
+    {
+      std::cout << "WARNING: seed calibration of detector " << detector << " has " << seed[detector].ped.size()
+                << " channels, waiting for a full window of events" << std::endl;
+    }
+  }
+  trackers[detector]->add_event(raw.data());
+
+  if (opt.monitor_events > 0 && triggers % opt.check_every >= opt.check_every - opt.monitor_events)
+  {
+    cluster_monitor &m = monitors[detector];
+    bool complete = (int)raw.size() == m.NChannels;
+    m.valid.push_back(complete);
+    if (complete)
+    {
+      m.events.insert(m.events.end(), raw.begin(), raw.end());
+    }
+    else
+    {
+      m.events.resize(m.events.size() + m.NChannels, 0);
+    }
+  }
+}
+
+void online_calibration::end_of_event()
+{
+  triggers++;
+  if (triggers % opt.check_every)
+  {
+    return;
+  }
+  monitor_clusters();
+
+  if (version == 0) // first version once every detector is seeded or has a full window of events
+  {
+    for (size_t det = 0; det < trackers.size(); det++)
+    {
+      if (trackers[det] && !seeded[det] && trackers[det]->events() < opt.window)
+      {
+        return;
+      }
+    }
+    std::cout << "Initial calibration after " << triggers << " events" << std::endl;
+    write_version();
+    return;
+  }
+
+  std::string why;
+  if (drifted(why))
+  {
+    std::cout << "Calibration drift after " << triggers << " events: " << why << std::endl;
+    write_version();
+  }
+  else if (opt.verb)
+  {
+    std::cout << "Event " << triggers << ": no significant drift" << std::endl;
+  }
+}
+
+bool online_calibration::drifted(std::string &why) const
+// largest median change over the VAs, so single hot channels do not trigger a new version
+{
+  for (size_t det = 0; det < trackers.size(); det++)
+  {
+    if (!trackers[det])
+    {
+      continue;
+    }
+    if (det >= reference.size())
+    {
+      why = Form("detector %zu appeared in the data", det);
+      return true;
+    }
+
+    calib now = trackers[det]->snapshot();
+    const calib &ref = reference[det];
+    int NChannels = now.ped.size();
+    if (ref.ped.size() != now.ped.size())
+    {
+      why = Form("detector %zu has a new number of channels", det);
+      return true;
+    }
+    std::vector<float> dped(NChannels);
+    std::vector<float> dnoise(NChannels);
+    std::vector<char> good(NChannels);
+    for (int ch = 0; ch < NChannels; ch++)
+    {
+      good[ch] = ref.status[ch] == 0 && ref.sig[ch] > 0;
+      dped[ch] = good[ch] ? std::abs(now.ped[ch] - ref.ped[ch]) / ref.sig[ch] : 0;
+      dnoise[ch] = good[ch] ? std::abs(now.sig[ch] / ref.sig[ch] - 1) : 0;
+    }
+
+    std::vector<robust_summary> va_ped = summarize_groups(dped.data(), good.data(), NChannels, 64);
+    std::vector<robust_summary> va_noise = summarize_groups(dnoise.data(), good.data(), NChannels, 64);
+    for (size_t va = 0; va < va_ped.size(); va++)
+    {
+      if (va_ped[va].median > opt.ped_drift) // false for NaN (VA without good channels)
+      {
+        why = Form("detector %zu VA %zu pedestal moved by %.2f sigma", det, va, va_ped[va].median);
+        return true;
+      }
+      if (va_noise[va].median > opt.noise_drift)
+      {
+        why = Form("detector %zu VA %zu noise changed by %.1f%%", det, va, 100 * va_noise[va].median);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void online_calibration::monitor_clusters()
+// pedestals and common noise (first GetCN algorithm) of the running calibration subtracted in place,
+// then the whole block is clusterized at once: a jump in the occupancy shows hot strips or a drift
+{
+  for (size_t det = 0; det < monitors.size(); det++)
+  {
+    cluster_monitor &m = monitors[det];
+    if (!trackers[det] || m.valid.empty())
+    {
+      continue;
+    }
+
+    calib cal = trackers[det]->snapshot();
+    row.resize(m.NChannels);
+    for (size_t ev = 0; ev < m.valid.size(); ev++)
+    {
+      if (!m.valid[ev])
+      {
+        continue;
+      }
+      float *signal = m.events.data() + ev * m.NChannels;
+      for (int ch = 0; ch < m.NChannels; ch++)
+      {
+        row[ch] = cal.status[ch] != 0 ? 0 : signal[ch] - cal.ped[ch];
+      }
+      GetEventCN(ecn, row);
+      for (int ch = 0; ch < m.NChannels; ch++)
+      {
+        float cn = ch / 64 < ecn.NVas ? ecn.get(ch / 64, 0) : 0;
+        signal[ch] = cn != -999 ? row[ch] - cn : 0; // VA without common noise set to 0, as in raw_clusterize
+      }
+    }
+
+    int nclusters = clusterize_events(table, &cal, m.events, m.valid, m.NChannels, opt.monitor_high, opt.monitor_low,
+                                      false, 0, false, det / 2, det % 2);
+    int nevents = 0;
+    int overflow = 0;
+    for (clusterize_status status : table.status)
+    {
+      nevents += status != CLUSTERIZE_invalid;
+      overflow += status == CLUSTERIZE_overflow;
+    }
+    m.nevents += nevents;
+    m.nclusters += nclusters;
+    m.overflow += overflow;
+    if (opt.verb && nevents)
+    {
+      std::cout << "Detector " << det << ": " << Form("%.2f", (float)nclusters / nevents) << " clusters/event, "
+                << overflow << " busy event(s) in the last " << nevents << " events" << std::endl;
+    }
+    m.events.clear();
+    m.valid.clear();
+  }
+}
+
+void online_calibration::write_version()
+{
+  version++;
+  std::time_t now = std::time(nullptr);
+  char date[32];
+  std::strftime(date, sizeof(date), "%Y%m%d_%H%M%S", std::localtime(&now));
+
+  reference.clear();
+  std::vector<std::string> headers;
+  for (size_t det = 0; det < trackers.size(); det++)
+  {
+    // detectors missing from the data keep their place in the file
+    reference.push_back(trackers[det] ? trackers[det]->snapshot() : calib());
+    headers.push_back(calib_header(Form("online_v%d", version), source, now));
+  }
+
+  std::string filename = opt.output + Form("_v%03d_", version) + date + ".cal";
+  std::string latest = opt.output + "_latest.cal";
+  if (!write_calib_ascii(filename.c_str(), reference, headers) ||
+      !write_calib_ascii((latest + ".tmp").c_str(), reference, headers) ||
+      std::rename((latest + ".tmp").c_str(), latest.c_str()) != 0) // readers never see a partial file
+  {
+    std::cout << "ERROR: could not write calibration version " << version << std::endl;
+    return;
+  }
+  std::cout << "Written calibration version " << version << ": " << filename << std::endl;
+}
+
+void online_calibration::finish()
+{
+  std::cout << "\nStopped after " << triggers << " events, " << version << " calibration version(s) written" << std::endl;
+  for (size_t det = 0; det < trackers.size(); det++)
+  {
+    if (trackers[det])
+    {
+      std::cout << "\tDetector " << det << ": " << trackers[det]->events() << " events, "
+                << trackers[det]->rejected() << " rejected hits";
+      const cluster_monitor &m = monitors[det];
+      if (m.nevents)
+      {
+        std::cout << ", " << Form("%.2f", (float)m.nclusters / m.nevents) << " clusters/event in "
+                  << m.nevents << " monitored events (" << m.overflow << " busy)";
+      }
+      std::cout << std::endl;
+    }
+  }
+}
+
+int run_online_file(const std::string &raw_file, const online_options &opt)
+// follows a PAPERO raw file (new format, with file header) while the DAQ appends events to it
+{
+  std::fstream file(raw_file.c_str(), std::ios::in | std::ios::binary);
+  if (file.fail())
+  {
+    std::cout << "ERROR: can't open input file" << std::endl;
+    return 2;
+  }
+
+  online_calibration calibration(opt, raw_file);
+  auto last_growth = std::chrono::steady_clock::now();
+  long last_size = -1;
+
+  // true if there was no new data for too long (end of run)
+  auto wait_for_data = [&]()
+  {
+    long size = file_size(raw_file);
+    if (size != last_size)
+    {
+      last_size = size;
+      last_growth = std::chrono::steady_clock::now();
+    }
+    file.clear();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return std::chrono::steady_clock::now() - last_growth > std::chrono::seconds(opt.idle_timeout);
+  };
+
+  std::map<uint16_t, int> detector_ids_map;
+  uint32_t offset = 0;
+  while (!stop_requested)
+  {
+    file.clear();
+    if (file_size(raw_file) >= 16 && seek_file_header(file, 0, opt.verb))
+    {
+      auto file_header = read_file_header(file, 0, opt.verb);
+      std::vector<uint16_t> detector_ids = std::get<6>(file_header);
+      for (size_t i = 0; i < detector_ids.size(); i++)
+      {
+        detector_ids_map[detector_ids.at(i)] = i;
+      }
+      offset = std::get<7>(file_header);
+      if (file_size(raw_file) >= offset)
+      {
+        break;
+      }
+    }
+    if (wait_for_data())
+    {
+      std::cout << "ERROR: no PAPERO file header in " << raw_file << " (old data format is not supported)" << std::endl;
+      return 2;
+    }
+  }
+
+  std::vector<std::vector<uint32_t>> detectors(2 * detector_ids_map.size());
+  while (!stop_requested)
+  {
+    long size = file_size(raw_file);
+    file.clear();
+
+    // an event is used only when all of it is on disk, otherwise we wait and read it again
+    bool complete = false;
+    uint32_t next_offset = offset;
+    if (size >= offset + 32)
+    {
+      auto evt_header = read_evt_header(file, offset, opt.verb);
+      if (!std::get<0>(evt_header))
+      {
+        int found = seek_first_evt_header(file, offset + 4, opt.verb); // resync on the next event
+        if (found >= 0)
+        {
+          std::cout << "WARNING: skipped " << found - offset << " bytes to the next event header" << std::endl;
+          offset = found;
+          continue;
+        }
+      }
+      else if (size >= offset + std::get<2>(evt_header))
+      {
+        next_offset = std::get<7>(evt_header);
+        complete = true;
+        for (auto &d : detectors)
+        {
+          d.clear();
+        }
+
+        for (size_t de10 = 0; de10 < std::get<4>(evt_header) && complete; de10++)
+        {
+          if (size < next_offset + 36)
+          {
+            complete = false;
+            break;
+          }
+          auto de10_header = read_de10_header(file, next_offset, opt.verb);
+          int evt_size = std::get<1>(de10_header);
+          next_offset = std::get<8>(de10_header);
+          if (!std::get<0>(de10_header) || size < next_offset + evt_size * 4 + 44)
+          {
+            complete = false;
+            break;
+          }
+
+          int board_id = std::get<4>(de10_header);
+          std::vector<uint32_t> raw_event_buffer;
+          if (std::get<2>(de10_header) == 0x9fd68b40)
+          {
+            board_id = board_id - 300;
+            raw_event_buffer = reorder_DAMPE(read_event(file, next_offset, evt_size, opt.verb, false));
+          }
+          else
+          {
+            raw_event_buffer = reorder(read_event(file, next_offset, evt_size, opt.verb, false));
+          }
+          next_offset += evt_size * 4 + 8 + 36; // 8 is the size of the de10 footer + crc, 36 is the size of the de10 header
+
+          auto board = detector_ids_map.find(board_id);
+          if (board == detector_ids_map.end())
+          {
+            continue;
+          }
+          detectors.at(2 * board->second).assign(raw_event_buffer.begin(), raw_event_buffer.begin() + raw_event_buffer.size() / 2);
+          detectors.at(2 * board->second + 1).assign(raw_event_buffer.begin() + raw_event_buffer.size() / 2, raw_event_buffer.end());
+        }
+      }
+    }
+
+    if (!complete)
+    {
+      if (wait_for_data())
+      {
+        std::cout << "No new data for " << opt.idle_timeout << " s, closing " << raw_file << std::endl;
+        break;
+      }
+      continue;
+    }
+
+    for (size_t det = 0; det < detectors.size(); det++)
+    {
+      if (!detectors[det].empty())
+      {
+        calibration.add_event(det, detectors[det]);
+      }
+    }
+    calibration.end_of_event();
+    offset = next_offset;
+  }
+
+  calibration.finish();
+  return 0;
+}
+
+int run_online_udp(const std::string &address, int port, const online_options &opt)
+// on-line monitor stream, same packet layout as readOM: two detectors (J5, J7) per packet
+{
+  udpServer server(address, port);
+  online_calibration calibration(opt, Form("udp://%s:%d", address.c_str(), port));
+  std::cout << "Listening for monitor events on " << address << ":" << port << std::endl;
+
+  std::vector<uint32_t> evt(650);
+  std::vector<uint32_t> evt_buffer;
+  std::vector<uint32_t> det;
+  while (!stop_requested)
+  {
+    uint32_t header;
+    if (server.RxTimeout(&header, sizeof(header), 1000) != sizeof(header)) // timeout: check for a stop request
+    {
+      continue;
+    }
+    if (header != 0xfa4af1ca)
+    {
+      if (opt.verb)
+      {
+        std::cout << "ERROR: header is not correct, skipping packet" << std::endl;
+      }
+      continue;
+    }
+
+    uint32_t word1, word2;
+    uint16_t word3, word4;
+    server.Rx(&word1, sizeof(word1));
+    server.Rx(&word2, sizeof(word2));
+    server.Rx(&word3, sizeof(word3));
+    server.Rx(&word4, sizeof(word4));
+    if (server.Rx(evt.data(), evt.size() * sizeof(uint32_t)) != (int)(evt.size() * sizeof(uint32_t)))
+    {
+      continue;
+    }
+
+    evt_buffer.clear();
+    for (size_t i = 0; i < evt.size() - 10; i++)
+    {
+      evt_buffer.push_back((evt.at(i + 9) % (0x10000)) / 4);
+      evt_buffer.push_back(((evt.at(i + 9) >> 16) % (0x10000)) / 4);
+    }
+    evt_buffer = reorder(evt_buffer);
+
+    det.assign(evt_buffer.begin(), evt_buffer.begin() + evt_buffer.size() / 2);
+    calibration.add_event(0, det);
+    det.assign(evt_buffer.begin() + evt_buffer.size() / 2, evt_buffer.end());
+    calibration.add_event(1, det);
+    calibration.end_of_event();
+  }
+
+  calibration.finish();
+  return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef ONLINE_CALIBRATION_H_
+#define ONLINE_CALIBRATION_H_
+
+#include "pedestal_tracker.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Rolling calibration of a running DAQ: events are read from a PAPERO raw file while it is
+// being written, or from the UDP on-line monitor stream. Every detector has a pedestal_tracker;
+// a new versioned and timestamped .cal is written when the calibration drifts from the last one written.
+// The last events before each drift check are also clusterized, as a block, to follow the cluster occupancy
+
+struct online_options
+{
+  std::string output;           // output name: <output>_v<N>_<date>.cal, plus <output>_latest.cal
+  std::string seed_calibration; // optional starting calibration (.cal or .calb)
+  int window = 5000;            // time constant of the running estimates, in events
+  float outlier_cut = 5;        // hits rejection, in sigmas
+  float ped_drift = 0.5;        // largest VA median pedestal change (in sigmas) before a new version
+  float noise_drift = 0.1;      // largest VA median relative sigma change before a new version
+  int check_every = 1000;       // events between two drift checks
+  int monitor_events = 100;     // last events before each check clusterized with the running calibration (0: none)
+  float monitor_high = 3.5;     // their clustering thresholds in S/N, the raw_clusterize defaults
+  float monitor_low = 1.0;
+  int idle_timeout = 60;        // seconds without new data before closing a raw file
+  bool verb = false;
+};
+
+class online_calibration
+{
+public:
+  explicit online_calibration(const online_options &opt, const std::string &source);
+
+  void add_event(int detector, const std::vector<uint32_t> &raw); // one detector of the current trigger
+  void end_of_event();                                            // checks the drift every check_every triggers
+  void finish();                                                  // last summary line
+
+private:
+  bool drifted(std::string &why) const;
+  void write_version();
+  void monitor_clusters();
+
+  struct cluster_monitor
+  {
+    int NChannels = 0;
+    std::vector<float> events; // raw events buffered for the next check, one after the other
+    std::vector<char> valid;   // 0 for an event with another number of channels
+    long nevents = 0;          // clusterized since the start
+    long nclusters = 0;
+    long overflow = 0;
+  };
+
+  online_options opt;
+  std::string source;
+  std::vector<calib> seed;
+  std::vector<std::unique_ptr<pedestal_tracker>> trackers; // by detector number, null if not in the data
+  std::vector<char> seeded;                                // by detector number, tracker started from seed
+  std::vector<calib> reference; // last written calibration
+  std::vector<cluster_monitor> monitors; // by detector number
+  cluster_table table;                   // memory reused from check to check
+  event_cn ecn;
+  std::vector<float> row;
+  long triggers = 0;
+  int version = 0;
+};
+
+int run_online_file(const std::string &raw_file, const online_options &opt);
+int run_online_udp(const std::string &address, int port, const online_options &opt);
+
+#endif
@@ -0,0 +1,110 @@
+#include "pedestal_tracker.h"
+
+#include <algorithm>
+#include <cmath>
+
+pedestal_tracker::pedestal_tracker(int NChannels, int window, float outlier_cut)
+    : NChannels(NChannels), NVas(NChannels / 64), alpha(1.0 / std::max(window, 1)),
+      outlier_cut2(outlier_cut * outlier_cut),
+      ped(NChannels, 0), rsig2(NChannels, 0), sig2(NChannels, 0), updates(NChannels, 0), streak(NChannels, 0),
+      signal(NChannels, 0)
+{
+}
+
+void pedestal_tracker::seed(const calib &cal, int weight)
+{
+  int nseed = std::min<int>(NChannels, cal.ped.size());
+  for (int ch = 0; ch < nseed; ch++)
+  {
+    ped[ch] = cal.ped[ch];
+    rsig2[ch] = cal.rsig[ch] * cal.rsig[ch];
+    sig2[ch] = cal.sig[ch] * cal.sig[ch];
+    updates[ch] = weight;
+  }
+}
+
+void pedestal_tracker::add_event(const uint32_t *raw)
+{
+  nevents++;
+  for (int ch = 0; ch < NChannels; ch++)
+  {
+    signal[ch] = raw[ch] - ped[ch];
+  }
+
+  for (int va = 0; va < NVas; va++)
+  {
+    float cn = GetCN(&signal, va, 0);
+    bool good_cn = cn != -999;
+
+    for (int ch = 64 * va; ch < 64 * (va + 1); ch++)
+    {
+      double d = signal[ch];
+      double s = good_cn ? d - cn : d;
+
+      // hits are rejected once the noise of the channel is known. Hits are sparse: a long
+      // run of rejected events is a real pedestal shift, which has to be followed
+      bool outlier = updates[ch] >= 100 && sig2[ch] > 0 && s * s > outlier_cut2 * sig2[ch];
+      if (outlier && streak[ch] < 100)
+      {
+        streak[ch]++;
+        nrejected++;
+        continue;
+      }
+      if (!outlier)
+      {
+        streak[ch] = 0;
+      }
+
+      updates[ch]++;
+      double a = std::max(alpha, 1.0 / updates[ch]);
+      ped[ch] += a * d;
+      rsig2[ch] = (1 - a) * (rsig2[ch] + a * d * d);
+      if (good_cn)
+      {
+        sig2[ch] += a * (s * s - sig2[ch]);
+      }
+    }
+  }
+}
+
+calib pedestal_tracker::snapshot(float sigmaraw_cut, float sigma_cut) const
+{
+  calib cal;
+  refresh(cal, true, sigmaraw_cut, sigma_cut);
+  return cal;
+}
+
+void pedestal_tracker::refresh(calib &cal, bool sigmas, float sigmaraw_cut, float sigma_cut) const
+{
+  cal.ped.resize(NChannels);
+  cal.rsig.resize(NChannels);
+  if (sigmas)
+  {
+    cal.sig.resize(NChannels);
+    cal.status.resize(NChannels);
+  }
+
+  for (int ch = 0; ch < NChannels; ch++)
+  {
+    float rsig = std::sqrt(rsig2[ch]);
+    cal.ped[ch] = ped[ch];
+    cal.rsig[ch] = rsig;
+    if (!sigmas)
+    {
+      continue;
+    }
+    float sig = std::sqrt(sig2[ch]);
+    cal.sig[ch] = sig;
+
+    // Flag for channels that are too noisy or dead
+    bool badchan = updates[ch] == 0;
+    if (rsig < 1.5 || rsig > sigmaraw_cut)
+    {
+      if (sig < 1 || sig > sigma_cut)
+      {
+        badchan = true;
+      }
+    }
+    cal.status[ch] = badchan;
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef PEDESTAL_TRACKER_H_
+#define PEDESTAL_TRACKER_H_
+
+#include "event.h"
+
+#include <cstdint>
+#include <vector>
+
+// Running calibration of one detector: exponentially weighted pedestal, raw sigma and
+// CN-subtracted sigma for each channel, updated in O(NChannels) per event with no histograms.
+// The weight of the newest event is max(1 / updates, 1 / window), so the first window events
+// give plain running averages and later events are forgotten with a time constant of window events.
+// Hits (|signal - CN| above outlier_cut sigmas) are not used for the update
+
+class pedestal_tracker
+{
+public:
+  pedestal_tracker(int NChannels, int window, float outlier_cut = 5);
+
+  void seed(const calib &cal, int weight); // start from an existing calibration, worth weight events
+  void add_event(const uint32_t *raw);
+
+  calib snapshot(float sigmaraw_cut = 15, float sigma_cut = 10) const; // status from the same cuts as calibration
+  // Pedestals and raw sigmas of cal in place, with sigmas also the sigmas and the status of snapshot():
+  // no allocation once cal has NChannels entries
+  void refresh(calib &cal, bool sigmas, float sigmaraw_cut = 15, float sigma_cut = 10) const;
+
+  long events() const { return nevents; }
+  long rejected() const { return nrejected; }
+
+private:
+  int NChannels;
+  int NVas;
+  double alpha;
+  float outlier_cut2;
+  long nevents = 0;
+  long nrejected = 0;
+
+  std::vector<double> ped;
+  std::vector<double> rsig2;
+  std::vector<double> sig2;
+  std::vector<long> updates; // events used for each channel
+  std::vector<int> streak;   // consecutive rejected events for each channel
+  std::vector<float> signal;
+};
+
+#endif
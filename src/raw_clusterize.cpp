@@ -1,788 +1,1802 @@
 #include "TROOT.h"
-#include "TSystem.h"
 #include "TChain.h"
 #include "TFile.h"
-#include "TF1.h"
 #include "TH1.h"
 #include "TH2.h"
 #include "TGraph.h"
 #include "TTree.h"
 #include "TKey.h"
+#include "TParameter.h"
 #include <iostream>
 #include <algorithm>
 #include <vector>
 #include <cmath>
-
-#include "TTreeReader.h"
+#include <chrono>
+#include <memory>
 
 #include <CLI/CLI.hpp>
 #include "event.h"
+#include "detector_profile.h"
+#include "thread_pool.h"
+#include "pedestal_tracker.h"
+#include "instrument.h"
+
+// Speed and accuracy of the fixed point pipeline against the float one (--fixed_report)
+struct fixed_report
+{
+  double float_time = 0;    // s, pedestals to clusters of the events compared
+  double fixed_time = 0;
+  long events = 0;          // events accepted by the common noise cuts of both pipelines
+  long cn_mismatch = 0;     // events accepted by only one of them
+  long same_clusters = 0;   // events with the same cluster addresses and widths
+  long clusters = 0;        // float clusters
+  long matched = 0;         // float clusters with a fixed point one of the same address and width
+  double signal_diff = 0;   // sum and maximum of |signal difference| of the matched clusters
+  double signal_diff_max = 0;
+  long cn_count = 0;        // VAs with a valid common noise in both
+  double cn_diff = 0;       // sum and maximum of |common noise difference|
+  double cn_diff_max = 0;
+};
+
+void compare_fixed(fixed_report &report, const cluster_arena &flt, const cluster_arena &fix)
+{
+  report.events++;
+  report.same_clusters += flt.address == fix.address && flt.width == fix.width;
+  for (size_t i = 0; i < flt.size(); i++)
+  {
+    report.clusters++;
+    for (size_t j = 0; j < fix.size(); j++)
+    {
+      if (flt.address[i] == fix.address[j] && flt.width[i] == fix.width[j])
+      {
+        float diff = std::abs(std::accumulate(flt.ADC(i), flt.ADC(i) + flt.width[i], 0.f) -
+                              std::accumulate(fix.ADC(j), fix.ADC(j) + fix.width[j], 0.f));
+        report.matched++;
+        report.signal_diff += diff;
+        report.signal_diff_max = std::max<double>(report.signal_diff_max, diff);
+        break;
+      }
+    }
+  }
+}
+
+void merge_fixed(fixed_report &report, const fixed_report &other)
+{
+  report.float_time += other.float_time;
+  report.fixed_time += other.fixed_time;
+  report.events += other.events;
+  report.cn_mismatch += other.cn_mismatch;
+  report.same_clusters += other.same_clusters;
+  report.clusters += other.clusters;
+  report.matched += other.matched;
+  report.signal_diff += other.signal_diff;
+  report.signal_diff_max = std::max(report.signal_diff_max, other.signal_diff_max);
+  report.cn_count += other.cn_count;
+  report.cn_diff += other.cn_diff;
+  report.cn_diff_max = std::max(report.cn_diff_max, other.cn_diff_max);
+}
+
+void print_fixed_report(const fixed_report &report, int board, int side)
+{
+  std::cout << "\nFixed point (1/" << FIXED_SCALE << " ADC) vs float pipeline, board " << board << " side " << side << std::endl;
+  if (!report.events)
+  {
+    std::cout << "  no events" << std::endl;
+    return;
+  }
+  std::cout << "  time per event: float " << 1e6 * report.float_time / report.events
+            << " us, fixed " << 1e6 * report.fixed_time / report.events << " us" << std::endl;
+  std::cout << "  events accepted by only one common noise cut: " << report.cn_mismatch << std::endl;
+  std::cout << "  events with the same clusters: " << report.same_clusters << " / " << report.events << std::endl;
+  std::cout << "  float clusters found in fixed point: " << report.matched << " / " << report.clusters << std::endl;
+  if (report.matched)
+  {
+    std::cout << "  cluster signal difference: mean " << report.signal_diff / report.matched
+              << " ADC, max " << report.signal_diff_max << " ADC" << std::endl;
+  }
+  if (report.cn_count)
+  {
+    std::cout << "  common noise difference: mean " << report.cn_diff / report.cn_count
+              << " ADC, max " << report.cn_diff_max << " ADC" << std::endl;
+  }
+}
+
+// Settings shared by all the detectors of the run
+struct clusterize_options
+{
+  int minADC_h, maxADC_h;
+  int minStrip, maxStrip;
+  int NChannels, NVas;
+  bool verb, dynped, invert;
+  int dynped_period, dynped_window; // events between calibration updates, memory of the tracker
+  bool dynsigma;                    // sigmas and status tracked too, not only pedestals and raw sigmas
+  float maxCN;
+  int cntype;
+  float highthreshold, lowthreshold;
+  bool absolute, symmetric;
+  int symmetricwidth;
+  float sensor_pitch; // mm
+  int version;
+  bool fused, fixed, report_fixed;
+};
+
+// Clusters of an event as flat columns, the branches of the clusters TTree: no dictionary is
+// needed and a reader streams only the columns it asks for (e.g. cog without the ADC).
+// Schema 2 in the UserInfo of the TTree (cluster_schema); schema 1 was one std::vector<cluster>
+// branch per event (read with src/types.C). Macros/read_clusters.C is a reader example
+const int cluster_schema = 2;
+
+struct cluster_columns
+{
+  int nclusters = 0;
+  int nstrips = 0;                     // strips of all the clusters
+  std::vector<unsigned short> address; // one entry per cluster
+  std::vector<int> width, over, seed, board, side;
+  std::vector<float> signal, cog, eta, sn;
+  std::vector<float> ADC;              // jagged: the strips of each cluster, one cluster after the other
+
+  void reserve(int clusters, int strips);
+  void clear();
+  void add(const cluster &clus, const cluster_features &f);
+  void add(const cluster_columns &from, int first, int n, int first_strip, int strips); // slice of another buffer
+  void attach(TTree *t);                                                                // branches, or their buffers again
+  void fill(TTree *t);
+
+private:
+  size_t bound_clusters = 0; // capacities of the buffers given to the TTree
+  size_t bound_strips = 0;
+};
+
+void cluster_columns::reserve(int clusters, int strips)
+{
+  for (auto *v : {&width, &over, &seed, &board, &side})
+  {
+    v->reserve(clusters);
+  }
+  for (auto *v : {&signal, &cog, &eta, &sn})
+  {
+    v->reserve(clusters);
+  }
+  address.reserve(clusters);
+  ADC.reserve(strips);
+}
 
-calib update_pedestals(TH1D **hADC, int NChannels, calib cal)
-// Dynamic pedestal calculation while processing the file:
-// when used it is assumed that the single strip occupancy will be low (not true for an higly collimated beam)
+void cluster_columns::clear()
 {
-  calib new_calibration; // calibration struct
+  nclusters = nstrips = 0;
+  for (auto *v : {&width, &over, &seed, &board, &side})
+  {
+    v->clear();
+  }
+  for (auto *v : {&signal, &cog, &eta, &sn})
+  {
+    v->clear();
+  }
+  address.clear();
+  ADC.clear();
+}
+
+void cluster_columns::add(const cluster &clus, const cluster_features &f)
+{
+  address.push_back(clus.address);
+  width.push_back(clus.width);
+  over.push_back(clus.over);
+  seed.push_back(f.seed);
+  board.push_back(clus.board);
+  side.push_back(clus.side);
+  signal.push_back(f.signal);
+  cog.push_back(f.cog);
+  eta.push_back(f.eta);
+  sn.push_back(f.sn);
+  ADC.insert(ADC.end(), clus.ADC.begin(), clus.ADC.end());
+  nclusters++;
+  nstrips += clus.ADC.size();
+}
 
-  std::vector<float> pedestals; // vector of pedestals
-  float mean_pedestal = 0;
-  float rms_pedestal = 0;
-  std::vector<float> rsigma; // vector of strip noise
-  float mean_rsigma = 0;
-  float rms_rsigma = 0;
-  std::vector<float> sigma; // vector of strip noise after common mode subtraction
-  float mean_sigma = 0;
-  float rms_sigma = 0;
+template <typename T>
+void append_columns(std::vector<T> &to, const std::vector<T> &from, int first, int n)
+{
+  to.insert(to.end(), from.begin() + first, from.begin() + first + n);
+}
 
-  TF1 *fittedgaus;
+void cluster_columns::add(const cluster_columns &from, int first, int n, int first_strip, int strips)
+{
+  append_columns(address, from.address, first, n);
+  append_columns(width, from.width, first, n);
+  append_columns(over, from.over, first, n);
+  append_columns(seed, from.seed, first, n);
+  append_columns(board, from.board, first, n);
+  append_columns(side, from.side, first, n);
+  append_columns(signal, from.signal, first, n);
+  append_columns(cog, from.cog, first, n);
+  append_columns(eta, from.eta, first, n);
+  append_columns(sn, from.sn, first, n);
+  append_columns(ADC, from.ADC, first_strip, strips);
+  nclusters += n;
+  nstrips += strips;
+}
 
-  for (int ch = 0; ch < NChannels; ch++)
+void cluster_columns::attach(TTree *t)
+{
+  // leaflist arrays sized by the counters of the event
+  const bool create = !t->GetBranch("nclusters");
+  auto column = [&](const char *name, void *data, const char *leaves)
   {
-    // Fitting histos with gaus to compute ped and raw_sigma: it is assumed that channel noise is normal (true unless there is a problem with the readout ASIC)
-    if (hADC[ch]->GetEntries())
+    if (create)
     {
-      hADC[ch]->Fit("gaus", "QS");
-      fittedgaus = (TF1 *)hADC[ch]->GetListOfFunctions()->FindObject("gaus");
-      pedestals.push_back(fittedgaus->GetParameter(1)); // mean of the fitted gaussian is the pedestal for the channel
-      rsigma.push_back(fittedgaus->GetParameter(2));    // sigma of the fitted gaussian is the noise for the channel
+      t->Branch(name, data, leaves);
     }
     else
     {
-      pedestals.push_back(0); // there was no data to compute pedestals and noise (channel disabled): setting them to 0
-      rsigma.push_back(0);
+      t->SetBranchAddress(name, data);
+    }
+  };
+  column("nclusters", &nclusters, "nclusters/I");
+  column("address", address.data(), "address[nclusters]/s");
+  column("width", width.data(), "width[nclusters]/I");
+  column("over", over.data(), "over[nclusters]/I");
+  column("signal", signal.data(), "signal[nclusters]/F");
+  column("cog", cog.data(), "cog[nclusters]/F");
+  column("seed", seed.data(), "seed[nclusters]/I");
+  column("eta", eta.data(), "eta[nclusters]/F");
+  column("sn", sn.data(), "sn[nclusters]/F");
+  column("board", board.data(), "board[nclusters]/I");
+  column("side", side.data(), "side[nclusters]/I");
+  column("nstrips", &nstrips, "nstrips/I");
+  column("ADC", ADC.data(), "ADC[nstrips]/F");
+  bound_clusters = address.capacity();
+  bound_strips = ADC.capacity();
+}
+
+void cluster_columns::fill(TTree *t)
+{
+  if (address.capacity() != bound_clusters || ADC.capacity() != bound_strips) // a buffer has moved
+  {
+    attach(t);
+  }
+  t->Fill();
+}
+
+// Clusters of a range of events of one detector, buffered by a worker of the parallel loop
+struct range_clusters
+{
+  std::vector<int> event;     // events saved in the TTree
+  std::vector<int> nclusters; // clusters of each event
+  std::vector<int> nstrips;   // strips of each event
+  cluster_columns columns;    // clusters of all the events, one event after the other
+};
+
+// BL monster (--version 2024): only channels 320-383 and 448-639 are clusterized, as strips 0-255.
+// Applied to the signal and to the calibration used for the clusters, so that the cuts of each strip
+// are the ones of its channel
+template <typename T>
+void keep_bl_monster_channels(std::vector<T> &v)
+{
+  v.erase(v.begin(), v.begin() + 320);
+  v.erase(v.begin() + 64, v.begin() + 128);
+  v.erase(v.begin() + 256, v.end());
+}
+
+// One detector (board and side) of the run: histograms, calibration, clusters TTree and the
+// buffers reused from event to event. main reads every entry once and then calls process()
+// for all the detectors, so an N board run is read from disk once instead of 2N times
+class detector_clusterizer
+{
+public:
+  detector_clusterizer(int board, int side, const clusterize_options &opt);
+  ~detector_clusterizer();
+
+  detector_clusterizer(const detector_clusterizer &) = delete;
+  detector_clusterizer &operator=(const detector_clusterizer &) = delete;
+
+  bool init(const std::string &calibration_file, TDirectory *dir); // false if the detector can't be clusterized
+  void track_pedestals(int index_event, const std::vector<unsigned int> &raw); // --dynped, called on every event before process()
+  void process(int index_event);         // raw_event of the entry just read
+  void finish();                         // summary, histograms and TTree written in the detector directory
+
+  // Parallel loop: workers have their own copy of the detector, main saves their clusters in
+  // event order and sums their histograms at the end
+  std::unique_ptr<detector_clusterizer> worker() const; // same calibration and pipelines, histograms in no directory
+  void follow_pedestals(const detector_clusterizer &main);
+  void flush(); // worker: clusterizes and saves the events still in the block
+  void commit(const range_clusters &clusters);
+  void merge(const detector_clusterizer &worker);
+
+  int board;
+  int side;
+  std::vector<unsigned int> *raw_event = 0; // buffer vector for the raw event in the TTree
+  TBranch *RAW = 0;
+  range_clusters *out = 0;                  // worker: clusters of the current range
+  int clustered_event = -1;                 // event of event_clusters(), not updated for skipped events
+
+  const cluster_columns &event_clusters() const { return columns; }
+  int channels() const { return opt.NChannels; }
+
+private:
+  void book();
+  void queue(int index_event, const std::vector<float> &signal);
+  void save(int index_event, clusterize_status status); // clusters of arena: status, TTree (or out) and histograms
+
+  clusterize_options opt;
+  bool fused, fixed, report_fixed; // switched off for this detector when not available
+  TDirectory *dir = 0;
+
+  TH1F *hADCCluster, *hHighest, *hADCClusterEdge, *hADCCluster1Strip, *hADCCluster2Strip, *hADCClusterManyStrip;
+  TH1F *hADCClusterSeed, *hPercentageSeed, *hPercSeedintegral, *hClusterCharge, *hSeedCharge, *hClusterSN, *hSeedSN;
+  TH1F *hClusterCog, *hBeamProfile, *hSeedPos, *hNclus, *hStatus, *hNstrip, *hNstripSeed;
+  TH1F *hEta, *hEta1, *hEta2, *hDifference, *hCommonNoise0, *hCommonNoise1, *hCommonNoise2;
+  TH2F *hADCvsSeed, *hADCvsWidth, *hADCvsPos, *hADCvsEta, *hADCvsSN, *hNStripvsSN;
+  TH2F *hCommonNoiseVsVA, *hEtaVsADC, *hADC0vsADC1;
+  TGraph *nclus_event = 0;
+  std::vector<TH1 *> histos; // all the histograms above, in booking order
+
+  std::vector<cluster> result;             // Vector of resulting clusters
+  std::vector<cluster_features> features; // of each cluster in result
+  cluster_columns columns;                // result in the TTree
+  cluster_arena arena;         // clusterize_event output, reused for all the events
+  long overflow_events = 0;    // events with more than maxClusters seeds
+  TTree *t_clusters = 0;
+
+  calib cal;                                 // calibration struct
+  calib monster_cal;                         // BL_monster: cal of the clusterized channels
+  calib *cluster_cal() { return BL_monster ? &monster_cal : &cal; }
+  void update_monster_cal();
+  std::unique_ptr<pedestal_tracker> tracker; // --dynped
+
+  int maxADC = 0; // max ADC in all the events, to set proper graph/histo limits
+  int maxEVT = 0; // event where maxADC was found
+  int maxPOS = 0; // position of the strip with value maxADC
+  bool AMS = false;
+  bool BL_monster = false;
+
+  event_cn ecn;             // common noise of the current event, memory reused for all the events
+  std::vector<float> va_cn; // fused kernel: common noise to subtract from each VA
+
+  fixed_calib fcal;              // fixed point pipeline (--fixed, --fixed_report)
+  std::vector<int16_t> fsignal;  // signal in 1/8 ADC
+  event_cn fixed_ecn;            // common noise of the fixed point pipeline in the comparison
+  cluster_arena fixed_arena;     // clusters of the fixed point pipeline in the comparison
+  std::vector<float> fixed_va_cn;
+  fixed_report report;
+
+  // Workers with the standard kernel: the events of a range are clusterized block_events at a time by
+  // clusterize_events, the strip cuts are checked once per block. The block is flushed before the
+  // calibration changes, so the clusters are the ones of clusterize_event
+  static const int block_events = 64;
+  bool blocks = false;
+  int block_channels = 0;
+  std::vector<float> block_signal; // signal of the events of the block, one after the other
+  std::vector<char> block_valid;
+  std::vector<int> block_event;
+  cluster_table table;
+};
+
+detector_clusterizer::detector_clusterizer(int board, int side, const clusterize_options &opt)
+    : board(board), side(side), opt(opt), fused(opt.fused), fixed(opt.fixed), report_fixed(opt.report_fixed)
+{
+}
+
+detector_clusterizer::~detector_clusterizer()
+{
+  for (TH1 *h : histos) // workers: the main detectors delete theirs in finish()
+  {
+    delete h;
+  }
+  delete nclus_event;
+}
+
+bool detector_clusterizer::init(const std::string &calibration_file, TDirectory *dir)
+{
+  // Read Calibration file
+  if (!calibration_file.size())
+  {
+    std::cout << "Error: no calibration file" << std::endl;
+    return false;
+  }
+
+  bool is_calib = false;
+
+  is_calib = read_calib(calibration_file.c_str(), &cal, opt.NChannels, 2 * board + side, opt.verb);
+
+  if (!is_calib)
+  {
+    std::cout << "ERROR: no calibration file found" << std::endl;
+    return false;
+  }
+
+  this->dir = dir;
+  dir->cd(); // histograms and TTree of the detector belong to its directory
+  book();
+
+  // add t_clusters TTree to output file with name containing board and side
+  TString tree_name = "t_clusters_board_" + std::to_string(board) + "_side_" + std::to_string(side);
+  t_clusters = new TTree(tree_name, Form("clusters board %d side %d, flat columns (schema %d)", board, side, cluster_schema));
+  t_clusters->GetUserInfo()->Add(new TParameter<int>("cluster_schema", cluster_schema));
+  columns.reserve(opt.NChannels, opt.NChannels); // fill() gives the TTree the new buffers if one still grows
+  columns.attach(t_clusters);
+
+  if (opt.dynped) // starts from the calibration file, as if it had been tracked for a whole window
+  {
+    tracker.reset(new pedestal_tracker(opt.NChannels, opt.dynped_window));
+    tracker->seed(cal, opt.dynped_window);
+  }
+
+  std::cout << "\nProcessing events for board " << board << " side " << side << std::endl;
+
+  if (opt.version == 2023 || opt.version == 2024)
+  {
+    AMS = true;
+    //cout << "AMS is " << AMS << endl;
+    if (opt.version == 2024)
+    {
+      BL_monster = true;
+      //cout << "BL_monster is " << BL_monster << endl;
     }
   }
 
-  new_calibration = (calib){.ped = pedestals, .rsig = rsigma, .sig = cal.sig, .status = cal.status}; // new calibration structure has the updated pedestals, we use previous info for all the other parameters
-  return new_calibration;
+  if (BL_monster && (opt.NChannels < 640 || cal.ped.size() < opt.NChannels || cal.rsig.size() < opt.NChannels ||
+                     cal.sig.size() < opt.NChannels || cal.status.size() < opt.NChannels))
+  {
+    std::cout << "Error: BL monster needs a calibration of at least 640 channels" << std::endl;
+    return false;
+  }
+  update_monster_cal();
+
+  if ((fused || fixed || report_fixed) && (opt.verb || BL_monster))
+  {
+    std::cout << "Fused event kernel not available " << (opt.verb ? "in verbose mode" : "for this version") << ", using the standard one" << std::endl;
+    fused = fixed = report_fixed = false;
+  }
+  if ((fixed || report_fixed) && (cal.ped.size() < opt.NChannels || cal.status.size() < opt.NChannels || cal.sig.size() < opt.NChannels))
+  {
+    std::cout << "Fixed point pipeline not available: calibration shorter than the detector" << std::endl;
+    fixed = report_fixed = false;
+  }
+  if (report_fixed) // the float pipeline of the comparison: same output as the standard one
+  {
+    fixed = false;
+    fused = true;
+  }
+
+  if (fixed || report_fixed)
+  {
+    make_fixed_calib(fcal, cal, opt.NChannels, opt.highthreshold, opt.lowthreshold, opt.absolute);
+  }
+  return true;
 }
 
-int clusterize_detector(int board, int side, int minADC_h, int maxADC_h, int minStrip, int maxStrip,
-                        bool newDAQ, int first_event, int NChannels, bool verb, bool dynped,
-                        bool invert, float maxCN, int cntype, int NVas,
-                        float highthreshold, float lowthreshold, bool absolute,
-                        bool symmetric, int symmetricwidth,
-                        int sensor_pitch, int version, std::vector<std::string> input_files, int nevents = -1, std::string calibration_file = "")
+void detector_clusterizer::book()
 {
   //////////////////Histos//////////////////
-  TH1F *hADCCluster = // ADC content of all clusters
-      new TH1F((TString) "hADCCluster_board_" + board + "_side_" + side, (TString) "hADCCluster_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCCluster = // ADC content of all clusters
+      new TH1F((TString) "hADCCluster_board_" + board + "_side_" + side, (TString) "hADCCluster_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCCluster->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hHighest = // ADC of highest signal
-      new TH1F((TString) "hHighest_board_" + board + "_side_" + side, (TString) "hHighest_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hHighest = // ADC of highest signal
+      new TH1F((TString) "hHighest_board_" + board + "_side_" + side, (TString) "hHighest_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hHighest->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hADCClusterEdge = // ADC content of all clusters
-      new TH1F((TString) "hADCClusterEdge_board_" + board + "_side_" + side, (TString) "hADCClusterEdge_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCClusterEdge = // ADC content of all clusters
+      new TH1F((TString) "hADCClusterEdge_board_" + board + "_side_" + side, (TString) "hADCClusterEdge_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCClusterEdge->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hADCCluster1Strip = // ADC content of clusters with a single strips
-      new TH1F((TString) "hADCCluster1Strip_board_" + board + "_side_" + side, (TString) "hADCCluster1Strip_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCCluster1Strip = // ADC content of clusters with a single strips
+      new TH1F((TString) "hADCCluster1Strip_board_" + board + "_side_" + side, (TString) "hADCCluster1Strip_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCCluster1Strip->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hADCCluster2Strip = // ADC content of clusters with 2 strips
-      new TH1F((TString) "hADCCluster2Strip_board_" + board + "_side_" + side, (TString) "hADCCluster2Strip_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCCluster2Strip = // ADC content of clusters with 2 strips
+      new TH1F((TString) "hADCCluster2Strip_board_" + board + "_side_" + side, (TString) "hADCCluster2Strip_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCCluster2Strip->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hADCClusterManyStrip = // ADC content of clusters with more than 2 strips
-      new TH1F((TString) "hADCClusterManyStrip_board_" + board + "_side_" + side, (TString) "hADCClusterManyStrip_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCClusterManyStrip = // ADC content of clusters with more than 2 strips
+      new TH1F((TString) "hADCClusterManyStrip_board_" + board + "_side_" + side, (TString) "hADCClusterManyStrip_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCClusterManyStrip->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hADCClusterSeed = // ADC content of the "seed strip"
-      new TH1F((TString) "hADCClusterSeed_board_" + board + "_side_" + side, (TString) "hADCClusterSeed_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCClusterSeed = // ADC content of the "seed strip"
+      new TH1F((TString) "hADCClusterSeed_board_" + board + "_side_" + side, (TString) "hADCClusterSeed_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCClusterSeed->GetXaxis()->SetTitle("ADC");
 
-  TH1F *hPercentageSeed = // percentage of the "seed strip" wrt the whole cluster
+  hPercentageSeed = // percentage of the "seed strip" wrt the whole cluster
       new TH1F((TString) "hPercentageSeed_board_" + board + "_side_" + side, (TString) "hPercentageSeed_board_" + board + "_side_" + side, 200, 20, 150);
   hPercentageSeed->GetXaxis()->SetTitle("percentage");
 
-  TH1F *hPercSeedintegral =
+  hPercSeedintegral =
       new TH1F((TString) "hPercSeedintegral_board_" + board + "_side_" + side, (TString) "hPercSeedintegral_board_" + board + "_side_" + side, 200, 20, 150);
   hPercSeedintegral->GetXaxis()->SetTitle("percentage");
 
-  TH1F *hClusterCharge = // sqrt(ADC signal / MIP_ADC) for the cluster
+  hClusterCharge = // sqrt(ADC signal / MIP_ADC) for the cluster
       new TH1F((TString) "hClusterCharge_board_" + board + "_side_" + side, (TString) "hClusterCharge_board_" + board + "_side_" + side, 1000, -0.5, 25.5);
   hClusterCharge->GetXaxis()->SetTitle("Charge");
 
-  TH1F *hSeedCharge = new TH1F((TString) "hSeedCharge_board_" + board + "_side_" + side, (TString) "hSeedCharge_board_" + board + "_side_" + side, 1000, -0.5, 25.5); // sqrt(ADC signal / MIP_ADC) for the seed
+  hSeedCharge = new TH1F((TString) "hSeedCharge_board_" + board + "_side_" + side, (TString) "hSeedCharge_board_" + board + "_side_" + side, 1000, -0.5, 25.5); // sqrt(ADC signal / MIP_ADC) for the seed
   hSeedCharge->GetXaxis()->SetTitle("Charge");
 
-  TH1F *hClusterSN = new TH1F((TString) "hClusterSN_board_" + board + "_side_" + side, (TString) "hClusterSN_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h); // cluster S/N
+  hClusterSN = new TH1F((TString) "hClusterSN_board_" + board + "_side_" + side, (TString) "hClusterSN_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h); // cluster S/N
   hClusterSN->GetXaxis()->SetTitle("S/N");
 
-  TH1F *hSeedSN = new TH1F((TString) "hSeedSN_board_" + board + "_side_" + side, (TString) "hSeedSN_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h); // seed S/N
+  hSeedSN = new TH1F((TString) "hSeedSN_board_" + board + "_side_" + side, (TString) "hSeedSN_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h); // seed S/N
   hSeedSN->GetXaxis()->SetTitle("S/N");
 
-  TH1F *hClusterCog = new TH1F((TString) "hClusterCog_board_" + board + "_side_" + side, (TString) "hClusterCog_board_" + board + "_side_" + side, (maxStrip - minStrip), minStrip - 0.5, maxStrip - 0.5); // clusters center of gravity in terms of strip number
+  hClusterCog = new TH1F((TString) "hClusterCog_board_" + board + "_side_" + side, (TString) "hClusterCog_board_" + board + "_side_" + side, (opt.maxStrip - opt.minStrip), opt.minStrip - 0.5, opt.maxStrip - 0.5); // clusters center of gravity in terms of strip number
   hClusterCog->GetXaxis()->SetTitle("cog");
 
-  TH1F *hBeamProfile = new TH1F((TString) "hBeamProfile_board_" + board + "_side_" + side, (TString) "hBeamProfile_board_" + board + "_side_" + side, 100, -0.5, 99.5); // clusters center of gravity converted to mm
+  hBeamProfile = new TH1F((TString) "hBeamProfile_board_" + board + "_side_" + side, (TString) "hBeamProfile_board_" + board + "_side_" + side, 100, -0.5, 99.5); // clusters center of gravity converted to mm
   hBeamProfile->GetXaxis()->SetTitle("pos (mm)");
 
-  TH1F *hSeedPos = new TH1F((TString) "hSeedPos_board_" + board + "_side_" + side, (TString) "hSeedPos_board_" + board + "_side_" + side, (maxStrip - minStrip), minStrip - 0.5, maxStrip - 0.5); // clusters seed position in terms of strip number
+  hSeedPos = new TH1F((TString) "hSeedPos_board_" + board + "_side_" + side, (TString) "hSeedPos_board_" + board + "_side_" + side, (opt.maxStrip - opt.minStrip), opt.minStrip - 0.5, opt.maxStrip - 0.5); // clusters seed position in terms of strip number
   hSeedPos->GetXaxis()->SetTitle("strip");
 
-  TH1F *hNclus = new TH1F((TString) "hclus_board_" + board + "_side_" + side, (TString) "hclus_board_" + board + "_side_" + side, 10, -0.5, 9.5); // number of clusters found in each event
+  hNclus = new TH1F((TString) "hclus_board_" + board + "_side_" + side, (TString) "hclus_board_" + board + "_side_" + side, 10, -0.5, 9.5); // number of clusters found in each event
   hNclus->GetXaxis()->SetTitle("n clusters");
 
-  TH1F *hNstrip = new TH1F((TString) "hNstrip_board_" + board + "_side_" + side, (TString) "hNstrip_board_" + board + "_side_" + side, 10, -0.5, 9.5); // number of strips per cluster
+  hStatus = new TH1F((TString) "hStatus_board_" + board + "_side_" + side, (TString) "hStatus_board_" + board + "_side_" + side, 3, -0.5, 2.5); // clusterize_event outcome of each event
+  hStatus->GetXaxis()->SetBinLabel(CLUSTERIZE_ok + 1, "ok");
+  hStatus->GetXaxis()->SetBinLabel(CLUSTERIZE_no_seed + 1, "no seed");
+  hStatus->GetXaxis()->SetBinLabel(CLUSTERIZE_overflow + 1, "overflow");
+
+  hNstrip = new TH1F((TString) "hNstrip_board_" + board + "_side_" + side, (TString) "hNstrip_board_" + board + "_side_" + side, 10, -0.5, 9.5); // number of strips per cluster
   hNstrip->GetXaxis()->SetTitle("n strips");
 
-  TH1F *hNstripSeed = new TH1F((TString) "hNstripSeed_board_" + board + "_side_" + side, (TString) "hNstripSeed_board_" + board + "_side_" + side, 10, -0.5, 9.5);
+  hNstripSeed = new TH1F((TString) "hNstripSeed_board_" + board + "_side_" + side, (TString) "hNstripSeed_board_" + board + "_side_" + side, 10, -0.5, 9.5);
   hNstripSeed->GetXaxis()->SetTitle("n strips over seed threshold");
 
-  TH2F *hADCvsSeed = new TH2F((TString) "hADCvsSeed_board_" + board + "_side_" + side, (TString) "hADCvsSeed_board_" + board + "_side_" + side, 1000, 0, 500, // cluster ADC vs seed ADC
+  hADCvsSeed = new TH2F((TString) "hADCvsSeed_board_" + board + "_side_" + side, (TString) "hADCvsSeed_board_" + board + "_side_" + side, 1000, 0, 500, // cluster ADC vs seed ADC
                               1000, 0, 500);
   hADCvsSeed->GetXaxis()->SetTitle("ADC Seed");
   hADCvsSeed->GetYaxis()->SetTitle("ADC Tot");
 
-  TH1F *hEta = new TH1F((TString) "hEta_board_" + board + "_side_" + side, (TString) "hEta_board_" + board + "_side_" + side, 100, 0, 1); // not the real eta function, ignore
+  hEta = new TH1F((TString) "hEta_board_" + board + "_side_" + side, (TString) "hEta_board_" + board + "_side_" + side, 100, 0, 1); // not the real eta function, ignore
   hEta->GetXaxis()->SetTitle("Eta");
 
-  TH1F *hEta1 = new TH1F((TString) "hEta1_board_" + board + "_side_" + side, (TString) "hEta1_board_" + board + "_side_" + side, 100, 0, 1); // not the real eta function, ignore
+  hEta1 = new TH1F((TString) "hEta1_board_" + board + "_side_" + side, (TString) "hEta1_board_" + board + "_side_" + side, 100, 0, 1); // not the real eta function, ignore
   hEta1->GetXaxis()->SetTitle("Eta (one seed)");
 
-  TH1F *hEta2 = new TH1F((TString) "hEta2_board_" + board + "_side_" + side, (TString) "hEta2_board_" + board + "_side_" + side, 100, 0, 1); // not the real eta function, ignore
+  hEta2 = new TH1F((TString) "hEta2_board_" + board + "_side_" + side, (TString) "hEta2_board_" + board + "_side_" + side, 100, 0, 1); // not the real eta function, ignore
   hEta2->GetXaxis()->SetTitle("Eta (two seed)");
 
-  TH1F *hDifference = new TH1F((TString) "hDifference_board_" + board + "_side_" + side, (TString) "hDifference_board_" + board + "_side_" + side, 200, -5, 5); // relative difference for clusters with 2 strips
+  hDifference = new TH1F((TString) "hDifference_board_" + board + "_side_" + side, (TString) "hDifference_board_" + board + "_side_" + side, 200, -5, 5); // relative difference for clusters with 2 strips
   hDifference->GetXaxis()->SetTitle("(ADC_0-ADC_1)/(ADC_0+ADC_1)");
 
-  TH2F *hADCvsWidth = // cluster ADC vs cluster width
+  hADCvsWidth = // cluster ADC vs cluster width
       new TH2F((TString) "hADCvsWidth_board_" + board + "_side_" + side, (TString) "hADCvsWidth_board_" + board + "_side_" + side, 10, -0.5, 9.5, 1000, 0, 500);
   hADCvsWidth->GetXaxis()->SetTitle("# of strips");
   hADCvsWidth->GetYaxis()->SetTitle("ADC");
 
-  TH2F *hADCvsPos = new TH2F((TString) "hADCvsPos_board_" + board + "_side_" + side, (TString) "hADCvsPos_board_" + board + "_side_" + side, (maxStrip - minStrip), minStrip - 0.5, maxStrip - 0.5, // cluster ADC vs cog
-                             1000, minADC_h, maxADC_h);
+  hADCvsPos = new TH2F((TString) "hADCvsPos_board_" + board + "_side_" + side, (TString) "hADCvsPos_board_" + board + "_side_" + side, (opt.maxStrip - opt.minStrip), opt.minStrip - 0.5, opt.maxStrip - 0.5, // cluster ADC vs cog
+                             1000, opt.minADC_h, opt.maxADC_h);
 
   hADCvsPos->GetXaxis()->SetTitle("cog");
   hADCvsPos->GetYaxis()->SetTitle("ADC");
 
-  TH2F *hADCvsEta = // ignore
-      new TH2F((TString) "hADCvsEta_board_" + board + "_side_" + side, (TString) "hADCvsEta_board_" + board + "_side_" + side, 200, 0, 1, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCvsEta = // ignore
+      new TH2F((TString) "hADCvsEta_board_" + board + "_side_" + side, (TString) "hADCvsEta_board_" + board + "_side_" + side, 200, 0, 1, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCvsEta->GetXaxis()->SetTitle("eta");
   hADCvsEta->GetYaxis()->SetTitle("ADC");
 
-  TH2F *hADCvsSN = new TH2F((TString) "hADCvsSN_board_" + board + "_side_" + side, (TString) "hADCvsSN_board_" + board + "_side_" + side, 2000, 0, 2500, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hADCvsSN = new TH2F((TString) "hADCvsSN_board_" + board + "_side_" + side, (TString) "hADCvsSN_board_" + board + "_side_" + side, 2000, 0, 2500, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hADCvsSN->GetXaxis()->SetTitle("S/N");
   hADCvsSN->GetYaxis()->SetTitle("ADC");
 
-  TH2F *hNStripvsSN =
+  hNStripvsSN =
       new TH2F((TString) "hNstripvsSN_board_" + board + "_side_" + side, (TString) "hNstripvsSN_board_" + board + "_side_" + side, 1000, 0, 2500, 5, -0.5, 4.5);
   hNStripvsSN->GetXaxis()->SetTitle("S/N");
   hNStripvsSN->GetYaxis()->SetTitle("# of strips");
 
-  TH1F *hCommonNoise0 = new TH1F((TString) "hCommonNoise0_board_" + board + "_side_" + side, (TString) "hCommonNoise0_board_" + board + "_side_" + side, 100, -20, 20); // common noise: first algo
+  hCommonNoise0 = new TH1F((TString) "hCommonNoise0_board_" + board + "_side_" + side, (TString) "hCommonNoise0_board_" + board + "_side_" + side, 100, -20, 20); // common noise: first algo
   hCommonNoise0->GetXaxis()->SetTitle("CN");
 
-  TH1F *hCommonNoise1 = new TH1F((TString) "hCommonNoise1_board_" + board + "_side_" + side, (TString) "hCommonNoise1_board_" + board + "_side_" + side, 100, -20, 20); // common noise: second algo
+  hCommonNoise1 = new TH1F((TString) "hCommonNoise1_board_" + board + "_side_" + side, (TString) "hCommonNoise1_board_" + board + "_side_" + side, 100, -20, 20); // common noise: second algo
   hCommonNoise1->GetXaxis()->SetTitle("CN");
 
-  TH1F *hCommonNoise2 = new TH1F((TString) "hCommonNoise2_board_" + board + "_side_" + side, (TString) "hCommonNoise2_board_" + board + "_side_" + side, 100, -20, 20); // common noise: third algo
+  hCommonNoise2 = new TH1F((TString) "hCommonNoise2_board_" + board + "_side_" + side, (TString) "hCommonNoise2_board_" + board + "_side_" + side, 100, -20, 20); // common noise: third algo
   hCommonNoise2->GetXaxis()->SetTitle("CN");
 
-  TH2F *hCommonNoiseVsVA = new TH2F((TString) "hCommonNoiseVsVA_board_" + board + "_side_" + side, (TString) "hCommonNoiseVsVA_board_" + board + "_side_" + side, 100, -20, 20, 10, -0.5, 9.5);
+  hCommonNoiseVsVA = new TH2F((TString) "hCommonNoiseVsVA_board_" + board + "_side_" + side, (TString) "hCommonNoiseVsVA_board_" + board + "_side_" + side, 100, -20, 20, 10, -0.5, 9.5);
   hCommonNoiseVsVA->GetXaxis()->SetTitle("CN");
   hCommonNoiseVsVA->GetYaxis()->SetTitle("VA");
 
-  TH2F *hEtaVsADC = new TH2F((TString) "hEtaVsADC_board_" + board + "_side_" + side, (TString) "hEtaVsADC_board_" + board + "_side_" + side, 100, 0, 1, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h);
+  hEtaVsADC = new TH2F((TString) "hEtaVsADC_board_" + board + "_side_" + side, (TString) "hEtaVsADC_board_" + board + "_side_" + side, 100, 0, 1, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h);
   hCommonNoiseVsVA->GetXaxis()->SetTitle("ADC");
   hCommonNoiseVsVA->GetYaxis()->SetTitle("Eta");
 
-  TH2F *hADC0vsADC1 = new TH2F((TString) "hADC0vsADC1_board_" + board + "_side_" + side, (TString) "hADC0vsADC1_board_" + board + "_side_" + side, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h, (maxADC_h - minADC_h) / 2, minADC_h, maxADC_h); // ADC of first strip vs ADC of second strip for clusters with 2 strips
+  hADC0vsADC1 = new TH2F((TString) "hADC0vsADC1_board_" + board + "_side_" + side, (TString) "hADC0vsADC1_board_" + board + "_side_" + side, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h, (opt.maxADC_h - opt.minADC_h) / 2, opt.minADC_h, opt.maxADC_h); // ADC of first strip vs ADC of second strip for clusters with 2 strips
   hADC0vsADC1->GetXaxis()->SetTitle("ADC0");
   hADC0vsADC1->GetYaxis()->SetTitle("ADC1");
 
-  TGraph *nclus_event = new TGraph(); // number of clusters as a function of event number
+  nclus_event = new TGraph(); // number of clusters as a function of event number
   nclus_event->SetName((TString) "nclus_event_board_" + board + "_side_" + side);
   nclus_event->SetTitle((TString) "nclus_event_board_" + board + "_side_" + side);
 
-  // Join ROOTfiles in a single chain
-  TChain *chain = new TChain();  // TChain for the first detector TTree (we read 2 detectors with each board on the new DAQ and 1 with the miniTRB)
-  TChain *chain2 = new TChain(); // TChain for the second detector TTree
-
-  std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  histos = {hADCCluster, hHighest, hADCClusterEdge, hADCCluster1Strip, hADCCluster2Strip, hADCClusterManyStrip,
+            hADCClusterSeed, hPercentageSeed, hPercSeedintegral, hClusterCharge, hSeedCharge, hClusterSN, hSeedSN,
+            hClusterCog, hBeamProfile, hSeedPos, hNclus, hStatus, hNstrip, hNstripSeed,
+            hEta, hEta1, hEta2, hDifference, hCommonNoise0, hCommonNoise1, hCommonNoise2,
+            hADCvsSeed, hADCvsWidth, hADCvsPos, hADCvsEta, hADCvsSN, hNStripvsSN,
+            hCommonNoiseVsVA, hEtaVsADC, hADC0vsADC1};
+}
 
-  if (board == 0) // TTree name depends on DAQ board
+void detector_clusterizer::update_monster_cal()
+{
+  if (BL_monster)
   {
-    chain->SetName("raw_events"); // simply called raw_events for retrocompatibility with old files from the prototype
-    for (int ii = 0; ii < input_files.size(); ii++)
-    {
-      std::cout << "\nAdding file " << input_files[ii] << " to the chain..." << std::endl;
-      chain->Add(input_files[ii].c_str());
-    }
-    if (newDAQ)
-    {
-      chain2->SetName("raw_events_B");
-      for (int ii = 0; ii < input_files.size(); ii++)
-      {
-        chain2->Add(input_files[ii].c_str());
-      }
-      chain->AddFriend(chain2);
-    }
+    monster_cal = cal;
+    keep_bl_monster_channels(monster_cal.ped);
+    keep_bl_monster_channels(monster_cal.rsig);
+    keep_bl_monster_channels(monster_cal.sig);
+    keep_bl_monster_channels(monster_cal.status);
   }
-  else
+}
+
+void detector_clusterizer::track_pedestals(int index_event, const std::vector<unsigned int> &raw)
+{
+  INSTRUMENT_SCOPE("dynamic pedestals");
+  if (index_event % opt.dynped_period == 0 && tracker->events()) // calibration of the next events
   {
-    chain->SetName((TString) "raw_events_" + alphabet.at(2 * board));
-    for (int ii = 0; ii < input_files.size(); ii++)
-    {
-      std::cout << "\nAdding file " << input_files[ii] << " to the chain..." << std::endl;
-      chain->Add(input_files[ii].c_str());
-    }
-    chain2->SetName((TString) "raw_events_" + alphabet.at(2 * board + 1));
-    for (int ii = 0; ii < input_files.size(); ii++)
+    flush(); // the events before keep the old one
+    if (opt.verb)
     {
-      chain2->Add(input_files[ii].c_str());
+      std::cout << "Updating pedestals" << std::endl;
     }
-    chain->AddFriend(chain2);
-  }
-
-  int entries = chain->GetEntries();
-
-  if (nevents) // to process only the first "nevents" events in the chain 
-  {
-    unsigned int temp_entries = nevents;
-    if (temp_entries < entries)
+    tracker->refresh(cal, opt.dynsigma);
+    update_monster_cal();
+    if (fixed || report_fixed)
     {
-      entries = temp_entries;
+      make_fixed_calib(fcal, cal, opt.NChannels, opt.highthreshold, opt.lowthreshold, opt.absolute);
     }
   }
 
-  if (entries == 0)
+  if (raw.size() == opt.NChannels)
   {
-    std::cout << "Error: no file or empty file" << std::endl;
-    return 2;
+    tracker->add_event(raw.data()); // hits are rejected by the tracker
   }
-  std::cout << "\nThis run has " << entries << " entries" << std::endl;
+}
 
-  if (first_event > entries)
+void detector_clusterizer::process(int index_event)
+{
+  INSTRUMENT_LAP(lap);
+  std::vector<float> signal(raw_event->size()); // Vector of pedestal subtracted signal
+  bool cn_done = false;                         // common noise already computed by the fused kernel
+  auto start = std::chrono::steady_clock::now(); // --fixed_report
+  double float_time = 0;
+  double fixed_time = 0;
+
+  if (raw_event->size() == opt.NChannels) // if the raw file was correctly processed these is the only possible value
   {
-    std::cout << "Error: first event is greater than the number of entries" << std::endl;
-    return 2;
-  }
+    if ((fused || fixed) && cal.ped.size() >= raw_event->size() && cal.status.size() >= raw_event->size())
+    {
+      start = std::chrono::steady_clock::now();
+      if (fixed)
+      {
+        GetFixedEventCN(ecn, fsignal, *raw_event, fcal, opt.invert); // same in 1/8 ADC
+      }
+      else
+      {
+        GetRawEventCN(ecn, signal, *raw_event, cal, opt.invert); // pedestals, transposition and common noise
+      }
+      float_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      cn_done = true;
+    }
+    else if (cal.ped.size() >= raw_event->size())
+    {
+      for (size_t i = 0; i != raw_event->size(); i++)
+      {
+        if (cal.status[i] != 0)
+        {
+          signal.at(i) = 0; // channel has a non 0 status in calibration (problem with channel: noisy, dead etc..), setting signal to 0
+        }
+        else
+        {
 
-  std::vector<unsigned int> *raw_event = 0; // buffer vector for the raw event in the TTree
-  TBranch *RAW = 0;
+          signal.at(i) = (raw_event->at(i) - cal.ped[i]);
 
-  if(side == 0)
-  {
-    chain->SetBranchAddress("RAW Event J5", &raw_event, &RAW);
+          if (opt.invert)
+          {
+            signal.at(i) = -signal.at(i); // one of the prototype DAQ boards had the analog output inverted
+          }
+        }
+      }
+    }
+    else
+    {
+      if (opt.verb)
+      {
+        std::cout << "Error: calibration file is not compatible" << std::endl;
+      }
+    }
   }
   else
   {
-    chain->SetBranchAddress("RAW Event J7", &raw_event, &RAW);
-  }
-
-  std::vector<cluster> result; // Vector of resulting clusters
-
-  // add t_clusters TTree to output file with name containing board and side
-  TString tree_name = "t_clusters_board_" + std::to_string(board) + "_side_" + std::to_string(side);
-  TTree *t_clusters = new TTree(tree_name, tree_name);
-  t_clusters->Branch("clusters", &result);
-
-  // Read Calibration file
-  if (!calibration_file.size())
-  {
-    std::cout << "Error: no calibration file" << std::endl;
-    return 2;
+    if (opt.verb)
+    {
+      std::cout << "Error: event " << index_event << " is not complete, skipping it" << std::endl;
+    }
+    return;
   }
+  INSTRUMENT_STAGE(lap, "pedestals"); // and common noise in the fused kernels
 
-  calib cal; // calibration struct
-  bool is_calib = false;
-
-  is_calib = read_calib(calibration_file.c_str(), &cal, NChannels, 2 * board + side, verb);
-
-  if (!is_calib)
+  if (!cn_done)
   {
-    std::cout << "ERROR: no calibration file found" << std::endl;
-    return 2;
+    GetEventCN(ecn, signal); // the three algorithms on every VA at once
   }
 
-  // histos for dynamic calibration
-  TH1D *hADC[NChannels];
-  for (int ch = 0; ch < NChannels; ch++)
+  for (int va = 0; va < opt.NVas; va++) // Loop on VA (readout chip): common noise algo 1
   {
-    hADC[ch] = new TH1D(Form("pedestal_channel_%d_board_%d_side_%d", ch, board, side), Form("Pedestal %d", ch), 50, 0, -1);
-    hADC[ch]->GetXaxis()->SetTitle("ADC");
+    float cn = ecn.cn[0][va];
+    if (opt.verb)
+    {
+      std::cout << "VA " << va << ": " << cn << std::endl;
+    }
+    if (cn != -999 && abs(cn) < opt.maxCN)
+    {
+      hCommonNoise0->Fill(cn);
+    }
   }
 
-  // Loop over events
-  int perc = 0;   // percentage of processed events
-  int maxADC = 0; // max ADC in all the events, to set proper graph/histo limits
-  int maxEVT = 0; // event where maxADC was found
-  int maxPOS = 0; // position of the strip with value maxADC
-  bool AMS = false;
-
-  std::cout << "\n===========================================================" << std::endl;
-  std::cout << "\nProcessing events for board " << board << " side " << side << std::endl;
-
-  std::cout << "\nProcessing " << entries << " entries, starting from event " << first_event << std::endl;
-
-  bool BL_monster = false;
-  if (version == 2023 || version == 2024)
+  for (int va = 0; va < opt.NVas; va++) // Loop on VA: common noise algo 2
   {
-    AMS = true;
-    //cout << "AMS is " << AMS << endl;
-    if (version == 2024)
+    float cn = ecn.cn[1][va];
+    if (cn != -999 && abs(cn) < opt.maxCN)
     {
-      BL_monster = true;
-      //cout << "BL_monster is " << BL_monster << endl;
+      hCommonNoise1->Fill(cn);
     }
   }
 
-  for (int index_event = first_event; index_event < entries; index_event++) // looping on the events
+  for (int va = 0; va < opt.NVas; va++) // Loop on VA: common noise algo 3
   {
-    chain->GetEntry(index_event);
-
-    if (verb)
-    {
-      std::cout << std::endl;
-      std::cout << "EVENT: " << index_event << std::endl;
-    }
-    Double_t pperc = 10.0 * ((index_event + 1.0) / entries); // print every 10% of processed events
-    if (pperc >= perc)
+    float cn = ecn.cn[2][va];
+    if (cn != -999 && abs(cn) < opt.maxCN)
     {
-      std::cout << "Processed " << (index_event + 1) << " out of " << entries
-                << ":" << (int)(100.0 * (index_event + 1.0) / entries) << "%"
-                << std::endl;
-      perc++;
+      hCommonNoise2->Fill(cn);
     }
+  }
 
-    if ((index_event % 5000) == 0 && dynped) // if dynamic pedestals are enabled we recalculate them
+  bool goodCN = true;
+  va_cn.clear();
+  if (opt.cntype >= 0 && (fused || fixed)) // the subtraction is done by clusterize_event_cn
+  {
+    for (int va = 0; va < opt.NVas; va++)
     {
-      std::cout << "Updating pedestals" << std::endl;
-
-      cal = update_pedestals(hADC, NChannels, cal);
-      for (int ch = 0; ch < NChannels; ch++)
+      float cn = ecn.get(va, opt.cntype);
+      if (opt.verb)
+      {
+        std::cout << "VA " << va << " CN " << cn << std::endl;
+      }
+      goodCN = cn != -999 && abs(cn) < opt.maxCN; // as the loop below: the last VA decides
+      if (goodCN)
       {
-        hADC[ch]->Reset(); // we only keep the last 5000 events for the pedestals
+        hCommonNoiseVsVA->Fill(cn, va);
       }
+      va_cn.push_back(goodCN ? cn : NAN); // NaN: VA set to 0
     }
-
-    std::vector<float> signal(raw_event->size()); // Vector of pedestal subtracted signal
-
-    if (raw_event->size() == NChannels) // if the raw file was correctly processed these is the only possible value
+  }
+  else if (opt.cntype >= 0)
+  {
+    for (int va = 0; va < opt.NVas; va++) // Loop on VA
     {
-      if (cal.ped.size() >= raw_event->size())
+      float cn = ecn.get(va, opt.cntype);
+      if (opt.verb)
       {
-        for (size_t i = 0; i != raw_event->size(); i++)
-        {
-          if (cal.status[i] != 0)
-          {
-            signal.at(i) = 0; // channel has a non 0 status in calibration (problem with channel: noisy, dead etc..), setting signal to 0
-          }
-          else
-          {
-
-            signal.at(i) = (raw_event->at(i) - cal.ped[i]);
-            if (dynped && signal.at(i) < 10) // if dynamic pedestals are enabled and signal is below 10 (probably not signal) we save the value to recalculate the pedestal
-            {
-              hADC[i]->Fill(raw_event->at(i));
-            }
+        std::cout << "VA " << va << " CN " << cn << std::endl;
+      }
+      if (cn != -999 && abs(cn) < opt.maxCN)
+      {
+        hCommonNoiseVsVA->Fill(cn, va);
+        goodCN = true;
 
-            if (invert)
-            {
-              signal.at(i) = -signal.at(i); // one of the prototype DAQ boards had the analog output inverted
-            }
-          }
+        for (int ch = va * 64; ch < (va + 1) * 64; ch++) // Loop on VA channels, subtracting common mode noise to the signals before clustering
+        {
+          signal.at(ch) = signal.at(ch) - cn;
         }
       }
       else
       {
-        if (verb)
+        for (int ch = va * 64; ch < (va + 1) * 64; ch++)
         {
-          std::cout << "Error: calibration file is not compatible" << std::endl;
+          signal.at(ch) = 0; // Invalid Common Noise Value, artificially setting VA channel to 0 signal
+          goodCN = false;
         }
       }
     }
-    else
-    {
-      if (verb)
+  }
+
+  bool fixed_good = false; // --fixed_report: event accepted by the fixed point common noise cut
+  if (report_fixed && cn_done)
+  {
+    start = std::chrono::steady_clock::now();
+    GetFixedEventCN(fixed_ecn, fsignal, *raw_event, fcal, opt.invert);
+    fixed_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fixed_good = true;
+    fixed_va_cn.clear();
+    for (int va = 0; opt.cntype >= 0 && va < opt.NVas; va++) // same cut as the float pipeline
+    {
+      float cn = fixed_ecn.get(va, opt.cntype);
+      float float_cn = ecn.get(va, opt.cntype);
+      fixed_good = cn != -999 && abs(cn) < opt.maxCN;
+      fixed_va_cn.push_back(fixed_good ? cn : NAN);
+      if (fixed_good && float_cn != -999 && abs(float_cn) < opt.maxCN)
       {
-        std::cout << "Error: event " << index_event << " is not complete, skipping it" << std::endl;
+        report.cn_count++;
+        report.cn_diff += std::abs(cn - float_cn);
+        report.cn_diff_max = std::max<double>(report.cn_diff_max, std::abs(cn - float_cn));
       }
-      continue;
     }
+    report.cn_mismatch += fixed_good != goodCN;
+  }
+
+  INSTRUMENT_STAGE(lap, "common noise");
+
+  if (!goodCN)
+    return;
 
-    for (int va = 0; va < NVas; va++) // Loop on VA (readout chip): common noise algo 1
+  clusterize_status status;
+  if (fixed && cn_done)
+  {
+    float highest;
+    status = clusterize_fixed_event(arena, fcal, fsignal, va_cn, highest, opt.symmetric, opt.symmetricwidth, board, side);
+    if (highest > maxADC)
     {
-      float cn = GetCN(&signal, va, 0);
-      if (verb)
+      maxADC = highest;
+      maxEVT = index_event;
+    }
+    hHighest->Fill(highest);
+  }
+  else if (fused || fixed)
+  {
+    float highest;
+    start = std::chrono::steady_clock::now();
+    status = clusterize_event_cn(arena, &cal, &signal, va_cn, highest, opt.highthreshold, opt.lowthreshold,
+                                 opt.symmetric, opt.symmetricwidth, opt.absolute, board, side);
+    if (report_fixed && cn_done && fixed_good)
+    {
+      float_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      float fixed_highest;
+      start = std::chrono::steady_clock::now();
+      clusterize_fixed_event(fixed_arena, fcal, fsignal, fixed_va_cn, fixed_highest, opt.symmetric, opt.symmetricwidth, board, side);
+      fixed_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      report.float_time += float_time;
+      report.fixed_time += fixed_time;
+      compare_fixed(report, arena, fixed_arena);
+    }
+    if (highest > maxADC)
+    {
+      maxADC = highest;
+      maxEVT = index_event;
+    }
+    hHighest->Fill(highest);
+  }
+  else
+  {
+    // if (!AMSLO)
+    // {
+    //   if (*max_element(signal.begin(), signal.end()) > 4096) // 4096 is the maximum ADC value possible, any more than that means the event is corrupted
+    //     continue;
+    // }
+    // else
+    // {
+    //   cout << "AMSLO is true" << endl;
+    //   sleep(10);
+    // }
+
+    if (*max_element(signal.begin(), signal.end()) > maxADC) // searching for the highest ADC value
+    {
+      maxADC = *max_element(signal.begin(), signal.end());
+      maxEVT = index_event;
+      std::vector<float>::iterator it = std::find(signal.begin(), signal.end(), maxADC);
+      maxPOS = std::distance(signal.begin(), it);
+    }
+
+    if (opt.verb)
+      std::cout << "Highest strip: " << *max_element(signal.begin(), signal.end()) << std::endl;
+
+    hHighest->Fill(*max_element(signal.begin(), signal.end()));
+
+    // if it's BL_monster we keep only channels 320-383, 448-639, deleting the others from the vector
+    if (BL_monster)
+    {
+      keep_bl_monster_channels(signal);
+    }
+
+    if (blocks) // clusterized and saved by flush()
+    {
+      queue(index_event, signal);
+      return;
+    }
+
+    status = clusterize_event(arena, cluster_cal(), &signal, opt.highthreshold, opt.lowthreshold, // clustering function
+                              opt.symmetric, opt.symmetricwidth, opt.absolute, board, side, opt.verb);
+  }
+  INSTRUMENT_STAGE(lap, "clustering");
+  save(index_event, status);
+}
+
+void detector_clusterizer::queue(int index_event, const std::vector<float> &signal)
+{
+  if (!block_event.empty() && (int)signal.size() != block_channels)
+  {
+    flush();
+  }
+  block_channels = signal.size();
+  block_signal.insert(block_signal.end(), signal.begin(), signal.end());
+  block_valid.push_back(1);
+  block_event.push_back(index_event);
+  if ((int)block_event.size() == block_events)
+  {
+    flush();
+  }
+}
+
+void detector_clusterizer::flush()
+{
+  if (block_event.empty())
+  {
+    return;
+  }
+  INSTRUMENT_LAP(lap);
+  clusterize_events(table, cluster_cal(), block_signal, block_valid, block_channels, opt.highthreshold, opt.lowthreshold,
+                    opt.symmetric, opt.symmetricwidth, opt.absolute, board, side);
+  INSTRUMENT_STAGE(lap, "clustering");
+
+  size_t c = 0; // clusters of the table are in event order
+  for (size_t ev = 0; ev < block_event.size(); ev++)
+  {
+    arena.clear();
+    arena.board = board;
+    arena.side = side;
+    for (; c < table.size() && table.event[c] == (int)ev; c++)
+    {
+      arena.add(table.address[c], table.width[c], table.over[c], table.ADC(c));
+    }
+    if (table.status[ev] != CLUSTERIZE_invalid)
+    {
+      save(block_event[ev], table.status[ev]);
+    }
+  }
+  block_signal.clear();
+  block_valid.clear();
+  block_event.clear();
+}
+
+void detector_clusterizer::save(int index_event, clusterize_status status)
+{
+  INSTRUMENT_LAP(lap);
+  hStatus->Fill(status);
+  if (status == CLUSTERIZE_overflow) // too busy to be clusterized: counted, not saved
+  {
+    overflow_events++;
+    if (opt.verb)
+    {
+      std::cerr << "Too many seeds, skipping event " << index_event << std::endl;
+    }
+    return;
+  }
+  to_clusters(arena, result); // std::vector<cluster> for the histograms, its memory is reused too
+
+  features.clear();
+  columns.clear();
+  for (const cluster &clus : result)
+  {
+    features.push_back(GetClusterFeatures(clus, cluster_cal())); // all the cluster quantities in a single pass
+    columns.add(clus, features.back());
+  }
+  clustered_event = index_event;
+  INSTRUMENT_STAGE(lap, "clustering");
+  INSTRUMENT_COUNT("clusters", result.size());
+
+  if (out) // worker of the parallel loop: saved by main in event order
+  {
+    out->event.push_back(index_event);
+    out->nclusters.push_back(columns.nclusters);
+    out->nstrips.push_back(columns.nstrips);
+    out->columns.add(columns, 0, columns.nclusters, 0, columns.nstrips);
+  }
+  else
+  {
+    // save result cluster in TTree
+    columns.fill(t_clusters);
+
+    nclus_event->SetPoint(nclus_event->GetN(), index_event, result.size());
+  }
+  INSTRUMENT_STAGE(lap, "tree fill");
+  hNclus->Fill(result.size());
+
+  for (int i = 0; i < result.size(); i++)
+  {
+
+    if (opt.verb)
+    {
+      PrintCluster(result.at(i));
+    }
+
+    // if (!GoodCluster(result.at(i), &cal))
+    //   continue;
+
+    if (result.at(i).address >= opt.minStrip && (result.at(i).address + result.at(i).width - 1) < opt.maxStrip) // cut on position on the detector in terms of strip number
+    {
+
+      const cluster_features &f = features[i];
+
+      hADCCluster->Fill(f.signal);
+
+      if (f.seed % 64 == 0)
       {
-        std::cout << "VA " << va << ": " << cn << std::endl;
+        hADCClusterEdge->Fill(f.signal);
       }
-      if (cn != -999 && abs(cn) < maxCN)
+
+      if (result.at(i).width == 1)
       {
-        hCommonNoise0->Fill(cn);
+        hADCCluster1Strip->Fill(f.signal);
+        hEtaVsADC->Fill(f.eta, f.signal);
       }
-    }
-
-    for (int va = 0; va < NVas; va++) // Loop on VA: common noise algo 2
-    {
-      float cn = GetCN(&signal, va, 1);
-      if (cn != -999 && abs(cn) < maxCN)
+      else if (result.at(i).width == 2)
       {
-        hCommonNoise1->Fill(cn);
+        hADCCluster2Strip->Fill(f.signal);
+        hEtaVsADC->Fill(f.eta, f.signal);
+      }
+      else
+      {
+        hADCClusterManyStrip->Fill(f.signal);
+        hEtaVsADC->Fill(f.eta, f.signal);
       }
-    }
 
-    for (int va = 0; va < NVas; va++) // Loop on VA: common noise algo 3
-    {
-      float cn = GetCN(&signal, va, 2);
-      if (cn != -999 && abs(cn) < maxCN)
+      hADCClusterSeed->Fill(f.seed_adc);
+      hClusterCharge->Fill(sqrt(f.signal / MIP_ADC));
+      hSeedCharge->Fill(sqrt(f.seed_adc / MIP_ADC));
+      hPercentageSeed->Fill(100 * f.seed_adc / f.signal);
+      hClusterSN->Fill(f.sn);
+      hSeedSN->Fill(f.seed_sn);
+
+      if (opt.verb)
       {
-        hCommonNoise2->Fill(cn);
+        std::cout << "Adding cluster with COG: " << f.cog << std::endl;
       }
-    }
 
-    bool goodCN = true;
-    if (cntype >= 0)
-    {
-      for (int va = 0; va < NVas; va++) // Loop on VA
+      hClusterCog->Fill(f.cog);
+      hBeamProfile->Fill(f.cog * opt.sensor_pitch);
+      hSeedPos->Fill(f.seed);
+      hNstrip->Fill(result.at(i).width);
+
+      if (result.at(i).width)
       {
-        float cn = GetCN(&signal, va, cntype);
-        if (verb)
-        {
-          std::cout << "VA " << va << " CN " << cn << std::endl;
-        }
-        if (cn != -999 && abs(cn) < maxCN)
+        hEta->Fill(f.eta);
+        if (result.at(i).over == 1)
         {
-          hCommonNoiseVsVA->Fill(cn, va);
-          goodCN = true;
-
-          for (int ch = va * 64; ch < (va + 1) * 64; ch++) // Loop on VA channels, subtracting common mode noise to the signals before clustering
-          {
-            signal.at(ch) = signal.at(ch) - cn;
-          }
+          hEta1->Fill(f.eta);
         }
         else
         {
-          for (int ch = va * 64; ch < (va + 1) * 64; ch++)
-          {
-            signal.at(ch) = 0; // Invalid Common Noise Value, artificially setting VA channel to 0 signal
-            goodCN = false;
-          }
+          hEta2->Fill(f.eta);
         }
+        hADCvsEta->Fill(f.eta, f.signal);
+      }
+
+      hADCvsWidth->Fill(result.at(i).width, f.signal);
+      hADCvsPos->Fill(f.cog, f.signal);
+      hADCvsSeed->Fill(f.seed_adc, f.signal);
+      hADCvsSN->Fill(f.sn, f.signal);
+      hNStripvsSN->Fill(f.sn, result.at(i).width);
+      hNstripSeed->Fill(result.at(i).over);
+
+      if (result.at(i).width == 2)
+      {
+        hDifference->Fill((result.at(i).ADC.at(0) - result.at(i).ADC.at(1)) / (result.at(i).ADC.at(0) + result.at(i).ADC.at(1)));
+        hADC0vsADC1->Fill(result.at(i).ADC.at(0), result.at(i).ADC.at(1));
       }
     }
+  }
+  INSTRUMENT_STAGE(lap, "histograms");
+}
 
-    try
-    {
-      if (!goodCN)
-        continue;
+void detector_clusterizer::finish()
+{
+  INSTRUMENT_SCOPE("write");
+  dir->cd();
+
+  if (report_fixed)
+  {
+    print_fixed_report(report, board, side);
+  }
+
+  if (overflow_events)
+  {
+    std::cout << "Board " << board << " side " << side << ": " << overflow_events << " events skipped for too many seeds" << std::endl;
+  }
+
+  if (opt.verb)
+  {
+    std::cout << "Maximum ADC value found is " << maxADC
+              << " in event number " << maxEVT
+              << " at strip " << maxPOS << std::endl;
+  }
+
+  // if(AMS)
+  // {
+  //   hNclus->SetName("Nclus_AMSL0");
+  //   hADCCluster->SetName("ADCCluster_AMSL0");
+  //   hADCClusterEdge->SetName("ADCClusterEdge_AMSL0");
+  //   hADCCluster1Strip->SetName("ADCCluster1Strip_AMSL0");
+  //   hADCCluster2Strip->SetName("ADCCluster2Strip_AMSL0");
+  //   hADCClusterManyStrip->SetName("ADCClusterManyStrip_AMSL0");
+  //   hADCClusterSeed->SetName("ADCClusterSeed_AMSL0");
+  //   hClusterCharge->SetName("ClusterCharge_AMSL0");
+  //   hSeedCharge->SetName("SeedCharge_AMSL0");
+  //   hPercentageSeed->SetName("PercentageSeed_AMSL0");
+  //   hClusterSN->SetName("ClusterSN_AMSL0");
+  //   hSeedSN->SetName("SeedSN_AMSL0");
+  //   hClusterCog->SetName("ClusterCog_AMSL0");
+  //   hBeamProfile->SetName("BeamProfile_AMSL0");
+  //   hSeedPos->SetName("SeedPos_AMSL0");
+  //   hNstrip->SetName("Nstrip_AMSL0");
+  //   hEta->SetName("Eta_AMSL0");
+  //   hEta1->SetName("Eta1_AMSL0");
+  //   hEta2->SetName("Eta2_AMSL0");
+  //   hADCvsEta->SetName("ADCvsEta_AMSL0");
+  //   hADCvsWidth->SetName("ADCvsWidth_AMSL0");
+  //   hADCvsPos->SetName("ADCvsPos_AMSL0");
+  //   hADCvsSeed->SetName("ADCvsSeed_AMSL0");
+  //   hADCvsSN->SetName("ADCvsSN_AMSL0");
+  //   hNStripvsSN->SetName("NStripvsSN_AMSL0");
+  //   hNstripSeed->SetName("NstripSeed_AMSL0");
+  //   hDifference->SetName("Difference_AMSL0");
+  //   hADC0vsADC1->SetName("ADC0vsADC1_AMSL0");
+  // }
+
+  hNclus->Write();
+  delete hNclus;
+
+  hStatus->Write();
+  delete hStatus;
+
+ // Double_t norm = hADCCluster->GetEntries();
+ // hADCCluster->Scale(1 / norm);
+  hADCCluster->Write();
+  delete hADCCluster;
+
+  hHighest->Write();
+  delete hHighest;
+
+ // norm = hADCClusterEdge->GetEntries();
+ // hADCClusterEdge->Scale(1 / norm);
+  hADCClusterEdge->Write();
+  delete hADCClusterEdge;
+
+ // norm = hADCCluster1Strip->GetEntries();
+ // hADCCluster1Strip->Scale(1 / norm);
+  hADCCluster1Strip->Write();
+  delete hADCCluster1Strip;
+
+  //norm = hADCCluster2Strip->GetEntries();
+ // hADCCluster2Strip->Scale(1 / norm);
+  hADCCluster2Strip->Write();
+  delete hADCCluster2Strip;
+
+  //norm = hADCClusterManyStrip->GetEntries();
+  //hADCClusterManyStrip->Scale(1 / norm);
+  hADCClusterManyStrip->Write();
+  delete hADCClusterManyStrip;
+
+  hEtaVsADC->Write();
+  delete hEtaVsADC;
+
+  hADCClusterSeed->Write();
+  hClusterCharge->Write();
+  hSeedCharge->Write();
+  hClusterSN->Write();
+  hSeedSN->Write();
+  hClusterCog->Write();
+  hBeamProfile->Write();
+  hSeedPos->Write();
+  hNstrip->Write();
+  hNstripSeed->Write();
+  hEta->Write();
+  hEta1->Write();
+  hEta2->Write();
+  hADCvsWidth->Write();
+  hADCvsPos->Write();
+  hADCvsSeed->Write();
+  hADCvsEta->Write();
+  hADCvsSN->Write();
+  hNStripvsSN->Write();
+  hDifference->Write();
+  hADC0vsADC1->Write();
+  hCommonNoise0->Write();
+  hCommonNoise1->Write();
+  hCommonNoise2->Write();
+  hCommonNoiseVsVA->Write();
+
+  delete hADCClusterSeed;
+  delete hClusterCharge;
+  delete hSeedCharge;
+  delete hClusterSN;
+  delete hSeedSN;
+  delete hClusterCog;
+  delete hBeamProfile;
+  delete hSeedPos;
+  delete hNstrip;
+  delete hNstripSeed;
+  delete hEta;
+  delete hEta1;
+  delete hEta2;
+  delete hADCvsWidth;
+  delete hADCvsPos;
+  delete hADCvsSeed;
+  delete hADCvsEta;
+  delete hADCvsSN;
+  delete hNStripvsSN;
+  delete hDifference;
+  delete hADC0vsADC1;
+  delete hCommonNoise0;
+  delete hCommonNoise1;
+  delete hCommonNoise2;
+  delete hCommonNoiseVsVA;
 
-      // if (!AMSLO)
-      // {
-      //   if (*max_element(signal.begin(), signal.end()) > 4096) // 4096 is the maximum ADC value possible, any more than that means the event is corrupted
-      //     continue;
-      // }
-      // else
-      // {
-      //   cout << "AMSLO is true" << endl;
-      //   sleep(10);
-      // }
-
-      if (*max_element(signal.begin(), signal.end()) > maxADC) // searching for the highest ADC value
+  nclus_event->SetTitle((TString) "nClus vs nEvent_board_" + board + "_side_" + side);
+  nclus_event->GetXaxis()->SetTitle("# event");
+  nclus_event->GetYaxis()->SetTitle("# clusters");
+  nclus_event->SetMarkerColor(kRed + 1);
+  nclus_event->SetLineColor(kRed + 1);
+  nclus_event->SetMarkerSize(0.5);
+  nclus_event->Draw("*lSAME");
+  nclus_event->Write();
+  delete nclus_event;
+  nclus_event = 0;
+  histos.clear();
+
+  t_clusters->Write();
+  delete t_clusters;
+}
+
+std::unique_ptr<detector_clusterizer> detector_clusterizer::worker() const
+{
+  std::unique_ptr<detector_clusterizer> w(new detector_clusterizer(board, side, opt));
+  w->fused = fused;
+  w->fixed = fixed;
+  w->report_fixed = report_fixed;
+  w->AMS = AMS;
+  w->BL_monster = BL_monster;
+  w->blocks = !fused && !fixed && !opt.verb; // standard kernel
+  w->cal = cal;
+  w->monster_cal = monster_cal;
+  w->fcal = fcal;
+  if (tracker)
+  {
+    w->tracker.reset(new pedestal_tracker(*tracker));
+  }
+  // filled by the worker thread only: booked in no directory, not in the current one (the last detector's)
+  bool add_directory = TH1::AddDirectoryStatus();
+  TH1::AddDirectory(kFALSE);
+  w->book();
+  TH1::AddDirectory(add_directory);
+  return w;
+}
+
+void detector_clusterizer::follow_pedestals(const detector_clusterizer &main)
+{
+  cal = main.cal;
+  monster_cal = main.monster_cal;
+  fcal = main.fcal;
+  *tracker = *main.tracker;
+}
+
+void detector_clusterizer::commit(const range_clusters &clusters)
+{
+  INSTRUMENT_SCOPE("tree fill");
+  int first = 0;
+  int first_strip = 0;
+  for (size_t i = 0; i < clusters.event.size(); i++)
+  {
+    columns.clear();
+    columns.add(clusters.columns, first, clusters.nclusters[i], first_strip, clusters.nstrips[i]);
+    columns.fill(t_clusters);
+    nclus_event->SetPoint(nclus_event->GetN(), clusters.event[i], columns.nclusters);
+    first += clusters.nclusters[i];
+    first_strip += clusters.nstrips[i];
+  }
+}
+
+void detector_clusterizer::merge(const detector_clusterizer &worker)
+{
+  INSTRUMENT_SCOPE("merge");
+  for (size_t i = 0; i < histos.size(); i++)
+  {
+    histos[i]->Add(worker.histos[i]);
+  }
+  overflow_events += worker.overflow_events;
+  if (worker.maxADC > maxADC || (worker.maxADC == maxADC && worker.maxEVT < maxEVT)) // first event with the highest ADC
+  {
+    maxADC = worker.maxADC;
+    maxEVT = worker.maxEVT;
+    maxPOS = worker.maxPOS;
+  }
+  merge_fixed(report, worker.report);
+}
+
+TChain *board_chain(int board, bool newDAQ, const std::vector<std::string> &input_files, bool print = true)
+// Join ROOTfiles in a single chain: the TTree of the first detector of the board with the second one as a friend
+{
+  TChain *chain = new TChain();  // TChain for the first detector TTree (we read 2 detectors with each board on the new DAQ and 1 with the miniTRB)
+  TChain *chain2 = new TChain(); // TChain for the second detector TTree
+
+  std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+  if (board == 0) // TTree name depends on DAQ board
+  {
+    chain->SetName("raw_events"); // simply called raw_events for retrocompatibility with old files from the prototype
+    for (int ii = 0; ii < input_files.size(); ii++)
+    {
+      if (print)
+      {
+        std::cout << "\nAdding file " << input_files[ii] << " to the chain..." << std::endl;
+      }
+      chain->Add(input_files[ii].c_str());
+    }
+    if (newDAQ)
+    {
+      chain2->SetName("raw_events_B");
+      for (int ii = 0; ii < input_files.size(); ii++)
+      {
+        chain2->Add(input_files[ii].c_str());
+      }
+      chain->AddFriend(chain2);
+    }
+  }
+  else
+  {
+    chain->SetName((TString) "raw_events_" + alphabet.at(2 * board));
+    for (int ii = 0; ii < input_files.size(); ii++)
+    {
+      if (print)
       {
-        maxADC = *max_element(signal.begin(), signal.end());
-        maxEVT = index_event;
-        std::vector<float>::iterator it = std::find(signal.begin(), signal.end(), maxADC);
-        maxPOS = std::distance(signal.begin(), it);
+        std::cout << "\nAdding file " << input_files[ii] << " to the chain..." << std::endl;
       }
+      chain->Add(input_files[ii].c_str());
+    }
+    chain2->SetName((TString) "raw_events_" + alphabet.at(2 * board + 1));
+    for (int ii = 0; ii < input_files.size(); ii++)
+    {
+      chain2->Add(input_files[ii].c_str());
+    }
+    chain->AddFriend(chain2);
+  }
+  return chain;
+}
 
-      if (verb)
-        std::cout << "Highest strip: " << *max_element(signal.begin(), signal.end()) << std::endl;
+// J5/J7 beam profile of a board, filled with the clusters of both sides of each event while they are
+// in memory. Every J5 cluster is paired with every J7 cluster, or with charge matching the two sides of
+// a particle crossing give about the same signal: the pairs with the closest signals are taken first,
+// each cluster at most once, up to max_asymmetry = |S5 - S7| / (S5 + S7)
+struct cog_correlation
+{
+  TH2F *h2D_Cog = 0;
+  bool charge_matching = false;
+  float max_asymmetry = 0.2;
 
-      hHighest->Fill(*max_element(signal.begin(), signal.end()));
+  void fill(const cluster_columns &j5, int first5, int n5, const cluster_columns &j7, int first7, int n7);
 
-      // if it's BL_monster we keep only channels 320-383, 448-639, deleting the others from the vector
-      if (BL_monster)
+private:
+  struct candidate
+  {
+    float asymmetry;
+    int j5, j7;
+  };
+  std::vector<candidate> candidates; // memory reused for all the events
+  std::vector<char> used5, used7;
+};
+
+void cog_correlation::fill(const cluster_columns &j5, int first5, int n5, const cluster_columns &j7, int first7, int n7)
+{
+  if (!charge_matching)
+  {
+    for (int j = first5; j < first5 + n5; j++)
+    {
+      for (int k = first7; k < first7 + n7; k++)
       {
-        signal.erase(signal.begin(), signal.begin() + 320);
-        signal.erase(signal.begin() + 64, signal.begin() + 128);
-        signal.erase(signal.begin() + 256, signal.end());
+        h2D_Cog->Fill(j5.cog[j], j7.cog[k]);
       }
+    }
+    return;
+  }
 
-      result = clusterize_event(&cal, &signal, highthreshold, lowthreshold, // clustering function
-                                symmetric, symmetricwidth, absolute, board, side, verb);
+  candidates.clear();
+  for (int j = first5; j < first5 + n5; j++)
+  {
+    for (int k = first7; k < first7 + n7; k++)
+    {
+      float total = j5.signal[j] + j7.signal[k];
+      if (total <= 0)
+      {
+        continue;
+      }
+      float asymmetry = std::abs(j5.signal[j] - j7.signal[k]) / total;
+      if (asymmetry <= max_asymmetry)
+      {
+        candidates.push_back({asymmetry, j - first5, k - first7});
+      }
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(), [](const candidate &a, const candidate &b)
+            { return a.asymmetry != b.asymmetry ? a.asymmetry < b.asymmetry : (a.j5 != b.j5 ? a.j5 < b.j5 : a.j7 < b.j7); });
 
-      // save result cluster in TTree
-      t_clusters->Fill();
+  used5.assign(n5, 0);
+  used7.assign(n7, 0);
+  for (const candidate &c : candidates)
+  {
+    if (!used5[c.j5] && !used7[c.j7])
+    {
+      used5[c.j5] = used7[c.j7] = 1;
+      h2D_Cog->Fill(j5.cog[first5 + c.j5], j7.cog[first7 + c.j7]);
+    }
+  }
+}
 
-      nclus_event->SetPoint(nclus_event->GetN(), index_event, result.size());
-      hNclus->Fill(result.size());
+// Detectors of a DAQ board: J5 (side 0) and J7 (side 1) are branches of the same chain entry
+struct board_input
+{
+  int board;
+  TChain *chain;
+  int entries;
+  std::vector<std::unique_ptr<detector_clusterizer>> sides;
+  cog_correlation correlation; // h2D_Cog set when the board has both sides
+};
+
+// Serial loop: both sides clustered the event just read
+void correlate_event(board_input &input, int index_event)
+{
+  INSTRUMENT_SCOPE("correlation");
+  if (!input.correlation.h2D_Cog || input.sides[0]->clustered_event != index_event || input.sides[1]->clustered_event != index_event)
+  {
+    return;
+  }
+  const cluster_columns &j5 = input.sides[0]->event_clusters();
+  const cluster_columns &j7 = input.sides[1]->event_clusters();
+  input.correlation.fill(j5, 0, j5.nclusters, j7, 0, j7.nclusters);
+}
 
-      for (int i = 0; i < result.size(); i++)
+// Parallel loop: the two sides of a range, paired event by event before main saves them
+void correlate_range(board_input &input, const range_clusters &j5, const range_clusters &j7)
+{
+  INSTRUMENT_SCOPE("correlation");
+  size_t i5 = 0;
+  size_t i7 = 0;
+  int first5 = 0;
+  int first7 = 0;
+  while (i5 < j5.event.size() && i7 < j7.event.size())
+  {
+    if (j5.event[i5] < j7.event[i7]) // event skipped by J7
+    {
+      first5 += j5.nclusters[i5++];
+    }
+    else if (j7.event[i7] < j5.event[i5])
+    {
+      first7 += j7.nclusters[i7++];
+    }
+    else
+    {
+      input.correlation.fill(j5.columns, first5, j5.nclusters[i5], j7.columns, first7, j7.nclusters[i7]);
+      first5 += j5.nclusters[i5++];
+      first7 += j7.nclusters[i7++];
+    }
+  }
+}
+
+void print_progress(int index_event, int entries, int &perc)
+{
+  Double_t pperc = 10.0 * ((index_event + 1.0) / entries); // print every 10% of processed events
+  if (pperc >= perc)
+  {
+    std::cout << "Processed " << (index_event + 1) << " out of " << entries
+              << ":" << (int)(100.0 * (index_event + 1.0) / entries) << "%"
+              << std::endl;
+    perc++;
+  }
+}
+
+struct range_schedule // shared by main and the workers of the parallel loop
+{
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<char> ready; // ranges processed by their worker
+  int committed = 0;       // ranges saved by main
+  int pedestals = 0;       // ranges followed by the dynamic pedestals
+  bool failed = false;     // a worker threw
+};
+
+void clusterize_parallel(std::vector<board_input> &boards, int first_event, int entries, int nthreads, int range_events,
+                         bool newDAQ, bool dynped, const std::vector<std::string> &input_files)
+// The entries are split in ranges of range_events (0: about 8 ranges per thread, from 1000 to 50000 events). Thread t clusterizes ranges t, t + nthreads, ... with
+// its own chains and copies of the detectors; main saves the buffered clusters of each range in event
+// order and sums the histograms of the threads in thread order at the end, so the output does not depend
+// on the scheduling. With --dynped each thread reads its range once into memory (ranges of at most about
+// 64 MB of raw events when range_events is 0). The main detectors track the pedestals range after range:
+// the thread whose turn it is copies their trackers as they are at the start of its range and advances
+// them over the events in memory, then tracks its copies along the clustering exactly as the serial loop
+// does. Only this tracking goes one range at a time
+{
+  size_t ndetectors = 0;
+  size_t channels = 0; // of all the detectors
+  for (board_input &input : boards)
+  {
+    ndetectors += input.sides.size();
+    for (auto &detector : input.sides)
+    {
+      channels += detector->channels();
+    }
+  }
+
+  if (range_events <= 0)
+  {
+    range_events = std::max(1000, std::min(50000, (entries - first_event) / (8 * std::max(1, nthreads))));
+    if (dynped)
+    {
+      range_events = std::max(100, std::min(range_events, (int)((64 << 20) / (sizeof(unsigned int) * std::max<size_t>(1, channels)))));
+    }
+  }
+  std::vector<int> range_first; // first event of each range, then the end
+  for (int e = first_event; e < entries; e = (e / range_events + 1) * range_events)
+  {
+    range_first.push_back(e);
+  }
+  range_first.push_back(entries);
+  int nranges = range_first.size() - 1;
+  nthreads = std::max(1, std::min(nthreads, nranges));
+  int window = 2 * nthreads; // ranges in flight: bounds the buffered clusters
+
+  std::vector<std::vector<board_input>> workers(nthreads); // chains and detectors of each thread
+  for (int t = 0; t < nthreads; t++)
+  {
+    for (board_input &input : boards)
+    {
+      board_input copy;
+      copy.board = input.board;
+      copy.chain = board_chain(input.board, newDAQ, input_files, false);
+      copy.entries = input.entries;
+      for (auto &detector : input.sides)
       {
+        copy.sides.push_back(detector->worker());
+        copy.chain->SetBranchAddress(detector->side == 0 ? "RAW Event J5" : "RAW Event J7", &copy.sides.back()->raw_event, &copy.sides.back()->RAW);
+      }
+      workers[t].push_back(std::move(copy));
+    }
+  }
+
+  std::vector<range_clusters> outputs(nranges * ndetectors);
+  range_schedule schedule;
+  schedule.ready.assign(nranges, 0);
 
-        if (verb)
+  auto work = [&](int t)
+  {
+    std::vector<board_input> &mine = workers[t];
+    std::vector<std::vector<std::vector<unsigned int>>> range_raw(ndetectors); // --dynped: raw events of the range, by detector
+    try
+    {
+      for (int r = t; r < nranges; r += nthreads)
+      {
         {
-          PrintCluster(result.at(i));
+          std::unique_lock<std::mutex> lock(schedule.mutex);
+          schedule.cond.wait(lock, [&]
+                             { return schedule.failed || r < schedule.committed + window; });
+          if (schedule.failed)
+          {
+            return;
+          }
         }
 
-        // if (!GoodCluster(result.at(i), &cal))
-        //   continue;
-
-        if (result.at(i).address >= minStrip && (result.at(i).address + result.at(i).width - 1) < maxStrip) // cut on position on the detector in terms of strip number
+        const int first = range_first[r];
+        const int end = range_first[r + 1];
+        if (dynped) // the range is read once, in parallel with the other threads, and kept in memory
         {
-
-          hADCCluster->Fill(GetClusterSignal(result.at(i)));
-
-          if (GetClusterSeed(result.at(i), &cal) % 64 == 0)
+          for (auto &raw : range_raw)
+          {
+            raw.resize(end - first);
+          }
+          for (int index_event = first; index_event < end; index_event++)
           {
-            hADCClusterEdge->Fill(GetClusterSignal(result.at(i)));
+            size_t k = 0;
+            for (board_input &input : mine)
+            {
+              if (index_event < input.entries)
+              {
+                INSTRUMENT_LAP(lap);
+                input.chain->GetEntry(index_event);
+                INSTRUMENT_STAGE(lap, "read");
+                for (auto &detector : input.sides)
+                {
+                  range_raw[k++][index_event - first].swap(*detector->raw_event);
+                }
+              }
+              else
+              {
+                k += input.sides.size();
+              }
+            }
           }
 
-          if (result.at(i).width == 1)
           {
-            hADCCluster1Strip->Fill(GetClusterSignal(result.at(i)));
-            hEtaVsADC->Fill(GetClusterEta(result.at(i)), GetClusterSignal(result.at(i)));
+            std::unique_lock<std::mutex> lock(schedule.mutex);
+            schedule.cond.wait(lock, [&]
+                               { return schedule.failed || schedule.pedestals == r; });
+            if (schedule.failed)
+            {
+              return;
+            }
           }
-          else if (result.at(i).width == 2)
+          // our turn: pedestals at the start of the range, then the main detectors track it from memory
+          size_t k = 0;
+          for (size_t b = 0; b < boards.size(); b++)
           {
-            hADCCluster2Strip->Fill(GetClusterSignal(result.at(i)));
-            hEtaVsADC->Fill(GetClusterEta(result.at(i)), GetClusterSignal(result.at(i)));
+            for (size_t s = 0; s < boards[b].sides.size(); s++, k++)
+            {
+              detector_clusterizer &main_detector = *boards[b].sides[s];
+              mine[b].sides[s]->follow_pedestals(main_detector);
+              for (int index_event = first; index_event < std::min(end, boards[b].entries); index_event++)
+              {
+                main_detector.track_pedestals(index_event, range_raw[k][index_event - first]);
+              }
+            }
           }
-          else
           {
-            hADCClusterManyStrip->Fill(GetClusterSignal(result.at(i)));
-            hEtaVsADC->Fill(GetClusterEta(result.at(i)), GetClusterSignal(result.at(i)));
+            std::lock_guard<std::mutex> lock(schedule.mutex);
+            schedule.pedestals++;
           }
+          schedule.cond.notify_all();
+        }
 
-          hADCClusterSeed->Fill(GetClusterSeedADC(result.at(i), &cal));
-          hClusterCharge->Fill(GetClusterMIPCharge(result.at(i)));
-          hSeedCharge->Fill(GetSeedMIPCharge(result.at(i), &cal));
-          hPercentageSeed->Fill(100 * GetClusterSeedADC(result.at(i), &cal) / GetClusterSignal(result.at(i)));
-          hClusterSN->Fill(GetClusterSN(result.at(i), &cal));
-          hSeedSN->Fill(GetSeedSN(result.at(i), &cal));
-
-          if (verb)
+        size_t k = 0;
+        for (board_input &input : mine)
+        {
+          for (auto &detector : input.sides)
           {
-            std::cout << "Adding cluster with COG: " << GetClusterCOG(result.at(i)) << std::endl;
+            detector->out = &outputs[r * ndetectors + k++];
           }
-
-          hClusterCog->Fill(GetClusterCOG(result.at(i)));
-          hBeamProfile->Fill(GetPosition(result.at(i), sensor_pitch));
-          hSeedPos->Fill(GetClusterSeed(result.at(i), &cal));
-          hNstrip->Fill(GetClusterWidth(result.at(i)));
-
-          if (result.at(i).width)
+        }
+        for (int index_event = first; index_event < end; index_event++)
+        {
+          k = 0;
+          for (board_input &input : mine)
           {
-            hEta->Fill(GetClusterEta(result.at(i)));
-            if (result.at(i).over == 1)
+            if (index_event >= input.entries)
             {
-              hEta1->Fill(GetClusterEta(result.at(i)));
+              k += input.sides.size();
+              continue;
             }
-            else
+            if (!dynped)
             {
-              hEta2->Fill(GetClusterEta(result.at(i)));
+              INSTRUMENT_LAP(lap);
+              input.chain->GetEntry(index_event);
+              INSTRUMENT_STAGE(lap, "read");
+            }
+            for (auto &detector : input.sides)
+            {
+              if (dynped)
+              {
+                detector->raw_event->swap(range_raw[k][index_event - first]);
+                detector->track_pedestals(index_event, *detector->raw_event);
+              }
+              k++;
+              detector->process(index_event);
             }
-            hADCvsEta->Fill(GetClusterEta(result.at(i)), GetClusterSignal(result.at(i)));
           }
-
-          hADCvsWidth->Fill(GetClusterWidth(result.at(i)), GetClusterSignal(result.at(i)));
-          hADCvsPos->Fill(GetClusterCOG(result.at(i)), GetClusterSignal(result.at(i)));
-          hADCvsSeed->Fill(GetClusterSeedADC(result.at(i), &cal), GetClusterSignal(result.at(i)));
-          hADCvsSN->Fill(GetClusterSN(result.at(i), &cal), GetClusterSignal(result.at(i)));
-          hNStripvsSN->Fill(GetClusterSN(result.at(i), &cal), GetClusterWidth(result.at(i)));
-          hNstripSeed->Fill(result.at(i).over);
-
-          if (result.at(i).width == 2)
+        }
+        for (board_input &input : mine)
+        {
+          for (auto &detector : input.sides)
           {
-            hDifference->Fill((result.at(i).ADC.at(0) - result.at(i).ADC.at(1)) / (result.at(i).ADC.at(0) + result.at(i).ADC.at(1)));
-            hADC0vsADC1->Fill(result.at(i).ADC.at(0), result.at(i).ADC.at(1));
+            detector->flush(); // last block of the range
           }
         }
+
+        {
+          std::lock_guard<std::mutex> lock(schedule.mutex);
+          schedule.ready[r] = 1;
+        }
+        schedule.cond.notify_all();
       }
     }
-    catch (const char *msg)
+    catch (...)
     {
-      if (verb)
       {
-        std::cerr << msg << "Skipping event " << index_event << std::endl;
+        std::lock_guard<std::mutex> lock(schedule.mutex);
+        schedule.failed = true;
       }
-      hNclus->Fill(0);
-      continue;
+      schedule.cond.notify_all();
+      throw;
     }
-  }
+  };
 
-  if (verb)
+  std::cout << "Clusterizing with " << nthreads << " thread(s)" << std::endl;
+  thread_pool pool(nthreads);
+  std::vector<std::future<void>> done;
+  for (int t = 0; t < nthreads; t++)
   {
-    std::cout << "Maximum ADC value found is " << maxADC
-              << " in event number " << maxEVT
-              << " at strip " << maxPOS << std::endl;
+    done.push_back(pool.submit([&, t]
+                               { work(t); }));
   }
 
-  // if(AMS)
-  // {
-  //   hNclus->SetName("Nclus_AMSL0");
-  //   hADCCluster->SetName("ADCCluster_AMSL0");
-  //   hADCClusterEdge->SetName("ADCClusterEdge_AMSL0");
-  //   hADCCluster1Strip->SetName("ADCCluster1Strip_AMSL0");
-  //   hADCCluster2Strip->SetName("ADCCluster2Strip_AMSL0");
-  //   hADCClusterManyStrip->SetName("ADCClusterManyStrip_AMSL0");
-  //   hADCClusterSeed->SetName("ADCClusterSeed_AMSL0");
-  //   hClusterCharge->SetName("ClusterCharge_AMSL0");
-  //   hSeedCharge->SetName("SeedCharge_AMSL0");
-  //   hPercentageSeed->SetName("PercentageSeed_AMSL0");
-  //   hClusterSN->SetName("ClusterSN_AMSL0");
-  //   hSeedSN->SetName("SeedSN_AMSL0");
-  //   hClusterCog->SetName("ClusterCog_AMSL0");
-  //   hBeamProfile->SetName("BeamProfile_AMSL0");
-  //   hSeedPos->SetName("SeedPos_AMSL0");
-  //   hNstrip->SetName("Nstrip_AMSL0");
-  //   hEta->SetName("Eta_AMSL0");
-  //   hEta1->SetName("Eta1_AMSL0");
-  //   hEta2->SetName("Eta2_AMSL0");
-  //   hADCvsEta->SetName("ADCvsEta_AMSL0");
-  //   hADCvsWidth->SetName("ADCvsWidth_AMSL0");
-  //   hADCvsPos->SetName("ADCvsPos_AMSL0");
-  //   hADCvsSeed->SetName("ADCvsSeed_AMSL0");
-  //   hADCvsSN->SetName("ADCvsSN_AMSL0");
-  //   hNStripvsSN->SetName("NStripvsSN_AMSL0");
-  //   hNstripSeed->SetName("NstripSeed_AMSL0");
-  //   hDifference->SetName("Difference_AMSL0");
-  //   hADC0vsADC1->SetName("ADC0vsADC1_AMSL0");
-  // }
-
-  hNclus->Write();
-  delete hNclus;
-
- // Double_t norm = hADCCluster->GetEntries();
- // hADCCluster->Scale(1 / norm);
-  hADCCluster->Write();
-  delete hADCCluster;
-
-  hHighest->Write();
-  delete hHighest;
-
- // norm = hADCClusterEdge->GetEntries();
- // hADCClusterEdge->Scale(1 / norm);
-  hADCClusterEdge->Write();
-  delete hADCClusterEdge;
-
- // norm = hADCCluster1Strip->GetEntries();
- // hADCCluster1Strip->Scale(1 / norm);
-  hADCCluster1Strip->Write();
-  delete hADCCluster1Strip;
-
-  //norm = hADCCluster2Strip->GetEntries();
- // hADCCluster2Strip->Scale(1 / norm);
-  hADCCluster2Strip->Write();
-  delete hADCCluster2Strip;
-
-  //norm = hADCClusterManyStrip->GetEntries();
-  //hADCClusterManyStrip->Scale(1 / norm);
-  hADCClusterManyStrip->Write();
-  delete hADCClusterManyStrip;
-
-  hEtaVsADC->Write();
-  delete hEtaVsADC;
-
-  hADCClusterSeed->Write();
-  hClusterCharge->Write();
-  hSeedCharge->Write();
-  hClusterSN->Write();
-  hSeedSN->Write();
-  hClusterCog->Write();
-  hBeamProfile->Write();
-  hSeedPos->Write();
-  hNstrip->Write();
-  hNstripSeed->Write();
-  hEta->Write();
-  hEta1->Write();
-  hEta2->Write();
-  hADCvsWidth->Write();
-  hADCvsPos->Write();
-  hADCvsSeed->Write();
-  hADCvsEta->Write();
-  hADCvsSN->Write();
-  hNStripvsSN->Write();
-  hDifference->Write();
-  hADC0vsADC1->Write();
-  hCommonNoise0->Write();
-  hCommonNoise1->Write();
-  hCommonNoise2->Write();
-  hCommonNoiseVsVA->Write();
+  int perc = 0; // percentage of processed events
+  for (int r = 0; r < nranges; r++)
+  {
+    {
+      std::unique_lock<std::mutex> lock(schedule.mutex);
+      schedule.cond.wait(lock, [&]
+                         { return schedule.failed || schedule.ready[r]; });
+      if (schedule.failed)
+      {
+        break;
+      }
+    }
 
-  delete hADCClusterSeed;
-  delete hClusterCharge;
-  delete hSeedCharge;
-  delete hClusterSN;
-  delete hSeedSN;
-  delete hClusterCog;
-  delete hBeamProfile;
-  delete hSeedPos;
-  delete hNstrip;
-  delete hNstripSeed;
-  delete hEta;
-  delete hEta1;
-  delete hEta2;
-  delete hADCvsWidth;
-  delete hADCvsPos;
-  delete hADCvsSeed;
-  delete hADCvsEta;
-  delete hADCvsSN;
-  delete hNStripvsSN;
-  delete hDifference;
-  delete hADC0vsADC1;
-  delete hCommonNoise0;
-  delete hCommonNoise1;
-  delete hCommonNoise2;
-  delete hCommonNoiseVsVA;
+    size_t k = 0;
+    for (board_input &input : boards)
+    {
+      if (input.correlation.h2D_Cog)
+      {
+        correlate_range(input, outputs[r * ndetectors + k], outputs[r * ndetectors + k + 1]);
+      }
+      for (auto &detector : input.sides)
+      {
+        range_clusters &clusters = outputs[r * ndetectors + k++];
+        detector->commit(clusters);
+        clusters = range_clusters(); // memory back before the next ranges
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(schedule.mutex);
+      schedule.committed++;
+    }
+    schedule.cond.notify_all();
 
-  nclus_event->SetTitle((TString) "nClus vs nEvent_board_" + board + "_side_" + side);
-  nclus_event->GetXaxis()->SetTitle("# event");
-  nclus_event->GetYaxis()->SetTitle("# clusters");
-  nclus_event->SetMarkerColor(kRed + 1);
-  nclus_event->SetLineColor(kRed + 1);
-  nclus_event->SetMarkerSize(0.5);
-  nclus_event->Draw("*lSAME");
-  nclus_event->Write();
-  delete nclus_event;
+    for (int index_event = range_first[r]; index_event < range_first[r + 1]; index_event++)
+    {
+      print_progress(index_event, entries, perc);
+    }
+    INSTRUMENT_EVENTS(range_first[r + 1] - range_first[r]);
+  }
 
-  t_clusters->Write();
-  delete t_clusters;
+  for (auto &d : done)
+  {
+    d.get(); // exception of a failed worker
+  }
 
-  return 0;
+  for (int t = 0; t < nthreads; t++)
+  {
+    for (size_t b = 0; b < boards.size(); b++)
+    {
+      for (size_t s = 0; s < boards[b].sides.size(); s++)
+      {
+        boards[b].sides[s]->merge(*workers[t][b].sides[s]);
+      }
+    }
+  }
 }
 
 int main(int argc, char *argv[])
 {
-  // generating shared library for cluster saving
   std::cout << "\n==========================================================================================================" << std::endl;
   std::cout << "========================================  Raw Clusterizer  ===============================================" << std::endl;
   std::cout << "==========================================================================================================" << std::endl;
 
-  TString command;
-  // check if types_C.so library is present
-  if (access("./src/types_C.so", F_OK) == -1)
-  {
-    std::cout << "types_C.so library not found, compiling it ..." << std::endl;
-    command = TString(".L ") + gSystem->pwd() + TString("/src/types.C+");
-  }
-  else
-  {
-    std::cout << "types_C.so library found, loading it ..." << std::endl;
-    command = TString(".L ") + gSystem->pwd() + TString("/src/types_C.so");
-  }
-
-  gROOT->ProcessLine(command);
-
+  INSTRUMENT_PROGRAM("raw_clusterize");
   gErrorIgnoreLevel = kWarning;
   bool symmetric = false;
   bool absolute = false;
   bool verb = false;
   bool invert = false;
   bool dynped = false;
+  bool dynsigma = false;
+  bool fused = false;
+  bool fixed = false;
+  bool fixed_report = false;
+  bool charge_matching = false;
+  int nthreads = 1;
+  int range_events = 0;
 
   float highthreshold = 3.5;
   float lowthreshold = 1.0;
   int symmetricwidth = 0;
   int cntype = 0;
   int maxCN = 999;
+  int dynped_period = 100;
+  int dynped_window = 5000;
   int first_event = 0;
   int nevents = -1;
   int version = 0;
@@ -794,6 +1808,7 @@ int main(int argc, char *argv[])
   int minADC_h = 0;
   int maxADC_h = 500;
   float sensor_pitch = 0.150;
+  float max_charge_asymmetry = 0.2;
 
   bool newDAQ = false;
   
@@ -811,7 +1826,12 @@ int main(int argc, char *argv[])
   app.add_flag("-a,--absolute", absolute, "Use absolute ADC value instead of S/N");
   app.add_flag("--invert", invert, "Invert signal");
   app.add_flag("--dynped", dynped, "Enable dynamic pedestals");
+  app.add_flag("--dynsigma", dynsigma, "Dynamic pedestals: track sigmas and strip status too");
+  app.add_flag("--fused", fused, "Pedestals, common noise and clustering in a single pass per event (same output)");
+  app.add_flag("--fixed", fixed, "Fixed point (int16, 1/8 ADC) pedestals, common noise and clustering");
+  app.add_flag("--fixed_report", fixed_report, "Run the float and the fixed point pipelines on every event, report speed and accuracy");
   app.add_flag("--newDAQ", newDAQ, "Use new DAQ format");
+  app.add_flag("--charge_matching", charge_matching, "Pair J5 and J7 clusters of the 2D beam profile by signal instead of all pairs");
 
   // Options
   app.add_option("--highthreshold", highthreshold, "High threshold for clustering");
@@ -824,6 +1844,7 @@ int main(int argc, char *argv[])
   app.add_option("--minStrip", minStrip, "Minimum strip index");
   app.add_option("--maxStrip", maxStrip, "Maximum strip index");
   app.add_option("--sensor_pitch", sensor_pitch, "Sensor pitch in mm");
+  app.add_option("--max_charge_asymmetry", max_charge_asymmetry, "Max |S5 - S7| / (S5 + S7) of the pairs with --charge_matching");
   app.add_option("--side", side, "Side of the detector");
   app.add_option("--board", board, "Board number");
   app.add_option("--version", version, "DAQ board version")->required();
@@ -831,84 +1852,32 @@ int main(int argc, char *argv[])
   app.add_option("--output_file", output_file, "Output file name");
   app.add_option("--nevents", nevents, "Number of events to process");
   app.add_option("--first_event", first_event, "First event to process");
+  app.add_option("--dynped_period", dynped_period, "Dynamic pedestals: events between calibration updates")->check(CLI::PositiveNumber);
+  app.add_option("--dynped_window", dynped_window, "Dynamic pedestals: events remembered by the tracker")->check(CLI::PositiveNumber);
+  app.add_option("-j,--threads", nthreads, "Number of threads for the event loop (0: all cores). With --dynped each thread keeps "
+                                          "its range of raw events in memory and the pedestals are tracked one range at a time");
+  app.add_option("--range_events", range_events, "Parallel event loop: events per range (0: from the number of events and threads, and the memory with --dynped)")->check(CLI::NonNegativeNumber);
   app.add_option("--input_files", input_files, "Input ROOT files")->required()->expected(-1);
 
   CLI11_PARSE(app, argc, argv);
 
 
-  if (version == 1212) // original DaMPE miniTRB system
-  {
-    NChannels = 384;
-    NVas = 6;
-    minStrip = 0;
-    maxStrip = 383;
-    sensor_pitch = 0.242;
-  }
-  else if (version == 1313) // modded DaMPE miniTRB system for the first FOOT prototype
+  const detector_profile *profile = find_detector_profile(version);
+  if (!profile)
   {
-    NChannels = 640;
-    NVas = 10;
-    minStrip = 0;
-    maxStrip = 639;
-    sensor_pitch = 0.150;
+    std::cout << "ERROR: invalid DAQ board version" << std::endl;
+    return 2;
   }
-  else if (version == 2020) // FOOT ADC boards + DE10Nano
+  NChannels = profile->NChannels;
+  NVas = profile->NVas;
+  minStrip = profile->minStrip;
+  maxStrip = profile->maxStrip;
+  sensor_pitch = profile->sensor_pitch;
+  maxADC_h = profile->maxADC_h;
+  if (profile->newDAQ)
   {
-    NChannels = 640;
-    NVas = 10;
-    minStrip = 0;
-    maxStrip = 639;
-    sensor_pitch = 0.150;
     newDAQ = true;
   }
-  else if (version == 2021) // PAN StripX
-  {
-    NChannels = 2048;
-    NVas = 32;
-    minStrip = 0;
-    maxStrip = 2047;
-    sensor_pitch = 0.050;
-  }
-  else if (version == 2022) // PAN StripY
-  {
-    NChannels = 128;
-    NVas = 1;
-    minStrip = 0;
-    maxStrip = 127;
-    sensor_pitch = 0.400;
-  }
-  else if (version == 2023) // AMSL0
-  {
-    NChannels = 1024;
-    NVas = 16;
-    minStrip = 0;
-    maxStrip = 1023;
-    sensor_pitch = 0.109;
-    maxADC_h = 2000;
-  }
-  else if (version == 2024) // AMSL0 BL Monster
-  {
-    NChannels = 1024;
-    NVas = 16;
-    minStrip = 0;
-    maxStrip = 1023;
-    sensor_pitch = 0.109;
-    maxADC_h = 200;
-  }
-  else if (version == 2025) // ASTRA
-  {
-    NChannels = 64;
-    NVas = 1;
-    minStrip = 0;
-    maxStrip = 63;
-    sensor_pitch = 0.150;
-    maxADC_h = 200;
-  }
-  else
-  {
-    std::cout << "ERROR: invalid DAQ board version" << std::endl;
-    return 2;
-  }
 
   // Create output ROOTfile
   TString output_filename;
@@ -965,69 +1934,142 @@ int main(int argc, char *argv[])
   TDirectory *doutput;
   std::cout << "Creating output directory" << std::endl;
 
-  if (detectors == 1)
+  clusterize_options opt = {minADC_h, maxADC_h, minStrip, maxStrip, NChannels, NVas, verb, dynped, invert,
+                            dynped_period, dynped_window, dynsigma,
+                            (float)maxCN, cntype, highthreshold, lowthreshold, absolute, symmetric, symmetricwidth,
+                            sensor_pitch, version, fused, fixed, fixed_report};
+
+  // One chain per board, read once for both its detectors
+  int nboards = detectors == 1 ? 1 : detectors / 2;
+  int nsides = detectors == 1 ? 1 : 2;
+  std::vector<board_input> boards;
+  int entries = 0; // longest chain
+  for (int i = 0; i < nboards; i++)
+  {
+    board_input input;
+    input.board = i;
+    input.chain = board_chain(i, newDAQ, input_files);
+    input.entries = input.chain->GetEntries();
+
+    if (nevents) // to process only the first "nevents" events in the chain
+    {
+      unsigned int temp_entries = nevents;
+      if (temp_entries < input.entries)
+      {
+        input.entries = temp_entries;
+      }
+    }
+
+    if (input.entries == 0)
+    {
+      std::cout << "Error: no file or empty file" << std::endl;
+      continue;
+    }
+    std::cout << "\nThis run has " << input.entries << " entries" << std::endl;
+
+    if (first_event > input.entries)
+    {
+      std::cout << "Error: first event is greater than the number of entries" << std::endl;
+      continue;
+    }
+
+    for (int s = 0; s < nsides; s++)
+    {
+      if (detectors == 1)
+      {
+        doutput = foutput->mkdir("histos");
+      }
+      else
+      {
+        std::cout << "Creating output directory " << i << std::endl;
+        doutput = foutput->mkdir((TString) "board_" + i + "_side_" + s);
+      }
+
+      std::unique_ptr<detector_clusterizer> detector(new detector_clusterizer(i, s, opt));
+      if (!detector->init(calibration_file, doutput))
+      {
+        continue;
+      }
+      input.chain->SetBranchAddress(s == 0 ? "RAW Event J5" : "RAW Event J7", &detector->raw_event, &detector->RAW);
+      input.sides.push_back(std::move(detector));
+    }
+    if (input.sides.empty())
+    {
+      continue;
+    }
+    if (input.sides.size() == 2)
+    {
+      input.correlation.h2D_Cog = h2D_Cog[i];
+      input.correlation.charge_matching = charge_matching;
+      input.correlation.max_asymmetry = max_charge_asymmetry;
+    }
+    entries = std::max(entries, input.entries);
+    boards.push_back(std::move(input));
+  }
+
+  // Loop over events
+  int perc = 0; // percentage of processed events
+
+  std::cout << "\n===========================================================" << std::endl;
+  std::cout << "\nProcessing " << entries << " entries, starting from event " << first_event << std::endl;
+
+  if (nthreads <= 0)
   {
-    doutput = foutput->mkdir("histos");
-    doutput->cd();
-    clusterize_detector(0, 0, minADC_h, maxADC_h, minStrip, maxStrip,
-                        newDAQ, first_event, NChannels, verb, dynped,
-                        invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
-                        symmetric, symmetricwidth,
-                        sensor_pitch,
-                        version == 2023,
-                        input_files,
-                        nevents,
-                        calibration_file);
+    nthreads = thread_pool::default_threads();
+  }
+  if (nthreads > 1 && verb)
+  {
+    std::cout << "Parallel event loop not available in verbose mode, using one thread" << std::endl;
+    nthreads = 1;
+  }
+
+  if (nthreads > 1)
+  {
+    ROOT::EnableThreadSafety();
+    clusterize_parallel(boards, first_event, entries, nthreads, range_events, newDAQ, dynped, input_files);
   }
   else
   {
-    for (int i = 0; i < detectors / 2; i++)
+    for (int index_event = first_event; index_event < entries; index_event++) // looping on the events
     {
-      std::cout << "Creating output directory " << i << std::endl;
-      doutput = foutput->mkdir((TString) "board_" + i + "_side_0");
-      doutput->cd();
-      clusterize_detector(i, 0, minADC_h, maxADC_h, minStrip, maxStrip,
-                          newDAQ, first_event, NChannels, verb, dynped,
-                          invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
-                          symmetric, symmetricwidth,
-                          sensor_pitch,
-                          version == 2023,
-                          input_files,
-                          nevents,
-                          calibration_file);
-
-      doutput = foutput->mkdir((TString) "board_" + i + "_side_1");
-      doutput->cd();
-      clusterize_detector(i, 1, minADC_h, maxADC_h, minStrip, maxStrip,
-                          newDAQ, first_event, NChannels, verb, dynped,
-                          invert, maxCN, cntype, NVas, highthreshold, lowthreshold, absolute,
-                          symmetric, symmetricwidth,
-                          sensor_pitch,
-                          version == 2023,
-                          input_files,
-                          nevents,
-                          calibration_file);
-
-      // Fill 2D Beam Profile Histos
-      TTreeReader j5Reader((TString)"board_" + i + "_side_0/t_clusters_board_" + i + "_side_0", foutput);
-      TTreeReaderValue<std::vector<cluster>> j5Clusters(j5Reader, "clusters");
-      TTreeReader j7Reader((TString)"board_" + i + "_side_1/t_clusters_board_" + i + "_side_1", foutput);
-      TTreeReaderValue<std::vector<cluster>> j7Clusters(j7Reader, "clusters");
-
-      while (j5Reader.Next())
+      if (verb)
+      {
+        std::cout << std::endl;
+        std::cout << "EVENT: " << index_event << std::endl;
+      }
+      print_progress(index_event, entries, perc);
+      INSTRUMENT_EVENTS(1);
+
+      for (board_input &input : boards)
       {
-        j7Reader.Next();
-        for (int j = 0; j < (*j5Clusters).size(); j++)
+        if (index_event >= input.entries)
+        {
+          continue;
+        }
+        INSTRUMENT_LAP(lap);
+        input.chain->GetEntry(index_event); // both sides of the board at once
+        INSTRUMENT_STAGE(lap, "read");
+        for (auto &detector : input.sides)
         {
-          for (int k = 0; k < (*j7Clusters).size(); k++)
+          if (dynped)
           {
-            h2D_Cog[i]->Fill(GetClusterCOG((*j5Clusters)[j]), GetClusterCOG((*j7Clusters)[k]));
+            detector->track_pedestals(index_event, *detector->raw_event);
           }
+          detector->process(index_event);
         }
+        correlate_event(input, index_event);
       }
     }
   }
 
+  for (board_input &input : boards)
+  {
+    for (auto &detector : input.sides)
+    {
+      detector->finish();
+    }
+  }
+
   // Write 2D Beam Profile Histos
   foutput->cd();
   for (int i = 0; i < detectors/2; i++)
@@ -12,9 +12,12 @@
 
 #include <CLI/CLI.hpp>
 #include "event.h"
+#include "detector_profile.h"
+#include "instrument.h"
 
 int main(int argc, char *argv[])
 {
+  INSTRUMENT_PROGRAM("raw_cn");
   bool verb = false;
 
   float meanCN = 0;
@@ -35,7 +38,7 @@ int main(int argc, char *argv[])
   app.set_help_all_flag("--help-all", "Show all help");
 
   app.add_flag("-v,--verbose", verb, "Verbose");
-  app.add_option("--version", version, "1212 (6VA miniTRB), 1313 (10VA miniTRB), 2020 (PAPERO)")
+  app.add_option("--version", version, "DAQ board version: 1212 (6VA miniTRB), 1313 (10VA miniTRB), 2020 (PAPERO), 2021-2025 (see detector_profile.h)")
       ->required();
   app.add_option("--output", output, "Output ROOT file")->required();
   app.add_option("--calibration", calibration, "Calibration file")->required();
@@ -45,20 +48,16 @@ int main(int argc, char *argv[])
 
   CLI11_PARSE(app, argc, argv);
 
-  if (version == 1212)
+  const detector_profile *profile = find_detector_profile(version);
+  if (!profile)
   {
-    NChannels = 384;
-    NVas = 6;
-  }
-  else if (version == 1313)
-  {
-    NChannels = 640;
-    NVas = 10;
+    std::cerr << "ERROR: invalid miniTRB version\n";
+    return 2;
   }
-  else if (version == 2020)
+  NChannels = profile->NChannels;
+  NVas = profile->NVas;
+  if (profile->newDAQ)
   {
-    NChannels = 640;
-    NVas = 10;
     if (!app.get_option("--board")->count())
     {
       std::cerr << "ERROR: no board number provided\n";
@@ -70,11 +69,6 @@ int main(int argc, char *argv[])
       return 2;
     }
   }
-  else
-  {
-    std::cerr << "ERROR: invalid miniTRB version\n";
-    return 2;
-  }
 
   int minStrip = 0;
   int maxStrip = NChannels - 1;
@@ -150,9 +144,13 @@ int main(int argc, char *argv[])
   }
 
   int perc = 0;
+  event_cn ecn; // common noise of the current event, memory reused for all the events
   for (int index_event = 0; index_event < entries; index_event++)
   {
+    INSTRUMENT_LAP(lap);
     chain->GetEntry(index_event);
+    INSTRUMENT_STAGE(lap, "read");
+    INSTRUMENT_EVENTS(1);
 
     if (verb)
     {
@@ -190,24 +188,24 @@ int main(int argc, char *argv[])
         std::cout << "Error: event " << index_event << " is not complete, skipping it" << std::endl;
       continue;
     }
+    INSTRUMENT_STAGE(lap, "pedestals");
+
+    GetEventCN(ecn, signal); // the three algorithms on every VA at once
+    INSTRUMENT_STAGE(lap, "common noise");
 
     meanCN = 0;
-#pragma omp parallel for
     for (int va = 0; va < NVas; va++)
     {
-      float cn = GetCN(&signal, va, 0);
+      float cn = ecn.cn[0][va];
       if (cn != -999)
       {
-#pragma omp critical
-        {
-          meanCN += cn;
-          if (cn < mincn)
-            mincn = cn;
-          else if (cn > maxcn)
-            maxcn = cn;
-          hCommonNoise0->Fill(cn);
-          hCommonNoise0VsVA->Fill(cn, va);
-        }
+        meanCN += cn;
+        if (cn < mincn)
+          mincn = cn;
+        else if (cn > maxcn)
+          maxcn = cn;
+        hCommonNoise0->Fill(cn);
+        hCommonNoise0VsVA->Fill(cn, va);
       }
     }
     meanCN = meanCN / NVas;
@@ -216,7 +214,7 @@ int main(int argc, char *argv[])
     meanCN = 0;
     for (int va = 0; va < NVas; va++)
     {
-      float cn = GetCN(&signal, va, 1);
+      float cn = ecn.cn[1][va];
       if (cn != -999)
       {
         meanCN += cn;
@@ -234,7 +232,7 @@ int main(int argc, char *argv[])
     meanCN = 0;
     for (int va = 0; va < NVas; va++)
     {
-      float cn = GetCN(&signal, va, 2);
+      float cn = ecn.cn[2][va];
       if (cn != -999)
       {
         meanCN += cn;
@@ -249,8 +247,10 @@ int main(int argc, char *argv[])
     meanCN = meanCN / NVas;
     common_noise_2->SetPoint(common_noise_2->GetN(), index_event, meanCN);
     meanCN = 0;
+    INSTRUMENT_STAGE(lap, "histograms");
   }
 
+  INSTRUMENT_LAP(write);
   hCommonNoise0->Write();
   hCommonNoise1->Write();
   hCommonNoise2->Write();
@@ -263,6 +263,7 @@ int main(int argc, char *argv[])
   common_noise_2->Write();
 
   foutput->Close();
+  INSTRUMENT_STAGE(write, "write");
 
   std::cout << "Min CN: " << mincn << " Max CN: " << maxcn << std::endl;
   return 0;
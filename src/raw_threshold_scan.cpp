@@ -7,6 +7,7 @@
 #include <iomanip>
 
 #include "event.h"
+#include "detector_profile.h"
 #include <CLI/CLI.hpp>
 
 #define verbose false
@@ -39,7 +40,7 @@ int main(int argc, char *argv[])
   std::vector<std::string> inputs;
 
   app.add_flag("-v,--verbose", verb, "Verbose output");
-  app.add_option("--version", version, "1212 (6VA miniTRB), 1313 (10VA miniTRB), 2020 (PAPERO)")->required();
+  app.add_option("--version", version, "DAQ board version: 1212 (6VA miniTRB), 1313 (10VA miniTRB), 2020 (PAPERO), 2021-2025 (see detector_profile.h)")->required();
   app.add_option("--calibration", calibration, "Calibration file")->required();
   app.add_option("--output", output_filename, "Output ROOT file");
   app.add_option("--minlow", low_min, "Minimum low threshold");
@@ -61,54 +62,20 @@ int main(int argc, char *argv[])
     return 2;
   }
 
-  if (version == 1212) // original DaMPE miniTRB system
+  const detector_profile *profile = find_detector_profile(version);
+  if (!profile)
   {
-    NChannels = 384;
-    NVas = 6;
-    minStrip = 0;
-    maxStrip = 383;
-  }
-  else if (version == 1313) // modded DaMPE miniTRB system for the first FOOT prototype
-  {
-    NChannels = 640;
-    NVas = 10;
-    minStrip = 0;
-    maxStrip = 639;
+    std::cout << "ERROR: invalid DAQ board version" << std::endl;
+    return 2;
   }
-  else if (version == 2020) // FOOT ADC boards + DE10Nano
+  NChannels = profile->NChannels;
+  NVas = profile->NVas;
+  minStrip = profile->minStrip;
+  maxStrip = profile->maxStrip;
+  if (profile->newDAQ)
   {
-    NChannels = 640;
-    NVas = 10;
-    minStrip = 0;
-    maxStrip = 639;
     newDAQ = true;
   }
-  else if (version == 2021) // PAN StripX
-  {
-    NChannels = 2048;
-    NVas = 32;
-    minStrip = 0;
-    maxStrip = 2047;
-  }
-  else if (version == 2022) // PAN StripY
-  {
-    NChannels = 128;
-    NVas = 1;
-    minStrip = 0;
-    maxStrip = 127;
-  }
-  else if (version == 2023) // AMSL0
-  {
-    NChannels = 1024;
-    NVas = 16;
-    minStrip = 0;
-    maxStrip = 1023;
-  }
-  else
-  {
-    std::cout << "ERROR: invalid DAQ board version" << std::endl;
-    return 2;
-  }
 
   if (!calibration.empty())
     std::cout << "Calibration file: " << calibration << std::endl;
@@ -178,6 +145,8 @@ int main(int argc, char *argv[])
   while (high_min <= high_max)
   {
     int binLow = 1;
+    cluster_arena arena; // clusters of the current event, memory reused for all the events
+    event_cn ecn;        // common noise of the current event
 
     while (low_min <= low_max && low_min <= high_min)
     {
@@ -226,11 +195,14 @@ int main(int argc, char *argv[])
 
         std::vector<float> signal2(signal.size());
 
+        GetEventCN(ecn, signal);
+
         for (size_t i = 0; i < signal.size(); i++)
         {
-          if (GetCN(&signal, i / 64, commonNoiseType))
+          float cn = ecn.get(i / 64, commonNoiseType);
+          if (cn)
           {
-            signal2.at(i) = signal.at(i) - GetCN(&signal, i / 64, commonNoiseType);
+            signal2.at(i) = signal.at(i) - cn;
           }
           else
           {
@@ -238,27 +210,23 @@ int main(int argc, char *argv[])
           }
         }
 
-        try
+        if (clusterize_event(arena, &cal, &signal2, high_min, low_min, 0, 0, absolute, 0, 0, false) == CLUSTERIZE_overflow)
         {
-          std::vector<cluster> result = clusterize_event(&cal, &signal2, high_min, low_min, 0, 0, absolute, 0, 0, false);
-
-          for (int i = 0; i < result.size(); i++)
+          if (verbose)
           {
-            if (i == 0)
-            {
-              hNclus->Fill(result.size());
-            }
-
-            hNstrip->Fill(GetClusterWidth(result.at(i)));
+            std::cerr << "Too many seeds, skipping event " << index_event << std::endl;
           }
+          continue;
         }
-        catch (const char *msg)
+
+        for (size_t i = 0; i < arena.size(); i++)
         {
-          if (verbose)
+          if (i == 0)
           {
-            std::cerr << msg << "Skipping event " << index_event << std::endl;
+            hNclus->Fill(arena.size());
           }
-          continue;
+
+          hNstrip->Fill(arena.width[i]);
         }
       }
       float mean_nclus = hNclus->GetMean();
@@ -0,0 +1,298 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+  double normal_pdf(double x) { return std::exp(-0.5 * x * x) / std::sqrt(2 * M_PI); }
+  double normal_cdf(double x) { return 0.5 * std::erfc(-x / std::sqrt(2)); }
+
+  struct window_moments
+  {
+    double sumw = 0;
+    double mean = 0;
+    double var = 0;
+    double low = 0;  // effective truncation points: half way between the last
+    double high = 0; // bin with entries inside the window and the first one outside
+    double spacing = 0; // smallest distance between two bins with entries (1 ADC for raw data)
+    bool low_cut = false;
+    bool high_cut = false;
+  };
+
+  window_moments moments_in_window(const double *content, int nbins, double xmin, double width,
+                                   double low, double high)
+  {
+    window_moments m;
+    double sumx = 0;
+    double sumx2 = 0;
+    int first = -1;
+    int last = -1;
+
+    for (int bin = 0; bin < nbins; bin++)
+    {
+      if (content[bin] <= 0)
+      {
+        continue;
+      }
+      double x = xmin + (bin + 0.5) * width;
+      if (x < low || x > high)
+      {
+        continue;
+      }
+      if (first < 0)
+      {
+        first = bin;
+      }
+      else if (m.spacing == 0 || (bin - last) * width < m.spacing)
+      {
+        m.spacing = (bin - last) * width;
+      }
+      last = bin;
+      m.sumw += content[bin];
+      sumx += content[bin] * x;
+      sumx2 += content[bin] * x * x;
+    }
+
+    if (m.sumw <= 0)
+    {
+      return m;
+    }
+
+    m.mean = sumx / m.sumw;
+    m.var = std::max(sumx2 / m.sumw - m.mean * m.mean, 0.);
+
+    // ADC data are integers: with fine bins most of them are empty, so the truncation
+    // happens between two filled bins and not at the window edge
+    m.low = xmin + first * width;
+    for (int bin = first - 1; bin >= 0; bin--)
+    {
+      if (content[bin] > 0)
+      {
+        m.low = 0.5 * (xmin + (bin + 0.5) * width + xmin + (first + 0.5) * width);
+        m.low_cut = true;
+        break;
+      }
+    }
+    m.high = xmin + (last + 1) * width;
+    for (int bin = last + 1; bin < nbins; bin++)
+    {
+      if (content[bin] > 0)
+      {
+        m.high = 0.5 * (xmin + (bin + 0.5) * width + xmin + (last + 0.5) * width);
+        m.high_cut = true;
+        break;
+      }
+    }
+    return m;
+  }
+}
+
+gauss_estimate truncated_gauss(const double *content, int nbins, double xmin, double xmax,
+                               double nsigma, int max_iterations)
+{
+  gauss_estimate est;
+  double width = (xmax - xmin) / nbins;
+
+  window_moments m = moments_in_window(content, nbins, xmin, width, xmin, xmax);
+  double total = m.sumw;
+  if (total <= 0)
+  {
+    return est;
+  }
+
+  if (m.var == 0) // all the entries in one bin: nothing a fit could do better
+  {
+    est.mean = m.mean;
+    est.entries = total;
+    est.gaussian = true;
+    return est;
+  }
+
+  // starting point: median and interquartile range, not pulled by signals in the tails.
+  // Moments of the whole histogram if the quartiles fall in the same bin
+  double mean = hist_quantile(content, nbins, xmin, xmax, 0.5);
+  double sigma = (hist_quantile(content, nbins, xmin, xmax, 0.75) - hist_quantile(content, nbins, xmin, xmax, 0.25)) / 1.349;
+  if (sigma < width)
+  {
+    mean = m.mean;
+    sigma = std::sqrt(m.var);
+  }
+
+  bool converged = false;
+  for (est.iterations = 1; est.iterations <= max_iterations; est.iterations++)
+  {
+    m = moments_in_window(content, nbins, xmin, width, mean - nsigma * sigma, mean + nsigma * sigma);
+    if (m.sumw <= 0)
+    {
+      break;
+    }
+
+    // moments of a normal distribution truncated in [low, high]: solve for the untruncated ones
+    double alpha = m.low_cut ? (m.low - mean) / sigma : -INFINITY;
+    double beta = m.high_cut ? (m.high - mean) / sigma : INFINITY;
+    double pdf_a = std::isinf(alpha) ? 0 : normal_pdf(alpha);
+    double pdf_b = std::isinf(beta) ? 0 : normal_pdf(beta);
+    double z = normal_cdf(beta) - normal_cdf(alpha);
+    if (z <= 0)
+    {
+      break;
+    }
+    double shift = (pdf_a - pdf_b) / z;
+    double var_factor = 1 + ((std::isinf(alpha) ? 0 : alpha * pdf_a) - (std::isinf(beta) ? 0 : beta * pdf_b)) / z - shift * shift;
+    if (var_factor <= 0)
+    {
+      break;
+    }
+
+    double new_sigma = std::sqrt(m.var / var_factor);
+    double new_mean = m.mean - new_sigma * shift;
+
+    bool stable = std::abs(new_mean - mean) < 1e-4 * sigma && std::abs(new_sigma - sigma) < 1e-4 * sigma;
+    mean = new_mean;
+    sigma = new_sigma;
+    est.entries = m.sumw;
+    if (stable || sigma == 0)
+    {
+      converged = true;
+      break;
+    }
+  }
+
+  est.mean = mean;
+  est.sigma = sigma;
+  if (!converged || sigma == 0)
+  {
+    return est;
+  }
+
+  // shape checks: population of the tails and of the core compared to a normal distribution
+  est.tails = 1 - est.entries / total;
+
+  double p_tails = 2 * normal_cdf(-nsigma);
+  bool heavy_tails = est.tails > 2 * p_tails + 3 * std::sqrt(p_tails / total);
+
+  bool bad_core = false;
+  if (sigma > 2 * m.spacing) // the core test is meaningless when the noise is comparable to the ADC step
+  {
+    double core = moments_in_window(content, nbins, xmin, width, mean - sigma, mean + sigma).sumw;
+    double p_core = (1 - 2 * normal_cdf(-1)) / (1 - p_tails);
+    bad_core = std::abs(core / est.entries - p_core) > 0.05 + 3 * std::sqrt(p_core * (1 - p_core) / est.entries);
+  }
+
+  est.gaussian = !heavy_tails && !bad_core;
+  return est;
+}
+
+double median_inplace(float *first, float *last)
+{
+  size_t n = last - first;
+  if (n == 0)
+  {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+
+  float *mid = first + n / 2;
+  std::nth_element(first, mid, last);
+  if (n % 2)
+  {
+    return *mid;
+  }
+  // the lower central value is the largest one of the lower half, already partitioned
+  return 0.5 * (*mid + *std::max_element(first, mid));
+}
+
+double mad_inplace(float *first, float *last, double median)
+{
+  for (float *x = first; x != last; x++)
+  {
+    *x = std::abs(*x - median);
+  }
+  return median_inplace(first, last);
+}
+
+robust_summary summarize(const float *data, size_t n)
+{
+  robust_summary s;
+  s.n = n;
+  if (n == 0)
+  {
+    s.mean = s.rms = s.median = s.mad = std::numeric_limits<double>::quiet_NaN();
+    return s;
+  }
+
+  double sum = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    sum += data[i];
+  }
+  s.mean = sum / n;
+
+  double sum2 = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    sum2 += (data[i] - s.mean) * (data[i] - s.mean);
+  }
+  s.rms = n > 1 ? std::sqrt(sum2 / (n - 1)) : 0;
+
+  std::vector<float> scratch(data, data + n);
+  s.median = median_inplace(scratch.data(), scratch.data() + n);
+  s.mad = mad_inplace(scratch.data(), scratch.data() + n, s.median);
+  return s;
+}
+
+std::vector<robust_summary> summarize_groups(const float *data, const char *valid, size_t n, size_t group_size)
+{
+  std::vector<robust_summary> groups;
+  std::vector<float> selected;
+  selected.reserve(group_size);
+
+  for (size_t first = 0; first < n; first += group_size)
+  {
+    size_t last = std::min(first + group_size, n);
+    selected.clear();
+    for (size_t i = first; i < last; i++)
+    {
+      if (!valid || valid[i])
+      {
+        selected.push_back(data[i]);
+      }
+    }
+    groups.push_back(summarize(selected.data(), selected.size()));
+  }
+  return groups;
+}
+
+double hist_quantile(const double *content, int nbins, double xmin, double xmax, double q)
+{
+  double total = 0;
+  for (int bin = 0; bin < nbins; bin++)
+  {
+    total += std::max(content[bin], 0.);
+  }
+  if (total <= 0)
+  {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+
+  double width = (xmax - xmin) / nbins;
+  double target = std::min(std::max(q, 0.), 1.) * total;
+  double cumulative = 0;
+  int last_filled = 0;
+  for (int bin = 0; bin < nbins; bin++)
+  {
+    double c = std::max(content[bin], 0.);
+    if (c == 0)
+    {
+      continue;
+    }
+    if (cumulative + c >= target)
+    {
+      return xmin + (bin + (target - cumulative) / c) * width;
+    }
+    cumulative += c;
+    last_filled = bin;
+  }
+  return xmin + (last_filled + 1) * width;
+}
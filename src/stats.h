@@ -0,0 +1,52 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <cstddef>
+#include <vector>
+
+// Statistics kernels for calibration: no ROOT dependency, safe to call from several threads
+
+struct gauss_estimate
+{
+  double mean = 0;       // gaussian mean
+  double sigma = 0;      // gaussian sigma, corrected for the truncation
+  double entries = 0;    // entries inside the final window
+  double tails = 0;      // fraction of entries outside the final window
+  int iterations = 0;    // number of clipping iterations done
+  bool gaussian = false; // false if the shape does not look gaussian (converge failed, heavy tails, flat top...)
+}; // result of the truncated gaussian estimator
+
+// Iterative truncated gaussian estimator on binned data (nbins bins between xmin and xmax, no under/overflow):
+// mean and sigma are recomputed from the entries within +-nsigma until they converge, correcting the clipped
+// moments for the truncation of a normal distribution. Gives fit-quality pedestals and noise without Minuit
+gauss_estimate truncated_gauss(const double *content, int nbins, double xmin, double xmax,
+                               double nsigma = 2.5, int max_iterations = 20);
+
+struct robust_summary
+{
+  double mean = 0;
+  double rms = 0; // sample standard deviation, like TMath::RMS
+  double median = 0;
+  double mad = 0; // median absolute deviation from the median
+  size_t n = 0;
+}; // location and spread of a set of values, NaN when there are none
+
+// Median of [first, last) with nth_element (average of the two central values for even sizes, like
+// TMath::Median). The range is reordered
+double median_inplace(float *first, float *last);
+
+// Median absolute deviation of [first, last) around median. The values are overwritten with the deviations
+double mad_inplace(float *first, float *last, double median);
+
+// Mean, RMS, median and MAD of n values with a single scratch copy
+robust_summary summarize(const float *data, size_t n);
+
+// summarize() of consecutive groups of group_size values (e.g. the channels of each VA),
+// skipping the values with valid[i] == 0 (valid can be nullptr)
+std::vector<robust_summary> summarize_groups(const float *data, const char *valid, size_t n, size_t group_size);
+
+// q-quantile (0 <= q <= 1) of binned data, interpolating linearly inside the bin: for integer ADC data
+// each value is spread over its unit bin, which gives a continuous quantile without sorting any sample
+double hist_quantile(const double *content, int nbins, double xmin, double xmax, double q);
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed size pool of worker threads: tasks are run in submission order by the first free worker
+
+class thread_pool
+{
+public:
+  explicit thread_pool(unsigned nthreads)
+  {
+    if (nthreads == 0)
+    {
+      nthreads = 1;
+    }
+    for (unsigned i = 0; i < nthreads; i++)
+    {
+      workers.emplace_back([this]
+                           { work(); });
+    }
+  }
+
+  ~thread_pool() // waits for all the queued tasks to be done
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cond.notify_all();
+    for (auto &w : workers)
+    {
+      w.join();
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  unsigned size() const { return workers.size(); }
+
+  template <typename F>
+  auto submit(F f) -> std::future<decltype(f())>
+  {
+    auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+    auto result = task->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace([task]
+                    { (*task)(); });
+    }
+    cond.notify_one();
+    return result;
+  }
+
+  static unsigned default_threads()
+  {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+  }
+
+private:
+  void work()
+  {
+    while (true)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this]
+                  { return stop || !tasks.empty(); });
+        if (stop && tasks.empty())
+        {
+          return;
+        }
+        task = std::move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable cond;
+  bool stop = false;
+};
+
+#endif